@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buzzer.h"
+#include "metrics.h"
+
+struct buzzer_priv {
+	struct gpio_out		*pin;
+	struct buzzer_note	queue[BUZZER_QUEUE];
+	unsigned		head, tail;
+	int			half;		// usec, 0 in a rest
+	int			active;		// line level of the wave
+	int			precise;	// spin for the edges
+	struct timespec		edge, note_end;
+	atomic_int		tone;
+	atomic_int		late, late_max;
+};
+
+static const struct buzzer_note buzzer_distance[] = { { 2400, 60 }, { 0, 40 }, { 2400, 60 } };
+static const struct buzzer_note buzzer_lease[] = { { 880, 150 }, { 660, 150 }, { 440, 300 } };
+static const struct buzzer_note buzzer_connect[] = { { 660, 70 }, { 990, 110 } };
+static const struct buzzer_note buzzer_release[] = { { 990, 70 }, { 660, 110 } };
+
+static const struct {
+	const struct buzzer_note	*notes;
+	int				cnt;
+} buzzer_alerts[BUZZER_ALERTS] = {
+	[BUZZER_ALERT_DISTANCE]	= { buzzer_distance, 3 },
+	[BUZZER_ALERT_LEASE]	= { buzzer_lease, 3 },
+	[BUZZER_ALERT_CONNECT]	= { buzzer_connect, 2 },
+	[BUZZER_ALERT_RELEASE]	= { buzzer_release, 2 },
+};
+
+// the buzzer is active low
+static void buzzer_line(struct buzzer_priv *priv, int active)
+{
+	priv->active = active;
+	gpio_out_set(priv->pin, !active);
+}
+
+static void buzzer_silence(struct device *dev, struct buzzer_priv *priv)
+{
+	buzzer_line(priv, 0);
+	priv->half = 0;
+	device_set_precise(dev, 0);
+	atomic_store_explicit(&priv->tone, 0, memory_order_relaxed);
+	dev->state = DEV_STATE_STOPPED;
+}
+
+static void buzzer_schedule(struct device *dev, struct buzzer_priv *priv)
+{
+	if ((priv->half != 0) && (device_timespec_cmp(&priv->edge, &priv->note_end) < 0))
+		dev->next_action = priv->edge;
+	else
+		dev->next_action = priv->note_end;
+}
+
+static void buzzer_next(struct device *dev, struct buzzer_priv *priv, struct timespec *ts)
+{
+	struct buzzer_note *note;
+
+	if (priv->head == priv->tail) {
+		buzzer_silence(dev, priv);
+		return;
+	}
+	note = &priv->queue[priv->tail++ & (BUZZER_QUEUE - 1)];
+	device_timespec_update(&priv->note_end, ts, note->duration * 1000);
+
+	if (note->freq == 0) {
+		priv->half = 0;
+		buzzer_line(priv, 0);
+		device_set_precise(dev, 0);
+	} else {
+		priv->half = 500000 / note->freq;
+		buzzer_line(priv, 1);
+		device_timespec_update(&priv->edge, ts, priv->half);
+		// a half period of a few hundred usec needs the spinning wait
+		device_set_precise(dev, priv->precise);
+	}
+	atomic_store_explicit(&priv->tone, note->freq, memory_order_relaxed);
+	buzzer_schedule(dev, priv);
+}
+
+static int buzzer_start_request(struct device *dev)
+{
+	if (dev->state != DEV_STATE_STOPPED)
+		return -EINVAL;
+	dev->state = DEV_STATE_STARTING;
+	return 0;
+}
+
+static void buzzer_timer_action(struct device *dev, struct timespec *ts)
+{
+	struct buzzer_priv *priv = dev->priv;
+	int late;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return;
+	if (dev->state == DEV_STATE_STOPPING) {
+		priv->tail = priv->head;
+		buzzer_silence(dev, priv);
+		return;
+	}
+	if ((dev->state == DEV_STATE_STARTING) || (device_timespec_cmp(ts, &priv->note_end) >= 0)) {
+		dev->state = DEV_STATE_STARTED;
+		buzzer_next(dev, priv, ts);
+		return;
+	}
+	if (priv->half == 0) {
+		buzzer_schedule(dev, priv);
+		return;
+	}
+
+	buzzer_line(priv, !priv->active);
+	late = device_timespec_diff(ts, &priv->edge);
+	atomic_store_explicit(&priv->late, late, memory_order_relaxed);
+	if (late > atomic_load_explicit(&priv->late_max, memory_order_relaxed))
+		atomic_store_explicit(&priv->late_max, late, memory_order_relaxed);
+	metrics_add(METRICS_BUZZER_EDGES, 1);
+
+	// edges are anchored to each other, resync if a whole half period was lost
+	device_timespec_update(&priv->edge, &priv->edge, priv->half);
+	if (device_timespec_cmp(&priv->edge, ts) < 0)
+		device_timespec_update(&priv->edge, ts, priv->half);
+	buzzer_schedule(dev, priv);
+}
+
+static void buzzer_destroy_priv(struct device *dev)
+{
+	struct buzzer_priv *priv = dev->priv;
+
+	buzzer_line(priv, 0);
+	free(priv);
+}
+
+static struct device_ops buzzer_ops = {
+	.start_request	= buzzer_start_request,
+	.stop_request	= device_stop_request,
+	.timer_action	= buzzer_timer_action,
+	.destroy_priv	= buzzer_destroy_priv,
+};
+
+int buzzer_init(struct device *dev, struct gpio_out *pin, int precise)
+{
+	struct buzzer_priv *priv;
+	int ret;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -errno;
+	memset(priv, 0, sizeof(*priv));
+	priv->pin = pin;
+	priv->precise = precise;
+	atomic_init(&priv->tone, 0);
+	atomic_init(&priv->late, 0);
+	atomic_init(&priv->late_max, 0);
+
+	ret = device_initialize(dev, "buzzer", &buzzer_ops, priv);
+	if (ret != 0) {
+		free(priv);
+		return ret;
+	}
+	buzzer_line(priv, 0);
+	return 0;
+}
+
+int buzzer_play(struct device *dev, const struct buzzer_note *notes, int cnt)
+{
+	struct buzzer_priv *priv = dev->priv;
+	struct buzzer_note *note;
+	int i;
+
+	// a held line is not a tone, the melody takes over
+	if ((dev->state == DEV_STATE_STOPPED) && priv->active)
+		buzzer_line(priv, 0);
+
+	for (i = 0; (i < cnt) && (priv->head - priv->tail < BUZZER_QUEUE); i++) {
+		note = &priv->queue[priv->head++ & (BUZZER_QUEUE - 1)];
+		*note = notes[i];
+		if ((note->freq != 0) && (note->freq < BUZZER_FREQ_MIN))
+			note->freq = BUZZER_FREQ_MIN;
+		if (note->freq > BUZZER_FREQ_MAX)
+			note->freq = BUZZER_FREQ_MAX;
+		if (note->duration < 0)
+			note->duration = 0;
+	}
+	if ((i > 0) && (dev->state == DEV_STATE_STOPPED))
+		dev->state = DEV_STATE_STARTING;
+	return i;
+}
+
+void buzzer_alert(struct device *dev, enum buzzer_alert alert)
+{
+	if ((alert < 0) || (alert >= BUZZER_ALERTS) || (dev->state != DEV_STATE_STOPPED))
+		return;
+	buzzer_play(dev, buzzer_alerts[alert].notes, buzzer_alerts[alert].cnt);
+}
+
+void buzzer_set(struct device *dev, int on)
+{
+	struct buzzer_priv *priv = dev->priv;
+
+	priv->tail = priv->head;
+	buzzer_silence(dev, priv);
+	buzzer_line(priv, on);
+	atomic_store_explicit(&priv->tone, on ? -1 : 0, memory_order_relaxed);
+}
+
+int buzzer_get_tone(struct device *dev)
+{
+	struct buzzer_priv *priv = dev->priv;
+
+	return atomic_load_explicit(&priv->tone, memory_order_relaxed);
+}
+
+void buzzer_edge_late(struct device *dev, int *last, int *max)
+{
+	struct buzzer_priv *priv = dev->priv;
+
+	*last = atomic_load_explicit(&priv->late, memory_order_relaxed);
+	*max = atomic_load_explicit(&priv->late_max, memory_order_relaxed);
+}
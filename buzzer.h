@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __BUZZER_H__
+#define __BUZZER_H__
+
+#include "device.h"
+#include "gpio-out.h"
+
+#define BUZZER_QUEUE		32	// notes, must be a power of 2
+#define BUZZER_FREQ_MIN		20	// Hz
+#define BUZZER_FREQ_MAX		8000	// Hz, 62 usec half period
+
+struct buzzer_note {
+	int	freq;		// Hz, 0 is a rest
+	int	duration;	// msec
+};
+
+enum buzzer_alert {
+	BUZZER_ALERT_DISTANCE,	// the collision reflex stepped in
+	BUZZER_ALERT_LEASE,	// the controller went silent
+	BUZZER_ALERT_CONNECT,	// a controller took the tank
+	BUZZER_ALERT_RELEASE,	// and left it
+	BUZZER_ALERTS
+};
+
+/*
+ * Square wave tone on the buzzer line, active low. Every half period is
+ * a wakeup anchored to the previous edge, so the pitch does not drift
+ * with the loop latency; rests and the silence between melodies need no
+ * precise wakeups at all. With precise set the edges are on time but the
+ * loop spins through most of every half period while a tone plays,
+ * without it an edge is a sleep wakeup late and costs about 1% CPU per
+ * kHz. Notes are queued, the loop thread only.
+ */
+int  buzzer_init(struct device *dev, struct gpio_out *pin, int precise);
+
+// returns the number of notes queued, a full queue drops the rest
+int  buzzer_play(struct device *dev, const struct buzzer_note *notes, int cnt);
+
+// plays the alert melody unless another one is playing, so alerts never pile up
+void buzzer_alert(struct device *dev, enum buzzer_alert alert);
+
+// plain line level, as the old toggle: stops the melody
+void buzzer_set(struct device *dev, int on);
+
+// any thread: tone playing (Hz), -1 for a held line, 0 if silent
+int  buzzer_get_tone(struct device *dev);
+
+// any thread: usec edges came after their time, last and max since the start
+void buzzer_edge_late(struct device *dev, int *last, int *max);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef CLIENT_SERVER_H
 #define CLIENT_SERVER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define HELLO_SERVER "hochu pogonyat"
@@ -10,18 +11,150 @@ struct tank_srv_info {
     int16_t right_speed, left_speed, sonic_distance;
     char sonik_servo_angle, camera_servo1_angle, camera_servo2_angle;
     char red, green, blue, buzzer;
+    uint32_t ts_sec, ts_usec;	// server clock when the frame was built
+    uint16_t macro_id;		// last sequence
+    uint8_t macro_step;		// its steps applied so far
+    char macro_state;		// TANK_MACRO_IDLE, RUNNING, DONE or CANCELLED
+    char reflex;		// TANK_REFLEX_*
+    char reserved;
+    int16_t range_distance;	// cm predicted between the sonic samples, -1 if unknown
+    int16_t range_closing;	// cm/s, positive when approaching
+    int16_t pose_x, pose_y;	// cm from the map centre, dead reckoned
+    int16_t pose_heading;	// degrees counterclockwise from the start heading
+    int16_t reserved2;
 };
 
 #define TANK_SRV_MSG_TYPE_ALIVE_CHECK	'o'
 #define TANK_SRV_MSG_TYPE_INFO_DATA	'k'
+#define TANK_SRV_MSG_TYPE_ROLE		'r' // answer to TAKE/RELEASE_CONTROL, sent on role change
+#define TANK_SRV_MSG_TYPE_CLOCK		't' // clock probe, answered with TANK_CLNT_CMD_CLOCK
+#define TANK_SRV_MSG_TYPE_TRACE		'x' // latency breakdown of a TANK_CLNT_CMD_TRACED command
+#define TANK_SRV_MSG_TYPE_MACRO		'm' // answer to TANK_CLNT_CMD_MACRO
+#define TANK_SRV_MSG_TYPE_SCAN		'p' // sweep scanner point, sent to TANK_SUB_SCAN subscribers
+#define TANK_SRV_MSG_TYPE_TILE		'g' // occupancy map tile, sent to TANK_SUB_MAP subscribers
+
+#define TANK_SRV_ROLE_CONTROLLER	'C'
+#define TANK_SRV_ROLE_OBSERVER		'O'
+
+/*
+ * First half of an NTP style exchange, t1 is the server clock when the
+ * probe was sent. rtt and offset are the server estimates for this
+ * client from the previous probes (rtt in usec, -1 until known), offset
+ * is client clock minus server clock: offset_sec is rounded down, so
+ * offset_usec is always 0..999999. The clocks count from the boot of
+ * each host, the offset easily exceeds 32 bits of usec.
+ */
+struct tank_srv_clock {
+    uint32_t t1_sec, t1_usec;
+    int32_t rtt;
+    int32_t offset_sec;
+    uint32_t offset_usec;
+};
+
+/*
+ * Server side stages of a traced command: recv is the server clock when
+ * the command was read, the others are usec after the previous stage
+ * (dispatch and apply saturate at 65535). edge is the first PWM frame
+ * with the new setpoint, it is only valid with TANK_TRACE_EDGE set.
+ */
+#define TANK_TRACE_EDGE		0x01
+
+struct tank_srv_trace {
+    uint16_t id;
+    char key;
+    char flags;
+    uint32_t recv_sec, recv_usec;
+    uint16_t dispatch, apply;
+    uint32_t set, edge;
+};
+
+// sequence upload status
+#define TANK_MACRO_ACCEPTED	'A'
+#define TANK_MACRO_INVALID	'I'	// bad setpoint, step count or timing
+#define TANK_MACRO_BUSY		'B'	// the previous upload is not taken yet
+#define TANK_MACRO_OBSERVER	'O'	// only the controller may upload
+
+// sequence state in the telemetry
+#define TANK_MACRO_IDLE		'_'
+#define TANK_MACRO_RUNNING	'R'
+#define TANK_MACRO_DONE		'D'
+#define TANK_MACRO_CANCELLED	'C'
+
+// collision avoidance reflex state in the telemetry
+#define TANK_REFLEX_OFF		'_'	// disabled on the server
+#define TANK_REFLEX_ARMED	'A'
+#define TANK_REFLEX_OVERRIDE	'O'	// switched off by the controller
+#define TANK_REFLEX_CAP		'C'	// forward speed is limited by an obstacle
+#define TANK_REFLEX_STOP	'S'	// stopped in front of an obstacle
+
+struct tank_srv_macro {
+    uint16_t id;
+    char status;
+    char reserved;
+};
+
+/*
+ * One point of the polar range map: angle from the sonic servo default
+ * position (degrees), distance in cm (-1 if there was no echo) and the
+ * server clock of the ping. sweep grows at every end of the arc.
+ */
+struct tank_srv_scan {
+    int8_t angle;
+    char reserved;
+    int16_t distance;
+    uint16_t sweep;
+    uint16_t reserved2;
+    uint32_t ts_sec, ts_usec;
+};
+
+/*
+ * Occupancy map: TANK_MAP_TILES x TANK_MAP_TILES tiles of TANK_MAP_TILE
+ * cells, the start point is the centre of the map, x goes along the
+ * start heading, y to the left of it. Cells are 4 bit signed log-odds
+ * (the server value divided by TANK_MAP_CELL_SCALE): 0 is unknown,
+ * positive is occupied and negative is free. Row major, two cells per
+ * byte, the even cell in the low nibble. Only changed tiles are sent,
+ * a new subscriber gets every tile seen so far.
+ */
+#define TANK_MAP_CELL		5	// cm
+#define TANK_MAP_TILE		16
+#define TANK_MAP_TILES		8
+#define TANK_MAP_CELL_SCALE	16
+
+struct tank_srv_tile {
+    uint8_t tx, ty;
+    uint8_t tiles;		// TANK_MAP_TILES
+    uint8_t cell;		// TANK_MAP_CELL
+    uint8_t cells[TANK_MAP_TILE * TANK_MAP_TILE / 2];
+};
 
 struct tank_srv_msg {
-    char type;		// ALIVE_CHECK or INFO_DATA
+    char type;		// ALIVE_CHECK, INFO_DATA, ROLE, CLOCK, TRACE, MACRO or SCAN
     union {
 	struct tank_srv_info info;
+	char role;
+	struct tank_srv_clock clock;
+	struct tank_srv_trace trace;
+	struct tank_srv_macro macro;
+	struct tank_srv_scan scan;
     };
 };
 
+#define TANK_SRV_MSG_ROLE_SIZE		2
+#define TANK_SRV_MSG_CLOCK_SIZE		(offsetof(struct tank_srv_msg, clock) + sizeof(struct tank_srv_clock))
+#define TANK_SRV_MSG_TRACE_SIZE		(offsetof(struct tank_srv_msg, trace) + sizeof(struct tank_srv_trace))
+#define TANK_SRV_MSG_MACRO_SIZE		(offsetof(struct tank_srv_msg, macro) + sizeof(struct tank_srv_macro))
+#define TANK_SRV_MSG_SCAN_SIZE		(offsetof(struct tank_srv_msg, scan) + sizeof(struct tank_srv_scan))
+
+// tiles are too large for the common union, that would bloat every telemetry frame
+struct tank_srv_msg_tile {
+    char type;			// TILE
+    char reserved[3];
+    struct tank_srv_tile tile;
+};
+
+#define TANK_SRV_MSG_TILE_SIZE		sizeof(struct tank_srv_msg_tile)
+
 //      name				cmd	button
 #define TANK_CLNT_CMD_FORWARD		'w' // "w"
 #define TANK_CLNT_CMD_RIGHT		'a' // "a"
@@ -42,10 +175,120 @@ struct tank_srv_msg {
 #define TANK_CLNT_CMD_BUZZER		'4' // "4"
 #define TANK_CLNT_CMD_SONIC_MOD1	'5' // "5"
 #define TANK_CLNT_CMD_SONIC_MOD0	'6' // "6"
-#define TANK_CLNT_CMD_CONNECT_CHEK	'0'
+#define TANK_CLNT_CMD_CONNECT_CHEK	'0' // alive check reply and control lease heartbeat
+#define TANK_CLNT_CMD_TAKE_CONTROL	'+' // become the controller, all clients are observers after the handshake
+#define TANK_CLNT_CMD_RELEASE_CONTROL	'-'
+#define TANK_CLNT_CMD_TIMED		'@' // struct tank_clnt_timed follows
+#define TANK_CLNT_CMD_CLOCK		'T' // struct tank_clnt_clock follows
+#define TANK_CLNT_CMD_TRACED		'#' // struct tank_clnt_traced follows
+#define TANK_CLNT_CMD_MACRO		'!' // struct tank_clnt_macro and its steps follow
+#define TANK_CLNT_CMD_SUBSCRIBE		'^' // struct tank_clnt_subscribe follows
+
+// a controlling client must send something at least this often (usec)
+#define TANK_CLNT_HEARTBEAT_PERIOD	40000
 
 struct tank_clnt_msg {
     char cmd;
 };
 
+// clock probe answer: t1 echoed, t2 probe receive and t3 answer send time of the client clock
+struct tank_clnt_clock {
+    char cmd;			// TANK_CLNT_CMD_CLOCK
+    char reserved[3];
+    uint32_t t1_sec, t1_usec;
+    uint32_t t2_sec, t2_usec;
+    uint32_t t3_sec, t3_usec;
+};
+
+// key command with a trace id, answered with TANK_SRV_MSG_TYPE_TRACE
+struct tank_clnt_traced {
+    char cmd;			// TANK_CLNT_CMD_TRACED
+    char key;			// TANK_CLNT_CMD_* key command
+    uint16_t id;		// network byte order
+};
+
+// optional streams, observers may subscribe too
+#define TANK_SUB_SCAN		0x01	// TANK_SRV_MSG_TYPE_SCAN points
+#define TANK_SUB_MAP		0x02	// TANK_SRV_MSG_TYPE_TILE occupancy map tiles
+
+struct tank_clnt_subscribe {
+    char cmd;			// TANK_CLNT_CMD_SUBSCRIBE
+    uint8_t flags;		// TANK_SUB_*, replaces the previous set
+};
+
+// absolute setpoints, used by the local control interface and by timed commands
+#define TANK_SETPOINT_TRACKS	1	// a: right speed, b: left speed (usec)
+#define TANK_SETPOINT_SERVO	2	// a: servo index, b: angle
+#define TANK_SETPOINT_LED	3	// a: 0 red, 1 green, 2 blue, b: 0 or 1
+#define TANK_SETPOINT_BUZZER	4	// b: 0 or 1, the line held, stops the tones
+#define TANK_SETPOINT_CMD	5	// a: TANK_CLNT_CMD_* key command
+#define TANK_SETPOINT_SCAN	6	// a: TANK_SCAN_ARC(from, to) degrees, b: step degrees, 0 stops
+#define TANK_SETPOINT_REFLEX	7	// a: 0 overrides the collision reflex, 1 arms it again
+#define TANK_SETPOINT_MAP	8	// a: 0 clears the occupancy map and the pose
+#define TANK_SETPOINT_RGB	9	// a: TANK_RGB(red, green), b: TANK_RGB_FX(blue, effect, n)
+#define TANK_SETPOINT_TONE	10	// a: Hz, 0 is a rest, b: msec, queued after the notes before
+
+// sweep arc of the sonic servo, from and to are -128..127 from its default position
+#define TANK_SCAN_ARC(from, to)	((int16_t)(((from) & 0xff) | ((to) & 0xff) << 8))
+#define TANK_SCAN_FROM(a)	((int8_t)((a) & 0xff))
+#define TANK_SCAN_TO(a)		((int8_t)(((a) >> 8) & 0xff))
+
+// LED colour mix, 8 bits per channel, and its effect
+#define TANK_LED_STEADY		0
+#define TANK_LED_BLINK		1	// n: period in 250 ms units, 0 is the default
+#define TANK_LED_BREATHE	2	// n: period in 250 ms units, 0 is the default
+#define TANK_LED_CODE		3	// n: flashes per status code
+#define TANK_RGB(r, g)		((int16_t)(((r) & 0xff) | ((g) & 0xff) << 8))
+#define TANK_RGB_FX(b, fx, n)	((int16_t)(((b) & 0xff) | ((fx) & 0x0f) << 8 | ((n) & 0x0f) << 12))
+#define TANK_RGB_RED(a)		((a) & 0xff)
+#define TANK_RGB_GREEN(a)	(((a) >> 8) & 0xff)
+#define TANK_RGB_BLUE(b)	((b) & 0xff)
+#define TANK_RGB_EFFECT(b)	(((b) >> 8) & 0x0f)
+#define TANK_RGB_N(b)		(((b) >> 12) & 0x0f)
+
+struct tank_setpoint {
+    uint32_t type;
+    int32_t a, b;
+};
+
+/*
+ * Time tagged setpoint, applied by the server at 'at' of its own clock
+ * (CLOCK_MONOTONIC_RAW, see tank_srv_info.ts_*) or at once if 'at' is
+ * zero or already passed. A setpoint more than 5 minutes ahead or one
+ * that finds the queue full is dropped. A STOP key command or a lease
+ * expiry drops everything still queued. All fields are in network byte
+ * order.
+ */
+struct tank_clnt_timed {
+    char cmd;			// TANK_CLNT_CMD_TIMED
+    char type;			// TANK_SETPOINT_*
+    int16_t a, b;
+    int16_t reserved;
+    uint32_t at_sec, at_usec;
+};
+
+/*
+ * Sequence of setpoints played by the server with its own timing. Every
+ * step is applied 'delay' usec after the previous one (the first one
+ * after the upload), the whole sequence may take up to a minute. It is
+ * answered with TANK_SRV_MSG_TYPE_MACRO, a new upload replaces the
+ * running sequence, a STOP key command or a lease expiry cancels it.
+ * All fields are in network byte order.
+ */
+#define TANK_MACRO_MAX_STEPS	32
+
+struct tank_clnt_macro {
+    char cmd;			// TANK_CLNT_CMD_MACRO
+    uint8_t steps;		// struct tank_clnt_macro_step follow
+    uint16_t id;
+};
+
+struct tank_clnt_macro_step {
+    char type;			// TANK_SETPOINT_*
+    char reserved;
+    int16_t a, b;
+    int16_t reserved2;
+    uint32_t delay;		// usec
+};
+
 #endif
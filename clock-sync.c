@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <string.h>
+#include "clock-sync.h"
+
+void clock_sync_init(struct clock_sync *cs)
+{
+	memset(cs, 0, sizeof(*cs));
+	cs->srtt = -1;
+	cs->rtt_min = -1;
+}
+
+int clock_sync_add(struct clock_sync *cs, long long t1, long long t2, long long t3, long long t4)
+{
+	long long rtt = (t4 - t1) - (t3 - t2);
+	int i, best;
+
+	// the client can't spend more time than the whole exchange took
+	if ((rtt < 0) || (t3 < t2) || (rtt > 60000000))
+		return -EINVAL;
+
+	cs->rtt[cs->next] = rtt;
+	cs->offset[cs->next] = ((t2 - t1) + (t3 - t4)) / 2;
+	cs->next = (cs->next + 1) % CLOCK_SYNC_SAMPLES;
+	if (cs->cnt < CLOCK_SYNC_SAMPLES)
+		cs->cnt++;
+
+	// same weight as the TCP smoothed RTT
+	cs->srtt = (cs->srtt < 0) ? (int)rtt : cs->srtt + ((int)rtt - cs->srtt) / 8;
+
+	for (best = 0, i = 1; i < cs->cnt; i++) {
+		if (cs->rtt[i] < cs->rtt[best])
+			best = i;
+	}
+	cs->rtt_min = cs->rtt[best];
+	cs->clock_offset = cs->offset[best];
+	return 0;
+}
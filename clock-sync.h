@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __CLOCK_SYNC_H__
+#define __CLOCK_SYNC_H__
+
+#define CLOCK_SYNC_SAMPLES	8
+
+/*
+ * NTP style estimate from four timestamps: t1 server send, t2 client
+ * receive, t3 client send, t4 server receive (usec). The offset of the
+ * sample with the lowest RTT in the window is taken, queueing delay on
+ * the link mostly adds to the RTT and makes a sample less trustworthy.
+ */
+struct clock_sync {
+	int		rtt[CLOCK_SYNC_SAMPLES];
+	long long	offset[CLOCK_SYNC_SAMPLES];
+	int		cnt, next;
+	int		srtt;		// smoothed RTT, -1 until the first sample
+	int		rtt_min;	// lowest RTT in the window
+	long long	clock_offset;	// client clock minus server clock
+};
+
+void clock_sync_init(struct clock_sync *cs);
+int  clock_sync_add(struct clock_sync *cs, long long t1, long long t2, long long t3, long long t4);
+
+#endif
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <string.h>
+#include "cmd-ring.h"
+
+void cmd_ring_init(struct cmd_ring *ring)
+{
+	memset(ring->buf, 0, sizeof(ring->buf));
+	memset(ring->trace, -1, sizeof(ring->trace));
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+int cmd_ring_push(struct cmd_ring *ring, char cmd, int trace)
+{
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail >= CMD_RING_SIZE)
+		return -ENOSPC;
+
+	ring->buf[head & (CMD_RING_SIZE - 1)] = cmd;
+	ring->trace[head & (CMD_RING_SIZE - 1)] = trace;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return 0;
+}
+
+int cmd_ring_pop(struct cmd_ring *ring, char *cmd, int *trace)
+{
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return 0;
+
+	*cmd = ring->buf[tail & (CMD_RING_SIZE - 1)];
+	*trace = ring->trace[tail & (CMD_RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 1;
+}
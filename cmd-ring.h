@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __CMD_RING_H__
+#define __CMD_RING_H__
+
+#include <stdatomic.h>
+
+#define CMD_RING_SIZE	256	// must be a power of 2
+
+/*
+ * Lock-free single producer / single consumer command ring, used to pass
+ * client commands from the network thread to the device loop thread.
+ */
+struct cmd_ring {
+	atomic_uint	head;	// written by the producer only
+	atomic_uint	tail;	// written by the consumer only
+	char		buf[CMD_RING_SIZE];
+	signed char	trace[CMD_RING_SIZE];	// trace slot of the command, -1 if not traced
+};
+
+void cmd_ring_init(struct cmd_ring *ring);
+
+// returns 0 on success, -ENOSPC if the ring is full
+int  cmd_ring_push(struct cmd_ring *ring, char cmd, int trace);
+
+// returns 1 if a command was taken, 0 if the ring is empty
+int  cmd_ring_pop(struct cmd_ring *ring, char *cmd, int *trace);
+
+#endif
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <string.h>
+#include "cmd-trace.h"
+
+void cmd_trace_init(struct cmd_trace_table *table)
+{
+	int i;
+
+	memset(table, 0, sizeof(*table));
+	for (i = 0; i < CMD_TRACE_SLOTS; i++)
+		atomic_init(&table->slot[i].state, CMD_TRACE_FREE);
+}
+
+int cmd_trace_alloc(struct cmd_trace_table *table)
+{
+	struct cmd_trace *trace;
+	int i;
+
+	for (i = 0; i < CMD_TRACE_SLOTS; i++) {
+		trace = &table->slot[i];
+		if (atomic_load_explicit(&trace->state, memory_order_acquire) != CMD_TRACE_FREE)
+			continue;
+		memset(trace->ts, 0, sizeof(trace->ts));
+		trace->edge = 0;
+		atomic_store_explicit(&trace->state, CMD_TRACE_BUSY, memory_order_relaxed);
+		return i;
+	}
+	return -1;
+}
+
+void cmd_trace_free(struct cmd_trace_table *table, int slot)
+{
+	atomic_store_explicit(&table->slot[slot].state, CMD_TRACE_FREE, memory_order_release);
+}
+
+void cmd_trace_pass(struct cmd_trace_table *table, int slot, enum cmd_trace_state state)
+{
+	atomic_store_explicit(&table->slot[slot].state, state, memory_order_release);
+}
+
+int cmd_trace_owned(struct cmd_trace_table *table, int slot, enum cmd_trace_state state)
+{
+	return atomic_load_explicit(&table->slot[slot].state, memory_order_acquire) == (int)state;
+}
+
+void cmd_trace_stamp(struct cmd_trace_table *table, int slot, enum cmd_trace_stage stage)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	table->slot[slot].ts[stage] = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
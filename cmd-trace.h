@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __CMD_TRACE_H__
+#define __CMD_TRACE_H__
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define CMD_TRACE_SLOTS		32	// fits the signed char of the command ring
+
+enum cmd_trace_stage {
+	CMD_TRACE_RECV,		// network thread read the command
+	CMD_TRACE_DISPATCH,	// pushed to the command ring
+	CMD_TRACE_APPLY,	// loop thread took it, key_phess_handle() starts
+	CMD_TRACE_SET,		// key_phess_handle() done, the device got the new setpoint
+	CMD_TRACE_EDGE,		// first PWM frame using the new setpoint
+	CMD_TRACE_STAGES
+};
+
+enum cmd_trace_state {
+	CMD_TRACE_FREE,
+	CMD_TRACE_BUSY,		// owned by the network thread
+	CMD_TRACE_LOOP,		// owned by the loop thread
+	CMD_TRACE_DONE,		// back to the network thread for the reply
+};
+
+/*
+ * In flight command trace. A slot changes owner through the state only,
+ * so the stage timestamps themselves need no atomics.
+ */
+struct cmd_trace {
+	atomic_int	state;
+	unsigned	id;
+	int		client;
+	unsigned	conn;
+	char		cmd;
+	int		edge;		// waiting for the edge stage
+	unsigned	latch;		// track latch count before the command
+	long long	ts[CMD_TRACE_STAGES];	// usec, 0 if the stage does not apply
+};
+
+struct cmd_trace_table {
+	struct cmd_trace	slot[CMD_TRACE_SLOTS];
+};
+
+void cmd_trace_init(struct cmd_trace_table *table);
+
+// network thread: returns a slot in the BUSY state or -1 if all are in flight
+int  cmd_trace_alloc(struct cmd_trace_table *table);
+void cmd_trace_free(struct cmd_trace_table *table, int slot);
+
+// passes the slot to the other thread
+void cmd_trace_pass(struct cmd_trace_table *table, int slot, enum cmd_trace_state state);
+int  cmd_trace_owned(struct cmd_trace_table *table, int slot, enum cmd_trace_state state);
+
+void cmd_trace_stamp(struct cmd_trace_table *table, int slot, enum cmd_trace_stage stage);
+
+#endif
@@ -40,6 +40,11 @@ int device_get_action_interval(struct device *dev, struct timespec *ts)
 	return (result > 0) ? result : WAKEUP_NOW;
 }
 
+void device_set_precise(struct device *dev, int enable)
+{
+	dev->precise = enable;
+}
+
 int device_initialize(struct device *dev, const char *name, struct device_ops *ops, void *priv)
 {
 	if ((ops == NULL) || (priv == NULL))
@@ -105,3 +110,18 @@ void device_timespec_update(struct timespec *dst, struct timespec *src, int usec
 		dst->tv_nsec -= 1000000000;
 	}
 }
+
+void device_frame_next(struct timespec *next, struct timespec *ts, int period)
+{
+	long long ns = (long long)ts->tv_sec * 1000000000 + ts->tv_nsec;
+	long long step = (long long)period * 1000;
+
+	ns = (ns / step + 1) * step;
+	next->tv_sec = ns / 1000000000;
+	next->tv_nsec = ns % 1000000000;
+}
+
+void device_timestamp(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC_RAW, ts);
+}
@@ -27,6 +27,7 @@ struct device {
 
 	enum device_state	state;
 	struct timespec		next_action;
+	int			precise;	// wake up with precise_wait_until()
 };
 
 struct device_ops {
@@ -41,6 +42,8 @@ int  device_stop_request(struct device *dev);
 // returns time before next activations (in microseconds)
 int  device_get_action_interval(struct device *dev, struct timespec *ts);
 
+void device_set_precise(struct device *dev, int enable);
+
 int  device_initialize(struct device *dev, const char *name, struct device_ops *ops, void *priv);
 int  device_destroy(struct device *dev, int force);
 
@@ -48,4 +51,14 @@ int  device_timespec_diff(struct timespec *a, struct timespec *b);
 int  device_timespec_cmp(struct timespec *a, struct timespec *b);
 void device_timespec_update(struct timespec *dst, struct timespec *src, int usec);
 
+/*
+ * First frame start after ts. Frames are aligned to the clock origin, so
+ * PWM devices with the same period, or one dividing the other, start
+ * their frames at the same instants and share the loop wakeup.
+ */
+void device_frame_next(struct timespec *next, struct timespec *ts, int period);
+
+// reads the scheduler clock, used to timestamp the real edge times
+void device_timestamp(struct timespec *ts);
+
 #endif
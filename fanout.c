@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <string.h>
+#include "fanout.h"
+
+void fanout_init(struct fanout *fan)
+{
+	memset(fan, 0, sizeof(*fan));
+}
+
+int fanout_publish(struct fanout *fan, const void *data, int len)
+{
+	struct fanout_frame *frame;
+
+	if ((len <= 0) || (len > FANOUT_FRAME_SIZE))
+		return -EINVAL;
+
+	frame = &fan->frame[fan->head & (FANOUT_FRAMES - 1)];
+	memcpy(frame->data, data, len);
+	frame->len = len;
+	fan->head++;
+	return 0;
+}
+
+struct fanout_frame *fanout_get(struct fanout *fan, unsigned long long seq)
+{
+	if (seq >= fan->head)
+		return NULL;
+	return &fan->frame[seq & (FANOUT_FRAMES - 1)];
+}
+
+int fanout_overwritten(struct fanout *fan, unsigned long long seq)
+{
+	return seq + FANOUT_FRAMES <= fan->head;
+}
+
+unsigned fanout_catch_up(struct fanout *fan, unsigned long long *seq)
+{
+	unsigned skipped;
+
+	if (*seq + FANOUT_FRAMES > fan->head)
+		return 0;
+
+	skipped = fan->head - 1 - *seq;
+	*seq = fan->head - 1;
+	return skipped;
+}
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#define FANOUT_FRAMES		16	// must be a power of 2
+#define FANOUT_FRAME_SIZE	256
+
+/*
+ * Shared telemetry buffer. Every frame is built once, each client only
+ * keeps a cursor (frame sequence number and offset inside the frame).
+ * A client lagging more than FANOUT_FRAMES behind skips to the newest
+ * frame; one lagging that much in the middle of a frame has lost the
+ * rest of it (see fanout_overwritten()).
+ */
+struct fanout_frame {
+	int	len;
+	char	data[FANOUT_FRAME_SIZE];
+};
+
+struct fanout {
+	unsigned long long	head;	// sequence number of the next frame
+	struct fanout_frame	frame[FANOUT_FRAMES];
+};
+
+void fanout_init(struct fanout *fan);
+int  fanout_publish(struct fanout *fan, const void *data, int len);
+
+// returns frame 'seq' or NULL if it is not published yet
+struct fanout_frame *fanout_get(struct fanout *fan, unsigned long long seq);
+
+// frame 'seq' was replaced by a newer one
+int  fanout_overwritten(struct fanout *fan, unsigned long long seq);
+
+/*
+ * moves a lagging cursor to the newest frame, returns number of
+ * frames skipped
+ */
+unsigned fanout_catch_up(struct fanout *fan, unsigned long long *seq);
+
+#endif
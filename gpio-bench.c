@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+
+/*
+ * Cost of an output edge: toggles a line through gpio_out with the
+ * libgpiod path and, if a register mapping is given, with the memory
+ * mapped one, and a three line batch like track_control() commits.
+ * Reports nsec per toggle. The line is left low.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gpio-out.h"
+
+#define BENCH_TOGGLES	1000000
+#define BENCH_LINES	3
+
+static long long bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double bench_set(struct gpio_out *out, int toggles)
+{
+	long long start;
+	int i;
+
+	start = bench_nsec();
+	for (i = 0; i < toggles; i++)
+		gpio_out_set(out, i & 1);
+	gpio_out_set(out, 0);
+	return (double)(bench_nsec() - start) / toggles;
+}
+
+static double bench_batch(struct gpio_out *out, int toggles)
+{
+	struct gpio_out_batch batch;
+	long long start;
+	int i, j;
+
+	gpio_out_batch_init(&batch);
+	start = bench_nsec();
+	for (i = 0; i < toggles; i++) {
+		for (j = 0; j < BENCH_LINES; j++)
+			gpio_out_batch_set(&batch, &out[j], (i + j) & 1);
+		gpio_out_batch_commit(&batch);
+	}
+	for (j = 0; j < BENCH_LINES; j++)
+		gpio_out_batch_set(&batch, &out[j], 0);
+	gpio_out_batch_commit(&batch);
+	return (double)(bench_nsec() - start) / toggles;
+}
+
+static void bench_report(const char *name, struct gpio_out *out, int toggles)
+{
+	printf("%-8s set   %8.1f nsec/toggle\n", name, bench_set(&out[0], toggles));
+	printf("%-8s batch %8.1f nsec/toggle of %d lines\n", name, bench_batch(out, toggles), BENCH_LINES);
+}
+
+int main(int argc, char *argv[])
+{
+	struct gpiod_chip *chip;
+	struct gpiod_line *line[BENCH_LINES];
+	struct gpio_out out[BENCH_LINES];
+	const char *mmio_path = NULL;
+	int opt, i, ret, num = 7, offset = 0, toggles = BENCH_TOGGLES;
+
+	while ((opt = getopt(argc, argv, "c:l:n:m:")) != -1) {
+		switch (opt) {
+		case 'c':
+			num = atoi(optarg);
+			break;
+		case 'l':
+			offset = atoi(optarg);
+			break;
+		case 'n':
+			toggles = atoi(optarg);
+			break;
+		case 'm':
+			mmio_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c gpiochip] [-l first_line] [-n toggles] [-m mmio_path]\n"
+					"  toggles lines first_line..first_line+%d of the chip, keep them free\n",
+				argv[0], BENCH_LINES - 1);
+			return 1;
+		}
+	}
+	if (toggles <= 0)
+		toggles = BENCH_TOGGLES;
+
+	chip = gpiod_chip_open_by_number(num);
+	if (chip == NULL) {
+		perror("gpiod_chip_open_by_number");
+		return 1;
+	}
+	for (i = 0; i < BENCH_LINES; i++) {
+		line[i] = gpiod_chip_get_line(chip, offset + i);
+		if ((line[i] == NULL) || (gpiod_line_request_output(line[i], "gpio-bench", 0) != 0)) {
+			perror("gpiod line request");
+			return 1;
+		}
+		gpio_out_init(&out[i], line[i]);
+	}
+	bench_report("libgpiod", out, toggles);
+
+	if (mmio_path != NULL) {
+		ret = gpio_out_mmio_open(mmio_path);
+		if (ret != 0) {
+			fprintf(stderr, "can't map %s: %s\n", mmio_path, strerror(-ret));
+			return 1;
+		}
+		for (i = 0; i < BENCH_LINES; i++)
+			gpio_out_init(&out[i], line[i]);
+		bench_report("mmio", out, toggles);
+		gpio_out_mmio_close();
+	}
+
+	for (i = 0; i < BENCH_LINES; i++)
+		gpiod_line_release(line[i]);
+	gpiod_chip_close(chip);
+	return 0;
+}
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gpio-out.h"
+#include "metrics.h"
+
+static struct {
+	int			fd;
+	long			page;
+	volatile uint32_t	*bank[GPIO_OUT_BANKS];
+} mmio = { .fd = -1 };
+
+static off_t gpio_out_bank_base(int bank)
+{
+	if (bank == 0)
+		return GPIO_OUT_BANK0_BASE;
+	return GPIO_OUT_BANK1_BASE + (off_t)(bank - 1) * GPIO_OUT_BANK_STEP;
+}
+
+int gpio_out_mmio_open(const char *path)
+{
+	struct stat st;
+	void *addr;
+	off_t off;
+	int i, ret, regular;
+
+	if (mmio.fd >= 0)
+		return -EBUSY;
+
+	mmio.fd = open(path, O_RDWR | O_SYNC);
+	if (mmio.fd < 0)
+		return -errno;
+
+	if (fstat(mmio.fd, &st) != 0)
+		goto error;
+
+	mmio.page = sysconf(_SC_PAGESIZE);
+	regular = S_ISREG(st.st_mode);
+	if (regular && (st.st_size < mmio.page * GPIO_OUT_BANKS) &&
+	    (ftruncate(mmio.fd, mmio.page * GPIO_OUT_BANKS) != 0))
+		goto error;
+
+	for (i = 0; i < GPIO_OUT_BANKS; i++) {
+		off = regular ? (off_t)i * mmio.page : gpio_out_bank_base(i);
+		addr = mmap(NULL, mmio.page, PROT_READ | PROT_WRITE, MAP_SHARED, mmio.fd, off);
+		if (addr == MAP_FAILED)
+			goto error;
+		mmio.bank[i] = (volatile uint32_t *)addr;
+	}
+	return 0;
+
+error:
+	ret = -errno;
+	gpio_out_mmio_close();
+	return ret;
+}
+
+void gpio_out_mmio_close(void)
+{
+	int i;
+
+	for (i = 0; i < GPIO_OUT_BANKS; i++) {
+		if (mmio.bank[i] != NULL)
+			munmap((void *)mmio.bank[i], mmio.page);
+		mmio.bank[i] = NULL;
+	}
+	if (mmio.fd >= 0)
+		close(mmio.fd);
+	mmio.fd = -1;
+}
+
+int gpio_out_mmio_enabled(void)
+{
+	return mmio.fd >= 0;
+}
+
+void gpio_out_init(struct gpio_out *out, struct gpiod_line *line)
+{
+	int bank;
+
+	memset(out, 0, sizeof(*out));
+	out->line = line;
+	out->bank = -1;
+
+	if ((line == NULL) || !gpio_out_mmio_enabled())
+		return;
+
+	if (sscanf(gpiod_chip_name(gpiod_line_get_chip(line)), "gpiochip%d", &bank) != 1)
+		return;
+	if ((bank < 0) || (bank >= GPIO_OUT_BANKS) || (gpiod_line_offset(line) >= 32))
+		return;
+
+	out->bank = bank;
+	out->mask = 1u << gpiod_line_offset(line);
+	out->dr = mmio.bank[bank] + GPIO_OUT_DR / sizeof(uint32_t);
+}
+
+void gpio_out_set(struct gpio_out *out, int value)
+{
+	if (out->dr != NULL) {
+		/*
+		 * read-modify-write, a kernel write to another line of
+		 * the same bank in between would be lost
+		 */
+		if (value)
+			*out->dr |= out->mask;
+		else
+			*out->dr &= ~out->mask;
+		return;
+	}
+	if (out->line != NULL) {
+		gpiod_line_set_value(out->line, value);
+		metrics_add(METRICS_GPIO_SYSCALLS, 1);
+	}
+}
+
+int gpio_out_get(struct gpio_out *out)
+{
+	if (out->dr != NULL)
+		return (*out->dr & out->mask) ? 1 : 0;
+	if (out->line != NULL) {
+		metrics_add(METRICS_GPIO_SYSCALLS, 1);
+		return gpiod_line_get_value(out->line);
+	}
+	return 0;
+}
+
+void gpio_out_batch_init(struct gpio_out_batch *batch)
+{
+	memset(batch, 0, sizeof(*batch));
+}
+
+void gpio_out_batch_set(struct gpio_out_batch *batch, struct gpio_out *out, int value)
+{
+	if (out->dr == NULL) {
+		gpio_out_set(out, value);
+		return;
+	}
+
+	if (value) {
+		batch->set[out->bank] |= out->mask;
+		batch->clr[out->bank] &= ~out->mask;
+	} else {
+		batch->clr[out->bank] |= out->mask;
+		batch->set[out->bank] &= ~out->mask;
+	}
+	batch->banks |= 1u << out->bank;
+}
+
+void gpio_out_batch_commit(struct gpio_out_batch *batch)
+{
+	volatile uint32_t *dr;
+	int i;
+
+	for (i = 0; batch->banks != 0; i++, batch->banks >>= 1) {
+		if (!(batch->banks & 1))
+			continue;
+		dr = mmio.bank[i] + GPIO_OUT_DR / sizeof(uint32_t);
+		*dr = (*dr & ~batch->clr[i]) | batch->set[i];
+		batch->set[i] = 0;
+		batch->clr[i] = 0;
+	}
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __GPIO_OUT_H__
+#define __GPIO_OUT_H__
+
+#include <stdint.h>
+#include <gpiod.h>
+
+#define GPIO_OUT_BANKS		9	// RK3288 has GPIO0..GPIO8, gpiochipN is bank N
+#define GPIO_OUT_DR		0x0000	// GPIO_SWPORTA_DR register offset
+#define GPIO_OUT_BANK0_BASE	0xff750000
+#define GPIO_OUT_BANK1_BASE	0xff780000
+#define GPIO_OUT_BANK_STEP	0x10000
+
+/*
+ * Output line. The line is requested through libgpiod as usual, but if
+ * the memory mapped backend is enabled, values are written straight to
+ * the bank data register with a single store instead of an ioctl.
+ */
+struct gpio_out {
+	struct gpiod_line	*line;
+	volatile uint32_t	*dr;	// NULL for the libgpiod path
+	uint32_t		mask;
+	int			bank;
+};
+
+// lines of the same bank are written with one store on commit
+struct gpio_out_batch {
+	uint32_t		set[GPIO_OUT_BANKS];
+	uint32_t		clr[GPIO_OUT_BANKS];
+	unsigned		banks;	// bitmask of touched banks
+};
+
+/*
+ * Maps the GPIO data registers. '/dev/mem' and '/dev/gpiomem' are mapped
+ * at the bank physical addresses, a regular file is mapped page per bank
+ * (bank N at N * page size), so the backend may be tried on any box.
+ */
+int  gpio_out_mmio_open(const char *path);
+void gpio_out_mmio_close(void);
+int  gpio_out_mmio_enabled(void);
+
+// line may be NULL, such an output ignores all writes
+void gpio_out_init(struct gpio_out *out, struct gpiod_line *line);
+void gpio_out_set(struct gpio_out *out, int value);
+int  gpio_out_get(struct gpio_out *out);
+
+void gpio_out_batch_init(struct gpio_out_batch *batch);
+void gpio_out_batch_set(struct gpio_out_batch *batch, struct gpio_out *out, int value);
+void gpio_out_batch_commit(struct gpio_out_batch *batch);
+
+#endif
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+
+/*
+ * Simulated GPIO backend: the libgpiod calls the tank uses, implemented
+ * in memory. Linked instead of libgpiod it lets the whole server run on
+ * any box, e.g. to load it with many clients.
+ *
+ * Outputs keep the last written value. Inputs requested by the same
+ * consumer as an output answer like an ultrasonic sensor: a falling
+ * edge of the output starts an echo pulse, its length corresponds to
+ * TANK_SIM_DISTANCE centimeters (100 by default, 0 means no echo).
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gpiod.h>
+
+#define GPIO_SIM_CHIPS		9
+#define GPIO_SIM_LINES		32
+#define GPIO_SIM_ECHO_DELAY	300	// usec, from the trigger falling edge to the echo
+
+struct gpiod_chip {
+	unsigned		num;
+	char			name[16];
+};
+
+struct gpiod_line {
+	struct gpiod_chip	*chip;
+	unsigned		offset;
+	const char		*consumer;
+	int			output;
+	int			value;
+	struct timespec		fall;	// last falling edge of an output
+};
+
+static struct gpiod_chip chips[GPIO_SIM_CHIPS];
+static struct gpiod_line lines[GPIO_SIM_CHIPS][GPIO_SIM_LINES];
+static int echo_usec = -1;
+
+struct gpiod_chip *gpiod_chip_open_by_number(unsigned int num)
+{
+	if (num >= GPIO_SIM_CHIPS) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if (echo_usec < 0) {
+		const char *env = getenv("TANK_SIM_DISTANCE");
+
+		// 58 usec of round trip per centimeter
+		echo_usec = (env != NULL ? atoi(env) : 100) * 1000 / 17;
+	}
+	chips[num].num = num;
+	snprintf(chips[num].name, sizeof(chips[num].name), "gpiochip%u", num);
+	return &chips[num];
+}
+
+void gpiod_chip_close(struct gpiod_chip *chip)
+{
+	(void)chip;
+}
+
+const char *gpiod_chip_name(struct gpiod_chip *chip)
+{
+	return chip->name;
+}
+
+struct gpiod_line *gpiod_chip_get_line(struct gpiod_chip *chip, unsigned int offset)
+{
+	struct gpiod_line *line;
+
+	if (offset >= GPIO_SIM_LINES) {
+		errno = EINVAL;
+		return NULL;
+	}
+	line = &lines[chip->num][offset];
+	line->chip = chip;
+	line->offset = offset;
+	return line;
+}
+
+struct gpiod_chip *gpiod_line_get_chip(struct gpiod_line *line)
+{
+	return line->chip;
+}
+
+unsigned int gpiod_line_offset(struct gpiod_line *line)
+{
+	return line->offset;
+}
+
+int gpiod_line_request_output(struct gpiod_line *line, const char *consumer, int default_val)
+{
+	line->consumer = consumer;
+	line->output = 1;
+	line->value = default_val;
+	return 0;
+}
+
+int gpiod_line_request_input(struct gpiod_line *line, const char *consumer)
+{
+	line->consumer = consumer;
+	line->output = 0;
+	line->value = 0;
+	return 0;
+}
+
+int gpiod_line_set_value(struct gpiod_line *line, int value)
+{
+	if (line->value && !value)
+		clock_gettime(CLOCK_MONOTONIC_RAW, &line->fall);
+	line->value = value;
+	return 0;
+}
+
+static int gpio_sim_echo(struct gpiod_line *in)
+{
+	struct gpiod_line *trig;
+	struct timespec now;
+	long long usec;
+	int i, j;
+
+	if ((in->consumer == NULL) || (echo_usec <= 0))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	for (i = 0; i < GPIO_SIM_CHIPS; i++) {
+		for (j = 0; j < GPIO_SIM_LINES; j++) {
+			trig = &lines[i][j];
+			if (!trig->output || (trig->consumer == NULL) || strcmp(trig->consumer, in->consumer))
+				continue;
+			if ((trig->fall.tv_sec == 0) && (trig->fall.tv_nsec == 0))
+				continue;
+			usec = (now.tv_sec - trig->fall.tv_sec) * 1000000LL +
+			       (now.tv_nsec - trig->fall.tv_nsec) / 1000 - GPIO_SIM_ECHO_DELAY;
+			return (usec >= 0) && (usec < echo_usec);
+		}
+	}
+	return 0;
+}
+
+int gpiod_line_get_value(struct gpiod_line *line)
+{
+	if (line->output)
+		return line->value;
+	return gpio_sim_echo(line);
+}
+
+void gpiod_line_release(struct gpiod_line *line)
+{
+	line->consumer = NULL;
+	line->output = 0;
+}
@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grid-map.h"
+#include "track.h"
+#include "servo.h"
+#include "sonic.h"
+
+struct grid_priv {
+	struct device		*track, *servo;
+	int			full_speed;	// cm/s at the full track duty
+	long long		x, y;		// Q8 cm
+	unsigned		heading;	// 1/2^32 turns, counterclockwise
+	struct timespec		last;		// pose integrated up to
+	atomic_int		pose_x, pose_y, pose_heading;
+	atomic_ullong		dirty, touched;
+	atomic_schar		cell[GRID_TILES * GRID_TILES][GRID_TILE_CELLS];
+};
+
+// quarter wave, Q14
+static const short grid_sin_table[65] = {
+	0, 402, 804, 1205, 1606, 2006, 2404, 2801,
+	3196, 3590, 3981, 4370, 4756, 5139, 5520, 5897,
+	6270, 6639, 7005, 7366, 7723, 8076, 8423, 8765,
+	9102, 9434, 9760, 10080, 10394, 10702, 11003, 11297,
+	11585, 11866, 12140, 12406, 12665, 12916, 13160, 13395,
+	13623, 13842, 14053, 14256, 14449, 14635, 14811, 14978,
+	15137, 15286, 15426, 15557, 15679, 15791, 15893, 15986,
+	16069, 16143, 16207, 16261, 16305, 16340, 16364, 16379,
+	16384,
+};
+
+// h in 1/65536 turns, Q14 result
+static int grid_sin(unsigned h)
+{
+	unsigned idx = h & 0x3fff;
+	int val;
+
+	h &= 0xffff;
+	if (h & 0x4000)
+		idx = 0x4000 - idx;
+	if (idx == 0x4000)
+		val = grid_sin_table[64];
+	else
+		val = grid_sin_table[idx >> 8] +
+		      (((grid_sin_table[(idx >> 8) + 1] - grid_sin_table[idx >> 8]) * (int)(idx & 0xff)) >> 8);
+	return (h & 0x8000) ? -val : val;
+}
+
+static int grid_cos(unsigned h)
+{
+	return grid_sin(h + 0x4000);
+}
+
+static void grid_publish_pose(struct grid_priv *priv)
+{
+	atomic_store_explicit(&priv->pose_x, (int)(priv->x / 256), memory_order_relaxed);
+	atomic_store_explicit(&priv->pose_y, (int)(priv->y / 256), memory_order_relaxed);
+	atomic_store_explicit(&priv->pose_heading, (int)((unsigned long long)priv->heading * 360 >> 32),
+			      memory_order_relaxed);
+}
+
+// dead reckoning with the speeds commanded since the last call
+static void grid_integrate(struct grid_priv *priv, struct timespec *ts)
+{
+	int r = track_get_duty_right(priv->track), l = track_get_duty_left(priv->track);
+	int usec = device_timespec_diff(ts, &priv->last);
+	long long vr, vl, v;
+
+	if (usec <= 0)
+		return;
+	priv->last = *ts;
+	if (abs(r) < TRACK_MINTIME)
+		r = 0;
+	if (abs(l) < TRACK_MINTIME)
+		l = 0;
+	if ((r == 0) && (l == 0))
+		return;
+
+	// Q8 cm/s
+	vr = (long long)priv->full_speed * 256 * r / TRACK_PERIOD;
+	vl = (long long)priv->full_speed * 256 * l / TRACK_PERIOD;
+	v = (vr + vl) / 2;
+
+	priv->x += v * grid_cos(priv->heading >> 16) / 16384 * usec / 1000000;
+	priv->y += v * grid_sin(priv->heading >> 16) / 16384 * usec / 1000000;
+	// turns/s = (vr - vl) / (2 pi width), 683565275 = 2^32 / (2 pi)
+	priv->heading += (unsigned)((vr - vl) * 683565275LL / (256LL * GRID_TRACK_WIDTH) * usec / 1000000);
+	grid_publish_pose(priv);
+}
+
+static void grid_cell_add(struct grid_priv *priv, int cx, int cy, int lo)
+{
+	int tile = (cy / GRID_TILE) * GRID_TILES + cx / GRID_TILE;
+	atomic_schar *cell = &priv->cell[tile][(cy % GRID_TILE) * GRID_TILE + cx % GRID_TILE];
+	int val = atomic_load_explicit(cell, memory_order_relaxed) + lo;
+
+	if (val > GRID_LO_MAX)
+		val = GRID_LO_MAX;
+	if (val < -GRID_LO_MAX)
+		val = -GRID_LO_MAX;
+	atomic_store_explicit(cell, val, memory_order_relaxed);
+	atomic_fetch_or_explicit(&priv->dirty, 1ULL << tile, memory_order_release);
+}
+
+// Q8 cm from the centre to the cell index, rounding down on both sides
+static int grid_cell_of(long long pos)
+{
+	long long c = pos / (256 * GRID_CELL);
+
+	if ((pos < 0) && (pos % (256 * GRID_CELL) != 0))
+		c--;
+	return c + GRID_SIDE / 2;
+}
+
+// beam from the sonic to the echo, the last cell is hit if hit is set
+static void grid_beam(struct grid_priv *priv, long long x0, long long y0, long long x1, long long y1, int hit)
+{
+	int cx = grid_cell_of(x0), cy = grid_cell_of(y0), ex = grid_cell_of(x1), ey = grid_cell_of(y1);
+	int dx = abs(ex - cx), dy = -abs(ey - cy), sx = cx < ex ? 1 : -1, sy = cy < ey ? 1 : -1;
+	int err = dx + dy, e2;
+
+	while (1) {
+		if ((cx < 0) || (cy < 0) || (cx >= GRID_SIDE) || (cy >= GRID_SIDE))
+			return;
+		if ((cx == ex) && (cy == ey)) {
+			if (hit)
+				grid_cell_add(priv, cx, cy, GRID_LO_HIT);
+			return;
+		}
+		grid_cell_add(priv, cx, cy, GRID_LO_MISS);
+		e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			cx += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			cy += sy;
+		}
+	}
+}
+
+// sonic listener, loop thread
+static void grid_sample(void *ctx, int value, struct timespec *start)
+{
+	struct device *dev = ctx;
+	struct grid_priv *priv = dev->priv;
+	long long x0, y0, range;
+	unsigned beam;
+	int angle;
+
+	if ((dev->state != DEV_STATE_STARTED) || (value < 0))
+		return;
+	grid_integrate(priv, start);
+
+	angle = angle_position(priv->servo) - angle_def(priv->servo);
+	beam = (priv->heading >> 16) + angle * 65536 / 360;
+	x0 = priv->x + (long long)GRID_SONIC_OFFSET * 256 * grid_cos(priv->heading >> 16) / 16384;
+	y0 = priv->y + (long long)GRID_SONIC_OFFSET * 256 * grid_sin(priv->heading >> 16) / 16384;
+	range = (value < GRID_MAX_RANGE ? value : GRID_MAX_RANGE) * 256LL;
+	grid_beam(priv, x0, y0, x0 + range * grid_cos(beam) / 16384, y0 + range * grid_sin(beam) / 16384,
+		  value < GRID_MAX_RANGE);
+}
+
+static int grid_start_request(struct device *dev)
+{
+	if (dev->state != DEV_STATE_STOPPED)
+		return -EINVAL;
+	dev->state = DEV_STATE_STARTING;
+	return 0;
+}
+
+static void grid_timer_action(struct device *dev, struct timespec *ts)
+{
+	struct grid_priv *priv = dev->priv;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return;
+	if (dev->state == DEV_STATE_STOPPING) {
+		dev->state = DEV_STATE_STOPPED;
+		return;
+	}
+	if (dev->state == DEV_STATE_STARTING) {
+		dev->state = DEV_STATE_STARTED;
+		priv->last = *ts;
+	}
+
+	grid_integrate(priv, ts);
+	device_timespec_update(&dev->next_action, ts,
+			       (track_get_duty_right(priv->track) || track_get_duty_left(priv->track)) ?
+			       GRID_PERIOD : GRID_IDLE);
+}
+
+static void grid_destroy_priv(struct device *dev)
+{
+	free(dev->priv);
+}
+
+static struct device_ops grid_ops = {
+	.start_request	= grid_start_request,
+	.stop_request	= device_stop_request,
+	.timer_action	= grid_timer_action,
+	.destroy_priv	= grid_destroy_priv,
+};
+
+int grid_init(struct device *dev, struct device *track, struct device *servo, struct device *sonic,
+	      int full_speed)
+{
+	struct grid_priv *priv;
+	int ret;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -errno;
+	memset(priv, 0, sizeof(*priv));
+	priv->track = track;
+	priv->servo = servo;
+	priv->full_speed = full_speed;
+	atomic_init(&priv->dirty, 0);
+	atomic_init(&priv->touched, 0);
+	grid_publish_pose(priv);
+
+	ret = device_initialize(dev, "grid", &grid_ops, priv);
+	if (ret != 0) {
+		free(priv);
+		return ret;
+	}
+	sonic_set_listener(sonic, grid_sample, dev);
+	return 0;
+}
+
+void grid_clear(struct device *dev)
+{
+	struct grid_priv *priv = dev->priv;
+	int tile, i;
+
+	for (tile = 0; tile < GRID_TILES * GRID_TILES; tile++)
+		for (i = 0; i < GRID_TILE_CELLS; i++)
+			atomic_store_explicit(&priv->cell[tile][i], 0, memory_order_relaxed);
+	priv->x = priv->y = 0;
+	priv->heading = 0;
+	grid_publish_pose(priv);
+	// the clients hold the old cells, resend everything they have seen
+	atomic_fetch_or_explicit(&priv->dirty, atomic_load(&priv->touched), memory_order_release);
+}
+
+unsigned long long grid_take_dirty(struct device *dev)
+{
+	struct grid_priv *priv = dev->priv;
+	unsigned long long dirty = atomic_exchange_explicit(&priv->dirty, 0, memory_order_acquire);
+
+	atomic_fetch_or_explicit(&priv->touched, dirty, memory_order_relaxed);
+	return dirty;
+}
+
+unsigned long long grid_touched(struct device *dev)
+{
+	struct grid_priv *priv = dev->priv;
+
+	return atomic_load_explicit(&priv->touched, memory_order_relaxed);
+}
+
+int grid_tile_pack(struct device *dev, int tile, uint8_t *cells)
+{
+	struct grid_priv *priv = dev->priv;
+	int i, lo, hi;
+
+	for (i = 0; i < GRID_TILE_CELLS; i += 2) {
+		lo = atomic_load_explicit(&priv->cell[tile][i], memory_order_relaxed) / TANK_MAP_CELL_SCALE;
+		hi = atomic_load_explicit(&priv->cell[tile][i + 1], memory_order_relaxed) / TANK_MAP_CELL_SCALE;
+		cells[i / 2] = (lo & 0x0f) | (hi & 0x0f) << 4;
+	}
+	return GRID_TILE_CELLS / 2;
+}
+
+void grid_pose(struct device *dev, int *x, int *y, int *heading)
+{
+	struct grid_priv *priv = dev->priv;
+
+	*x = atomic_load_explicit(&priv->pose_x, memory_order_relaxed);
+	*y = atomic_load_explicit(&priv->pose_y, memory_order_relaxed);
+	*heading = atomic_load_explicit(&priv->pose_heading, memory_order_relaxed);
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __GRID_MAP_H__
+#define __GRID_MAP_H__
+
+#include "device.h"
+#include "client_server.h"
+
+#define GRID_CELL		TANK_MAP_CELL	// cm
+#define GRID_TILE		TANK_MAP_TILE	// cells per tile side
+#define GRID_TILES		TANK_MAP_TILES	// tiles per map side, at most 64 tiles in all
+#define GRID_SIDE		(GRID_TILE * GRID_TILES)
+#define GRID_TILE_CELLS		(GRID_TILE * GRID_TILE)
+
+#define GRID_PERIOD		10000	// usec, pose integration while the tank moves
+#define GRID_IDLE		100000	// usec, standing still
+#define GRID_TRACK_WIDTH	15	// cm between the tracks
+#define GRID_SONIC_OFFSET	8	// cm, sonic ahead of the turning centre
+#define GRID_MAX_RANGE		250	// cm, longer echoes only clear the cells on the way
+
+// log-odds of a cell, saturated so that a changed scene is relearned quickly
+#define GRID_LO_HIT		24
+#define GRID_LO_MISS		-6
+#define GRID_LO_MAX		120
+
+/*
+ * Occupancy grid around the start point. The pose is dead reckoned from
+ * the commanded track speeds, every sonic sample walks its beam through
+ * the grid: cells on the way are more likely free, the cell at the echo
+ * is more likely occupied. The cells are stored tile by tile (a tile is
+ * a few cache lines and is the unit sent to the clients), every update
+ * marks its tile dirty. Written by the loop thread only, the cells are
+ * atomic so the network thread may pack tiles while the map changes,
+ * a tile changed during packing is dirty again and is sent once more.
+ */
+int  grid_init(struct device *dev, struct device *track, struct device *servo, struct device *sonic,
+	       int full_speed);
+
+// loop thread: forgets the map and puts the tank back to the centre
+void grid_clear(struct device *dev);
+
+// network thread: tiles changed since the last call, and tiles ever changed
+unsigned long long grid_take_dirty(struct device *dev);
+unsigned long long grid_touched(struct device *dev);
+
+// packs a tile as struct tank_srv_tile cells, returns the packed size
+int  grid_tile_pack(struct device *dev, int tile, uint8_t *cells);
+
+// any thread: cm from the map centre, degrees counterclockwise from the start heading
+void grid_pose(struct device *dev, int *x, int *y, int *heading);
+
+#endif
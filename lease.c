@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include "device.h"
+#include "lease.h"
+
+static long long lease_usec(struct timespec *ts)
+{
+	return (long long)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+void lease_init(struct lease *lease, int window)
+{
+	atomic_init(&lease->refresh, 0);
+	atomic_init(&lease->expired, 0);
+	lease->window = window;
+}
+
+void lease_refresh(struct lease *lease, struct timespec *ts)
+{
+	long long now = lease_usec(ts);
+
+	// zero means "not held"
+	atomic_store(&lease->refresh, now ? now : 1);
+}
+
+void lease_release(struct lease *lease)
+{
+	atomic_store(&lease->refresh, 0);
+}
+
+int lease_remaining(struct lease *lease, struct timespec *ts)
+{
+	long long refresh = atomic_load(&lease->refresh);
+	long long left;
+
+	if (refresh == 0)
+		return WAKEUP_NEVER;
+
+	left = refresh + lease->window - lease_usec(ts);
+	return (left > 0) ? (int)left : WAKEUP_NOW;
+}
+
+int lease_check(struct lease *lease, struct timespec *ts)
+{
+	long long refresh = atomic_load(&lease->refresh);
+
+	if ((refresh == 0) || (refresh + lease->window > lease_usec(ts)))
+		return 0;
+
+	// a refresh from the network thread in between wins
+	if (!atomic_compare_exchange_strong(&lease->refresh, &refresh, 0))
+		return 0;
+
+	atomic_fetch_add(&lease->expired, 1);
+	return 1;
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __LEASE_H__
+#define __LEASE_H__
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define LEASE_WINDOW	100000	// usec
+
+/*
+ * Dead-man control lease. The network thread refreshes it on every byte
+ * from a controlling client, the loop thread on every track setpoint of
+ * the local interface. The loop thread checks it on every iteration and
+ * stops the tracks itself as soon as it expires.
+ */
+struct lease {
+	atomic_llong	refresh;	// usec of the last refresh, 0 if nobody holds the lease
+	int		window;		// usec
+	atomic_uint	expired;	// number of expiries
+};
+
+void lease_init(struct lease *lease, int window);
+
+// network thread, loop thread for the local interface
+void lease_refresh(struct lease *lease, struct timespec *ts);
+void lease_release(struct lease *lease);
+
+// loop thread: returns usec before expiry or WAKEUP_NEVER if the lease is not held
+int  lease_remaining(struct lease *lease, struct timespec *ts);
+
+// loop thread: returns 1 once when the lease has expired
+int  lease_check(struct lease *lease, struct timespec *ts);
+
+#endif
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <string.h>
+#include "loop-stats.h"
+
+void loop_stats_init(struct loop_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+void loop_stats_add(struct loop_stats *stats, int usec)
+{
+	if (usec < 0)
+		usec = 0;
+
+	stats->sum += usec;
+	stats->count++;
+	if (usec > stats->max)
+		stats->max = usec;
+	stats->hist[(usec < LOOP_STATS_BUCKETS) ? usec : LOOP_STATS_BUCKETS - 1]++;
+}
+
+int loop_stats_mean(struct loop_stats *stats)
+{
+	if (stats->count == 0)
+		return 0;
+	return stats->sum / stats->count;
+}
+
+int loop_stats_percentile(struct loop_stats *stats, int permille)
+{
+	unsigned long long limit, cnt = 0;
+	int i;
+
+	if (stats->count == 0)
+		return 0;
+
+	limit = ((unsigned long long)stats->count * permille + 999) / 1000;
+	for (i = 0; i < LOOP_STATS_BUCKETS - 1; i++) {
+		cnt += stats->hist[i];
+		if (cnt >= limit)
+			return i;
+	}
+	return stats->max;
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __LOOP_STATS_H__
+#define __LOOP_STATS_H__
+
+#define LOOP_STATS_BUCKETS	2048	// 1 usec buckets, the last one collects the rest
+
+// wakeup latency statistics of the device loop
+struct loop_stats {
+	unsigned long long	sum;
+	unsigned		count;
+	int			max;
+	unsigned		hist[LOOP_STATS_BUCKETS];
+};
+
+void loop_stats_init(struct loop_stats *stats);
+void loop_stats_add(struct loop_stats *stats, int usec);
+int  loop_stats_mean(struct loop_stats *stats);
+
+// returns value (usec) below which 'permille' of the samples are
+int  loop_stats_percentile(struct loop_stats *stats, int permille);
+
+#endif
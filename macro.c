@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "macro.h"
+
+struct macro_priv {
+	struct macro		macro;
+	int			next;		// step to apply at next_action
+	macro_apply_t		apply;
+	void			*ctx;
+	atomic_uint		progress;	// id << 16 | step << 8 | state
+};
+
+static void macro_set_progress(struct macro_priv *priv, unsigned step, char state)
+{
+	atomic_store_explicit(&priv->progress, (priv->macro.id & 0xffff) << 16 | (step & 0xff) << 8 |
+			      (unsigned char)state, memory_order_relaxed);
+}
+
+int macro_validate(const struct macro *m)
+{
+	long long total = 0;
+	int i;
+
+	if ((m->steps <= 0) || (m->steps > MACRO_MAX_STEPS))
+		return -EINVAL;
+	for (i = 0; i < m->steps; i++) {
+		if ((m->step[i].delay < 0) || (m->step[i].delay > MACRO_MAX_DELAY))
+			return -EINVAL;
+		total += m->step[i].delay;
+	}
+	return (total <= MACRO_MAX_TIME) ? 0 : -EINVAL;
+}
+
+void macro_box_init(struct macro_box *box)
+{
+	memset(&box->macro, 0, sizeof(box->macro));
+	atomic_init(&box->full, 0);
+}
+
+int macro_box_put(struct macro_box *box, const struct macro *m)
+{
+	if (atomic_load_explicit(&box->full, memory_order_acquire))
+		return -EBUSY;
+	box->macro = *m;
+	atomic_store_explicit(&box->full, 1, memory_order_release);
+	return 0;
+}
+
+int macro_box_get(struct macro_box *box, struct macro *m)
+{
+	if (!atomic_load_explicit(&box->full, memory_order_acquire))
+		return 0;
+	*m = box->macro;
+	atomic_store_explicit(&box->full, 0, memory_order_release);
+	return 1;
+}
+
+static int macro_start_request(struct device *dev)
+{
+	// started by macro_run() only
+	(void)dev;
+	return -EINVAL;
+}
+
+static void macro_timer_action(struct device *dev, struct timespec *ts)
+{
+	struct macro_priv *priv = dev->priv;
+	struct macro *m = &priv->macro;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return;
+	if (dev->state == DEV_STATE_STOPPING) {
+		macro_set_progress(priv, priv->next, TANK_MACRO_CANCELLED);
+		dev->state = DEV_STATE_STOPPED;
+		return;
+	}
+
+	// a late wakeup applies everything already due
+	do {
+		priv->apply(priv->ctx, &m->step[priv->next].sp);
+		priv->next++;
+		if (priv->next == m->steps) {
+			macro_set_progress(priv, priv->next, TANK_MACRO_DONE);
+			dev->state = DEV_STATE_STOPPED;
+			return;
+		}
+		device_timespec_update(&dev->next_action, &dev->next_action, m->step[priv->next].delay);
+	} while (device_get_action_interval(dev, ts) == WAKEUP_NOW);
+
+	macro_set_progress(priv, priv->next, TANK_MACRO_RUNNING);
+}
+
+static void macro_destroy_priv(struct device *dev)
+{
+	free(dev->priv);
+}
+
+static struct device_ops macro_ops = {
+	.start_request	= macro_start_request,
+	.stop_request	= device_stop_request,
+	.timer_action	= macro_timer_action,
+	.destroy_priv	= macro_destroy_priv,
+};
+
+int macro_init(struct device *dev, macro_apply_t apply, void *ctx)
+{
+	struct macro_priv *priv;
+	int ret;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -errno;
+	memset(priv, 0, sizeof(*priv));
+	priv->apply = apply;
+	priv->ctx = ctx;
+	atomic_init(&priv->progress, 0);
+	macro_set_progress(priv, 0, TANK_MACRO_IDLE);
+
+	ret = device_initialize(dev, "macro", &macro_ops, priv);
+	if (ret != 0) {
+		free(priv);
+		return ret;
+	}
+	device_set_precise(dev, 1);
+	return 0;
+}
+
+void macro_run(struct device *dev, const struct macro *m, struct timespec *ts)
+{
+	struct macro_priv *priv = dev->priv;
+
+	priv->macro = *m;
+	priv->next = 0;
+	device_timespec_update(&dev->next_action, ts, m->step[0].delay);
+	dev->state = DEV_STATE_STARTED;
+	macro_set_progress(priv, 0, TANK_MACRO_RUNNING);
+}
+
+int macro_cancel(struct device *dev)
+{
+	struct macro_priv *priv = dev->priv;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return 0;
+	macro_set_progress(priv, priv->next, TANK_MACRO_CANCELLED);
+	dev->state = DEV_STATE_STOPPED;
+	return 1;
+}
+
+void macro_progress(struct device *dev, unsigned *id, unsigned *step, char *state)
+{
+	struct macro_priv *priv = dev->priv;
+	unsigned progress = atomic_load_explicit(&priv->progress, memory_order_relaxed);
+
+	*id = progress >> 16;
+	*step = (progress >> 8) & 0xff;
+	*state = progress & 0xff;
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __MACRO_H__
+#define __MACRO_H__
+
+#include <stdatomic.h>
+#include "device.h"
+#include "client_server.h"
+
+#define MACRO_MAX_STEPS		TANK_MACRO_MAX_STEPS
+#define MACRO_MAX_DELAY		10000000	// usec, a single step
+#define MACRO_MAX_TIME		60000000	// usec, the whole sequence
+
+struct macro_step {
+	int			delay;	// usec after the previous step (after the start for the first one)
+	struct tank_setpoint	sp;
+};
+
+struct macro {
+	unsigned		id;
+	int			steps;
+	struct macro_step	step[MACRO_MAX_STEPS];
+};
+
+// hands one sequence from the network thread to the loop thread
+struct macro_box {
+	atomic_int		full;
+	struct macro		macro;
+};
+
+// applies a setpoint, returns non zero if it changed something
+typedef int (*macro_apply_t)(void *ctx, const struct tank_setpoint *sp);
+
+// checks the step count and the timing, 0 or -EINVAL
+int  macro_validate(const struct macro *m);
+
+void macro_box_init(struct macro_box *box);
+int  macro_box_put(struct macro_box *box, const struct macro *m);	// 0 or -EBUSY
+int  macro_box_get(struct macro_box *box, struct macro *m);		// 1 if taken
+
+/*
+ * Sequence player. The device wakes up precisely at every step, the
+ * steps are timed from the start, not from the previous wakeup, so a
+ * late wakeup never shifts the rest of the sequence.
+ */
+int  macro_init(struct device *dev, macro_apply_t apply, void *ctx);
+
+// starts the sequence at ts, a running one is replaced
+void macro_run(struct device *dev, const struct macro *m, struct timespec *ts);
+
+// drops the rest of the running sequence, returns non zero if there was one
+int  macro_cancel(struct device *dev);
+
+/*
+ * Progress for the telemetry, may be read from any thread: id of the
+ * last sequence, steps applied so far and TANK_MACRO_* state.
+ */
+void macro_progress(struct device *dev, unsigned *id, unsigned *step, char *state);
+
+#endif
@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+_Thread_local struct metrics_thread *metrics_self;
+
+static struct metrics_thread	*metrics_threads[METRICS_MAX_THREADS];
+static atomic_int		metrics_thread_cnt;
+
+static const char *metrics_names[METRICS_COUNTERS] = {
+	[METRICS_LOOP_ITERATIONS]	= "tank_loop_iterations_total",
+	[METRICS_LOOP_DURATION]		= "tank_loop_duration_usec_total",
+	[METRICS_GPIO_SYSCALLS]		= "tank_gpio_syscalls_total",
+	[METRICS_SONIC_VALID]		= "tank_sonic_samples_valid_total",
+	[METRICS_SONIC_INVALID]		= "tank_sonic_samples_invalid_total",
+	[METRICS_BYTES_IN]		= "tank_net_bytes_in_total",
+	[METRICS_BYTES_OUT]		= "tank_net_bytes_out_total",
+	[METRICS_DROPPED_FRAMES]	= "tank_net_dropped_frames_total",
+	[METRICS_LEASE_EXPIRED]		= "tank_lease_expired_total",
+	[METRICS_REJECTED_CMDS]		= "tank_net_rejected_commands_total",
+	[METRICS_SHM_SETPOINTS]		= "tank_shm_setpoints_total",
+	[METRICS_TIMED_LATE]		= "tank_timed_commands_late_total",
+	[METRICS_TIMED_DROPPED]		= "tank_timed_commands_dropped_total",
+	[METRICS_LOOP_WAKEUPS]		= "tank_loop_wakeups_total",
+	[METRICS_LOOP_JITTER]		= "tank_loop_jitter_usec_total",
+	[METRICS_SCAN_DROPPED]		= "tank_scan_points_dropped_total",
+	[METRICS_REFLEX_EVENTS]		= "tank_reflex_events_total",
+	[METRICS_BUZZER_EDGES]		= "tank_buzzer_edges_total",
+};
+
+void metrics_thread_register(struct metrics_thread *mt, const char *name)
+{
+	int i, idx;
+
+	mt->name = name;
+	for (i = 0; i < METRICS_COUNTERS; i++)
+		atomic_init(&mt->counter[i], 0);
+	for (i = 0; i < METRICS_MAX_DEV; i++)
+		atomic_init(&mt->timer_actions[i], 0);
+	atomic_init(&mt->loop_duration_max, 0);
+	atomic_init(&mt->loop_jitter_max, 0);
+
+	idx = atomic_fetch_add(&metrics_thread_cnt, 1);
+	if (idx < METRICS_MAX_THREADS)
+		metrics_threads[idx] = mt;
+	metrics_self = mt;
+}
+
+void metrics_loop_duration(int usec)
+{
+	if (metrics_self == NULL)
+		return;
+
+	metrics_add(METRICS_LOOP_DURATION, usec);
+	if ((unsigned)usec > atomic_load_explicit(&metrics_self->loop_duration_max, memory_order_relaxed))
+		atomic_store_explicit(&metrics_self->loop_duration_max, usec, memory_order_relaxed);
+}
+
+void metrics_loop_jitter(int usec)
+{
+	if (metrics_self == NULL)
+		return;
+
+	if (usec < 0)
+		usec = 0;
+	metrics_add(METRICS_LOOP_WAKEUPS, 1);
+	metrics_add(METRICS_LOOP_JITTER, usec);
+	if ((unsigned)usec > atomic_load_explicit(&metrics_self->loop_jitter_max, memory_order_relaxed))
+		atomic_store_explicit(&metrics_self->loop_jitter_max, usec, memory_order_relaxed);
+}
+
+static unsigned long long metrics_sum(enum metrics_counter id)
+{
+	unsigned long long sum = 0;
+	int i;
+
+	for (i = 0; i < METRICS_MAX_THREADS; i++) {
+		if (metrics_threads[i] != NULL)
+			sum += atomic_load_explicit(&metrics_threads[i]->counter[id], memory_order_relaxed);
+	}
+	return sum;
+}
+
+int metrics_server_open(struct metrics_server *srv, const char *addr)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	int i, ret, reuse_addr = 1;
+
+	memset(srv, 0, sizeof(*srv));
+	for (i = 0; i < METRICS_MAX_CONN; i++)
+		srv->conn[i] = -1;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &srv->last_scrape);
+
+	if (addr[0] == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof(sun.sun_path))
+			return -ENAMETOOLONG;
+		strcpy(sun.sun_path, addr);
+		unlink(addr);
+
+		srv->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (srv->fd < 0)
+			return -errno;
+		if (bind(srv->fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+			goto error;
+	} else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(addr));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		srv->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (srv->fd < 0)
+			return -errno;
+		if (setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr)) != 0)
+			goto error;
+		if (bind(srv->fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+			goto error;
+	}
+
+	if (listen(srv->fd, METRICS_MAX_CONN) != 0)
+		goto error;
+	return 0;
+
+error:
+	ret = -errno;
+	close(srv->fd);
+	srv->fd = -1;
+	return ret;
+}
+
+void metrics_server_close(struct metrics_server *srv)
+{
+	int i;
+
+	for (i = 0; i < METRICS_MAX_CONN; i++) {
+		if (srv->conn[i] >= 0)
+			close(srv->conn[i]);
+		srv->conn[i] = -1;
+	}
+	if (srv->fd >= 0)
+		close(srv->fd);
+	srv->fd = -1;
+}
+
+int metrics_server_pollfds(struct metrics_server *srv, struct pollfd *pfd)
+{
+	int i, cnt = 0;
+
+	if (srv->fd < 0)
+		return 0;
+
+	pfd[cnt].fd = srv->fd;
+	pfd[cnt++].events = POLLIN;
+	for (i = 0; i < METRICS_MAX_CONN; i++) {
+		if (srv->conn[i] < 0)
+			continue;
+		pfd[cnt].fd = srv->conn[i];
+		pfd[cnt++].events = POLLIN;
+	}
+	return cnt;
+}
+
+static int metrics_printf(char *buf, int len, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (len >= METRICS_BUF_SIZE)
+		return len;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf + len, METRICS_BUF_SIZE - len, fmt, ap);
+	va_end(ap);
+	return (ret < 0) ? len : len + ret;
+}
+
+static int metrics_format(struct metrics_server *srv, struct metrics_gauges *gauges, char *buf)
+{
+	struct metrics_thread *mt;
+	struct timespec now;
+	unsigned long long iterations, gpio, valid, invalid, loop_cnt = 0, loop_sum = 0;
+	unsigned loop_max = 0, jitter_max = 0;
+	int i, j, len = 0, elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	elapsed = device_timespec_diff(&now, &srv->last_scrape);
+	iterations = metrics_sum(METRICS_LOOP_ITERATIONS);
+	gpio = metrics_sum(METRICS_GPIO_SYSCALLS);
+
+	for (i = 0; i < METRICS_COUNTERS; i++) {
+		len = metrics_printf(buf, len, "# TYPE %s counter\n", metrics_names[i]);
+		for (j = 0; j < METRICS_MAX_THREADS; j++) {
+			mt = metrics_threads[j];
+			if (mt == NULL)
+				continue;
+			len = metrics_printf(buf, len, "%s{thread=\"%s\"} %llu\n", metrics_names[i], mt->name,
+					     atomic_load_explicit(&mt->counter[i], memory_order_relaxed));
+		}
+	}
+
+	len = metrics_printf(buf, len, "# TYPE tank_timer_actions_total counter\n");
+	for (i = 0; (i < gauges->dev_cnt) && (i < METRICS_MAX_DEV); i++) {
+		unsigned long long cnt = 0;
+
+		for (j = 0; j < METRICS_MAX_THREADS; j++) {
+			if (metrics_threads[j] != NULL)
+				cnt += atomic_load_explicit(&metrics_threads[j]->timer_actions[i], memory_order_relaxed);
+		}
+		len = metrics_printf(buf, len, "tank_timer_actions_total{device=\"%d\",name=\"%s\"} %llu\n",
+				     i, gauges->dev[i].name, cnt);
+	}
+
+	for (j = 0; j < METRICS_MAX_THREADS; j++) {
+		mt = metrics_threads[j];
+		if (mt == NULL)
+			continue;
+		loop_cnt += atomic_load_explicit(&mt->counter[METRICS_LOOP_ITERATIONS], memory_order_relaxed);
+		loop_sum += atomic_load_explicit(&mt->counter[METRICS_LOOP_DURATION], memory_order_relaxed);
+		if (atomic_load_explicit(&mt->loop_duration_max, memory_order_relaxed) > loop_max)
+			loop_max = atomic_load_explicit(&mt->loop_duration_max, memory_order_relaxed);
+		if (atomic_load_explicit(&mt->loop_jitter_max, memory_order_relaxed) > jitter_max)
+			jitter_max = atomic_load_explicit(&mt->loop_jitter_max, memory_order_relaxed);
+	}
+
+	valid = metrics_sum(METRICS_SONIC_VALID);
+	invalid = metrics_sum(METRICS_SONIC_INVALID);
+
+	len = metrics_printf(buf, len,
+		"# TYPE tank_loop_iterations_per_second gauge\n"
+		"tank_loop_iterations_per_second %llu\n"
+		"# TYPE tank_gpio_syscalls_per_second gauge\n"
+		"tank_gpio_syscalls_per_second %llu\n"
+		"# TYPE tank_loop_duration_mean_usec gauge\n"
+		"tank_loop_duration_mean_usec %llu\n"
+		"# TYPE tank_loop_duration_max_usec gauge\n"
+		"tank_loop_duration_max_usec %u\n"
+		"# TYPE tank_loop_jitter_mean_usec gauge\n"
+		"tank_loop_jitter_mean_usec %llu\n"
+		"# TYPE tank_loop_jitter_max_usec gauge\n"
+		"tank_loop_jitter_max_usec %u\n"
+		"# TYPE tank_sonic_valid_ratio gauge\n"
+		"tank_sonic_valid_ratio %.3f\n"
+		"# TYPE tank_sonic_confidence_percent gauge\n"
+		"tank_sonic_confidence_percent %d\n"
+		"# TYPE tank_reflex_latency_usec gauge\n"
+		"tank_reflex_latency_usec %d\n"
+		"# TYPE tank_reflex_latency_max_usec gauge\n"
+		"tank_reflex_latency_max_usec %d\n"
+		"# TYPE tank_range_predicted_cm gauge\n"
+		"tank_range_predicted_cm %d\n"
+		"# TYPE tank_range_closing_cm_per_second gauge\n"
+		"tank_range_closing_cm_per_second %d\n"
+		"# TYPE tank_buzzer_tone_hz gauge\n"
+		"tank_buzzer_tone_hz %d\n"
+		"# TYPE tank_buzzer_edge_late_usec gauge\n"
+		"tank_buzzer_edge_late_usec %d\n"
+		"# TYPE tank_buzzer_edge_late_max_usec gauge\n"
+		"tank_buzzer_edge_late_max_usec %d\n"
+		"# TYPE tank_servo_pulse_error_usec gauge\n"
+		"tank_servo_pulse_error_usec %d\n"
+		"# TYPE tank_clients_connected gauge\n"
+		"tank_clients_connected %d\n"
+		"# TYPE tank_clients_handshaken gauge\n"
+		"tank_clients_handshaken %d\n"
+		"# TYPE tank_controller_connected gauge\n"
+		"tank_controller_connected %d\n"
+		"# TYPE tank_controller_rtt_usec gauge\n"
+		"tank_controller_rtt_usec %d\n"
+		"# TYPE tank_controller_clock_offset_usec gauge\n"
+		"tank_controller_clock_offset_usec %lld\n",
+		(elapsed > 0) ? (iterations - srv->last_iterations) * 1000000 / elapsed : 0,
+		(elapsed > 0) ? (gpio - srv->last_gpio) * 1000000 / elapsed : 0,
+		loop_cnt ? loop_sum / loop_cnt : 0, loop_max,
+		metrics_sum(METRICS_LOOP_WAKEUPS) ?
+			metrics_sum(METRICS_LOOP_JITTER) / metrics_sum(METRICS_LOOP_WAKEUPS) : 0, jitter_max,
+		(valid + invalid) ? (double)valid / (valid + invalid) : 0.0, gauges->sonic_confidence,
+		gauges->reflex_latency, gauges->reflex_latency_max, gauges->range_distance, gauges->range_closing,
+		gauges->buzzer_tone, gauges->buzzer_late, gauges->buzzer_late_max, gauges->servo_pulse_error,
+		gauges->clients_connected, gauges->clients_handshaken, gauges->controller,
+		gauges->controller_rtt, gauges->controller_offset);
+
+	srv->last_scrape = now;
+	srv->last_iterations = iterations;
+	srv->last_gpio = gpio;
+	return len;
+}
+
+static void metrics_respond(struct metrics_server *srv, int fd, struct metrics_gauges *gauges)
+{
+	char hdr[128];
+	int len, hlen;
+
+	len = metrics_format(srv, gauges, srv->buf);
+	if (len > METRICS_BUF_SIZE - 1)
+		len = METRICS_BUF_SIZE - 1;
+	hlen = snprintf(hdr, sizeof(hdr),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %d\r\n\r\n", len);
+
+	// the answer fits into an empty socket buffer, a slow reader just gets a cut reply
+	write(fd, hdr, hlen);
+	write(fd, srv->buf, len);
+}
+
+void metrics_server_handle(struct metrics_server *srv, struct pollfd *pfd, int cnt,
+			   struct metrics_gauges *gauges)
+{
+	char req[512];
+	int i, k, fd;
+
+	if ((srv->fd < 0) || (cnt == 0))
+		return;
+
+	for (k = 1; k < cnt; k++) {
+		if (!(pfd[k].revents & (POLLIN | POLLERR | POLLHUP)))
+			continue;
+		for (i = 0; i < METRICS_MAX_CONN; i++) {
+			if (srv->conn[i] == pfd[k].fd)
+				break;
+		}
+		if (i == METRICS_MAX_CONN)
+			continue;
+		// any request gets the metrics page
+		if (read(srv->conn[i], req, sizeof(req)) > 0)
+			metrics_respond(srv, srv->conn[i], gauges);
+		close(srv->conn[i]);
+		srv->conn[i] = -1;
+	}
+
+	if (!(pfd[0].revents & POLLIN))
+		return;
+
+	fd = accept(srv->fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	for (i = 0; i < METRICS_MAX_CONN; i++) {
+		if (srv->conn[i] < 0) {
+			srv->conn[i] = fd;
+			return;
+		}
+	}
+	close(fd);
+}
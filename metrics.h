@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdatomic.h>
+#include <poll.h>
+#include <time.h>
+#include "device.h"
+
+#define METRICS_MAX_THREADS	4
+#define METRICS_MAX_DEV		16
+#define METRICS_MAX_CONN	4
+#define METRICS_BUF_SIZE	8192
+#define METRICS_POLLFDS		(1 + METRICS_MAX_CONN)
+
+enum metrics_counter {
+	METRICS_LOOP_ITERATIONS,
+	METRICS_LOOP_DURATION,		// usec, sum over all iterations
+	METRICS_GPIO_SYSCALLS,
+	METRICS_SONIC_VALID,
+	METRICS_SONIC_INVALID,
+	METRICS_BYTES_IN,
+	METRICS_BYTES_OUT,
+	METRICS_DROPPED_FRAMES,
+	METRICS_LEASE_EXPIRED,
+	METRICS_REJECTED_CMDS,		// device commands from observers
+	METRICS_SHM_SETPOINTS,
+	METRICS_TIMED_LATE,		// time tagged commands received after their time
+	METRICS_TIMED_DROPPED,		// time tagged commands beyond the horizon or the queues
+	METRICS_LOOP_WAKEUPS,		// timed wakeups of the loop
+	METRICS_LOOP_JITTER,		// usec, sum of the wakeup latencies
+	METRICS_SCAN_DROPPED,		// scan points lost to a full ring
+	METRICS_REFLEX_EVENTS,		// forward speed capped by the collision reflex
+	METRICS_BUZZER_EDGES,		// buzzer tone half periods
+	METRICS_COUNTERS
+};
+
+/*
+ * Counters of one thread. Only the owner thread writes them (plain
+ * relaxed load + store, no locked instructions), the scraper reads them
+ * with relaxed loads, so a scrape costs the control loop nothing.
+ */
+struct metrics_thread {
+	const char		*name;
+	atomic_ullong		counter[METRICS_COUNTERS];
+	atomic_uint		loop_duration_max;
+	atomic_uint		loop_jitter_max;
+	atomic_ullong		timer_actions[METRICS_MAX_DEV];
+};
+
+extern _Thread_local struct metrics_thread *metrics_self;
+
+static inline void metrics_add(enum metrics_counter id, unsigned long long val)
+{
+	atomic_ullong *cnt;
+
+	if (metrics_self == NULL)
+		return;
+	cnt = &metrics_self->counter[id];
+	atomic_store_explicit(cnt, atomic_load_explicit(cnt, memory_order_relaxed) + val,
+			      memory_order_relaxed);
+}
+
+static inline void metrics_timer_action(int dev)
+{
+	atomic_ullong *cnt;
+
+	if ((metrics_self == NULL) || (dev >= METRICS_MAX_DEV))
+		return;
+	cnt = &metrics_self->timer_actions[dev];
+	atomic_store_explicit(cnt, atomic_load_explicit(cnt, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+void metrics_loop_duration(int usec);
+void metrics_loop_jitter(int usec);
+
+// attaches counters to the calling thread, must be called before the thread counts anything
+void metrics_thread_register(struct metrics_thread *mt, const char *name);
+
+// values owned by the scraping thread itself
+struct metrics_gauges {
+	int		clients_connected;
+	int		clients_handshaken;
+	int		controller;	// non zero if a client controls the tank
+	int		controller_rtt;	// usec, -1 if unknown
+	long long	controller_offset;	// usec, controller clock minus server clock
+	int		sonic_confidence;	// percent
+	int		reflex_latency;		// usec, sonic ping to the speed cap, last and max
+	int		reflex_latency_max;
+	int		range_distance;		// cm predicted, -1 if unknown
+	int		range_closing;		// cm/s
+	int		buzzer_tone;		// Hz, -1 for a held line
+	int		buzzer_late;		// usec, buzzer edge after its time, last and max
+	int		buzzer_late_max;
+	int		servo_pulse_error;	// usec, sonic servo pulse of the last frame
+	struct device	*dev;
+	int		dev_cnt;
+};
+
+struct metrics_server {
+	int			fd;
+	int			conn[METRICS_MAX_CONN];
+	struct timespec		last_scrape;
+	unsigned long long	last_iterations, last_gpio;
+	char			buf[METRICS_BUF_SIZE];
+};
+
+/*
+ * addr is a unix socket path (starts with '/') or a tcp port on the
+ * loopback interface
+ */
+int  metrics_server_open(struct metrics_server *srv, const char *addr);
+void metrics_server_close(struct metrics_server *srv);
+
+// poll() integration, returns number of used pollfd entries
+int  metrics_server_pollfds(struct metrics_server *srv, struct pollfd *pfd);
+void metrics_server_handle(struct metrics_server *srv, struct pollfd *pfd, int cnt,
+			   struct metrics_gauges *gauges);
+
+#endif
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#define _GNU_SOURCE
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include "device.h"
+#include "precise-wait.h"
+
+static void precise_wait_account(struct precise_wait *pw, int overshoot)
+{
+	int diff;
+
+	if (overshoot < 0)
+		overshoot = 0;
+	if (overshoot > pw->overshoot_max)
+		pw->overshoot_max = overshoot;
+
+	if (pw->samples++ == 0) {
+		pw->overshoot = overshoot << 4;
+		pw->deviation = overshoot << 3;
+	} else {
+		/* exponential averages with 1/8 weight, fixed point x16 */
+		diff = (overshoot << 4) - pw->overshoot;
+		pw->overshoot += diff / 8;
+		pw->deviation += ((diff < 0 ? -diff : diff) - pw->deviation) / 8;
+	}
+
+	pw->margin = (pw->overshoot + 4 * pw->deviation) >> 4;
+	if (pw->margin < PRECISE_WAIT_MARGIN_MIN)
+		pw->margin = PRECISE_WAIT_MARGIN_MIN;
+	if (pw->margin > PRECISE_WAIT_MARGIN_MAX)
+		pw->margin = PRECISE_WAIT_MARGIN_MAX;
+}
+
+void precise_wait_init(struct precise_wait *pw)
+{
+	memset(pw, 0, sizeof(*pw));
+	pw->margin = PRECISE_WAIT_MARGIN_MAX / 10;
+}
+
+void precise_wait_calibrate(struct precise_wait *pw, int loops)
+{
+	struct timespec start, now;
+	int i, sleep_time;
+
+	for (i = 0; i < loops; i++) {
+		/* vary the sleep length a bit to not hit a lucky tick only */
+		sleep_time = 200 + (i % 10) * 100;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+		usleep(sleep_time);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		precise_wait_account(pw, device_timespec_diff(&now, &start) - sleep_time);
+	}
+}
+
+void precise_wait_until(struct precise_wait *pw, struct timespec *deadline)
+{
+	struct timespec start, now;
+	int sleep_time;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	sleep_time = device_timespec_diff(deadline, &start) - pw->margin;
+	now = start;
+
+	if (sleep_time > 0) {
+		usleep(sleep_time);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		/* runtime tuning: how late did we wake up compared to the request */
+		precise_wait_account(pw, device_timespec_diff(&now, &start) - sleep_time);
+	}
+
+	while (device_timespec_cmp(&now, deadline) < 0)
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+}
+
+int precise_wait_until_fd(struct precise_wait *pw, struct timespec *deadline, int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct timespec start, now, timeout;
+	int sleep_time;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	sleep_time = device_timespec_diff(deadline, &start) - pw->margin;
+	now = start;
+
+	if (sleep_time > 0) {
+		timeout.tv_sec = sleep_time / 1000000;
+		timeout.tv_nsec = (sleep_time % 1000000) * 1000;
+		if (ppoll(&pfd, 1, &timeout, NULL) > 0)
+			return 1;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		precise_wait_account(pw, device_timespec_diff(&now, &start) - sleep_time);
+	}
+
+	while (device_timespec_cmp(&now, deadline) < 0)
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	return 0;
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __PRECISE_WAIT_H__
+#define __PRECISE_WAIT_H__
+
+#include <time.h>
+
+#define PRECISE_WAIT_MARGIN_MIN		20
+#define PRECISE_WAIT_MARGIN_MAX		2000
+#define PRECISE_WAIT_CALIBRATE_LOOPS	50
+
+/*
+ * Hybrid sleep/spin waiter. Sleeps with usleep() until 'margin' usec
+ * before the deadline, then spins on CLOCK_MONOTONIC_RAW. The margin
+ * follows the measured usleep() overshoot (mean + 4 * mean deviation).
+ */
+struct precise_wait {
+	int	margin;		// usec reserved for spinning
+	int	overshoot;	// filtered usleep() overshoot (usec, x16)
+	int	deviation;	// filtered overshoot deviation (usec, x16)
+	int	overshoot_max;	// worst seen overshoot (usec)
+	unsigned samples;
+};
+
+void precise_wait_init(struct precise_wait *pw);
+void precise_wait_calibrate(struct precise_wait *pw, int loops);
+
+// waits until CLOCK_MONOTONIC_RAW reaches deadline
+void precise_wait_until(struct precise_wait *pw, struct timespec *deadline);
+
+/*
+ * The same, but the sleep ends early when fd gets readable, returns 1
+ * then (fd is not read). Only the final spin is not interruptible.
+ */
+int  precise_wait_until_fd(struct precise_wait *pw, struct timespec *deadline, int fd);
+
+#endif
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ *
+ * pwm-sysfs against a fake pwmchip tree in a temporary directory:
+ * the files written must hold what the kernel would have been told.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pwm-sysfs.h"
+
+static char root[PATH_MAX];
+static int failed;
+
+static void check(int cond, const char *what)
+{
+	printf("%s: %s\n", cond ? "ok" : "FAIL", what);
+	if (!cond)
+		failed++;
+}
+
+static void touch(const char *fmt, int n)
+{
+	char path[PATH_MAX + 64], name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), fmt, n);
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0)
+		close(fd);
+}
+
+static void mkdir_at(const char *fmt, int n)
+{
+	char path[PATH_MAX + 64], name[64];
+
+	snprintf(name, sizeof(name), fmt, n);
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	mkdir(path, 0755);
+}
+
+// the channel directory with the attributes a real pwm has
+static void make_channel(int channel, int with_period)
+{
+	mkdir_at("pwmchip0/pwm%d", channel);
+	touch("pwmchip0/pwm%d/duty_cycle", channel);
+	if (with_period)
+		touch("pwmchip0/pwm%d/period", channel);
+	touch("pwmchip0/pwm%d/enable", channel);
+}
+
+static int file_is(const char *fmt, int n, const char *val)
+{
+	char path[PATH_MAX + 64], name[64], buf[64];
+	int fd, len;
+
+	snprintf(name, sizeof(name), fmt, n);
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return 0;
+	buf[len] = '\0';
+	return strcmp(buf, val) == 0;
+}
+
+struct export_arg {
+	int	channel;
+	int	with_period;
+};
+
+// plays udev: the channel appears some time after the export
+static void *exporter(void *data)
+{
+	struct export_arg *arg = data;
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		if (!file_is("pwmchip%d/export", 0, ""))
+			break;
+		usleep(2000);
+	}
+	make_channel(arg->channel, arg->with_period);
+	return NULL;
+}
+
+static void test_open(void)
+{
+	struct pwm_sysfs pwm;
+	int ret;
+
+	make_channel(0, 1);
+	ret = pwm_sysfs_open(&pwm, root, 0, 0, 20000);
+	check(ret == 0, "open of an exported channel");
+	check(file_is("pwmchip0/pwm%d/period", 0, "20000000"), "period in nsec");
+	check(file_is("pwmchip0/pwm%d/enable", 0, "1"), "channel enabled");
+	check(file_is("pwmchip0/pwm%d/duty_cycle", 0, "0"), "duty cleared");
+	check(file_is("pwmchip0/export", 0, ""), "no export of an exported channel");
+
+	pwm_sysfs_set_duty(&pwm, 1500);
+	check(file_is("pwmchip0/pwm%d/duty_cycle", 0, "1500000"), "duty in nsec");
+	pwm_sysfs_set_duty(&pwm, 25000);
+	check(file_is("pwmchip0/pwm%d/duty_cycle", 0, "20000000"), "duty clamped to the period");
+	pwm_sysfs_close(&pwm);
+	check(file_is("pwmchip0/pwm%d/duty_cycle", 0, "0"), "duty cleared on close");
+	check(!pwm_sysfs_is_open(&pwm), "closed");
+}
+
+static void test_export(void)
+{
+	struct export_arg arg = { 1, 1 };
+	struct pwm_sysfs pwm;
+	pthread_t thread;
+	int ret;
+
+	touch("pwmchip0/export", 0);
+	pthread_create(&thread, NULL, exporter, &arg);
+	ret = pwm_sysfs_open(&pwm, root, 0, arg.channel, 1000);
+	pthread_join(thread, NULL);
+	check(ret == 0, "open with an export");
+	check(file_is("pwmchip0/export", 0, "1"), "channel exported");
+	check(file_is("pwmchip0/pwm%d/period", arg.channel, "1000000"), "period of the exported channel");
+	pwm_sysfs_close(&pwm);
+}
+
+static void test_failure(void)
+{
+	struct export_arg arg = { 2, 0 };
+	struct pwm_sysfs pwm;
+	pthread_t thread;
+	int ret;
+
+	// no period attribute: the open fails after our own export
+	touch("pwmchip0/export", 0);
+	touch("pwmchip0/unexport", 0);
+	pthread_create(&thread, NULL, exporter, &arg);
+	ret = pwm_sysfs_open(&pwm, root, 0, arg.channel, 20000);
+	pthread_join(thread, NULL);
+	check(ret == -ENOENT, "open fails without a period");
+	check(!pwm_sysfs_is_open(&pwm), "failed channel is not open");
+	check(file_is("pwmchip0/pwm%d/enable", arg.channel, ""), "failed channel is not enabled");
+	check(file_is("pwmchip0/unexport", 0, "2"), "channel exported by the open is unexported");
+
+	// the same, but the channel was exported before
+	make_channel(3, 0);
+	touch("pwmchip0/export", 0);
+	touch("pwmchip0/unexport", 0);
+	ret = pwm_sysfs_open(&pwm, root, 0, 3, 20000);
+	check(ret == -ENOENT, "open of an exported channel fails without a period");
+	check(file_is("pwmchip0/unexport", 0, ""), "channel exported elsewhere is kept");
+
+	ret = pwm_sysfs_open(&pwm, root, 1, 0, 20000);
+	check(ret == -ENOENT, "open of a missing chip");
+}
+
+int main(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	snprintf(root, sizeof(root), "/tmp/pwm-sysfs-test.XXXXXX");
+	if (mkdtemp(root) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	mkdir_at("pwmchip%d", 0);
+	touch("pwmchip0/export", 0);
+	touch("pwmchip0/unexport", 0);
+
+	test_open();
+	test_export();
+	test_failure();
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+	if (system(cmd) != 0)
+		fprintf(stderr, "can't remove %s\n", root);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+	return failed ? 1 : 0;
+}
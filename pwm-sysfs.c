@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pwm-sysfs.h"
+
+#define PWM_EXPORT_RETRIES	10
+
+static int pwm_sysfs_write_fd(int fd, int regular, const char *val)
+{
+	int len = strlen(val);
+
+	if (pwrite(fd, val, len, 0) != len)
+		return -errno;
+	if (regular && (ftruncate(fd, len) != 0))
+		return -errno;
+	return 0;
+}
+
+static int pwm_sysfs_write(const char *dir, const char *attr, const char *val)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = (fstat(fd, &st) == 0) ? pwm_sysfs_write_fd(fd, S_ISREG(st.st_mode), val) : -errno;
+	close(fd);
+	return ret;
+}
+
+void pwm_sysfs_init(struct pwm_sysfs *pwm)
+{
+	memset(pwm, 0, sizeof(*pwm));
+	pwm->duty_fd = -1;
+}
+
+int pwm_sysfs_open(struct pwm_sysfs *pwm, const char *root, int chip, int channel, int period)
+{
+	char chip_dir[PATH_MAX], dir[PATH_MAX], val[32];
+	struct stat st;
+	int i, ret, exported = 0;
+
+	pwm_sysfs_init(pwm);
+
+	snprintf(chip_dir, sizeof(chip_dir), "%s/pwmchip%d", root, chip);
+	snprintf(dir, sizeof(dir), "%s/pwmchip%d/pwm%d", root, chip, channel);
+	if (stat(chip_dir, &st) != 0)
+		return -errno;
+
+	if (stat(dir, &st) != 0) {
+		snprintf(val, sizeof(val), "%d", channel);
+		ret = pwm_sysfs_write(chip_dir, "export", val);
+		if (ret != 0)
+			return ret;
+		exported = 1;
+
+		/* udev may need some time to fix the permissions */
+		for (i = 0; i < PWM_EXPORT_RETRIES; i++) {
+			if (access(dir, F_OK) == 0)
+				break;
+			usleep(10000);
+		}
+		if (i == PWM_EXPORT_RETRIES) {
+			ret = -ENOENT;
+			goto err;
+		}
+	}
+
+	/* duty must never exceed the period, so clear it first */
+	ret = pwm_sysfs_write(dir, "duty_cycle", "0");
+	if (ret != 0)
+		goto err;
+
+	snprintf(val, sizeof(val), "%d", period * 1000);
+	ret = pwm_sysfs_write(dir, "period", val);
+	if (ret != 0)
+		goto err;
+
+	ret = pwm_sysfs_write(dir, "enable", "1");
+	if (ret != 0)
+		goto err;
+
+	snprintf(chip_dir, sizeof(chip_dir), "%s/pwmchip%d/pwm%d/duty_cycle", root, chip, channel);
+	pwm->duty_fd = open(chip_dir, O_WRONLY);
+	if (pwm->duty_fd < 0) {
+		ret = -errno;
+		goto err_disable;
+	}
+	if (fstat(pwm->duty_fd, &st) != 0) {
+		ret = -errno;
+		close(pwm->duty_fd);
+		pwm->duty_fd = -1;
+		goto err_disable;
+	}
+
+	pwm->regular = S_ISREG(st.st_mode);
+	pwm->chip = chip;
+	pwm->channel = channel;
+	pwm->period = period;
+	pwm->duty = 0;
+	return 0;
+
+err_disable:
+	pwm_sysfs_write(dir, "enable", "0");
+err:
+	/* a channel exported by someone else is left as it was */
+	if (exported) {
+		snprintf(chip_dir, sizeof(chip_dir), "%s/pwmchip%d", root, chip);
+		snprintf(val, sizeof(val), "%d", channel);
+		pwm_sysfs_write(chip_dir, "unexport", val);
+	}
+	return ret;
+}
+
+int pwm_sysfs_set_duty(struct pwm_sysfs *pwm, int duty)
+{
+	char val[32];
+	int ret;
+
+	if (!pwm_sysfs_is_open(pwm))
+		return -EBADF;
+
+	if (duty < 0)
+		duty = 0;
+	if (duty > pwm->period)
+		duty = pwm->period;
+	if (duty == pwm->duty)
+		return 0;
+
+	snprintf(val, sizeof(val), "%d", duty * 1000);
+	ret = pwm_sysfs_write_fd(pwm->duty_fd, pwm->regular, val);
+	if (ret == 0)
+		pwm->duty = duty;
+	return ret;
+}
+
+void pwm_sysfs_close(struct pwm_sysfs *pwm)
+{
+	if (!pwm_sysfs_is_open(pwm))
+		return;
+
+	pwm_sysfs_write_fd(pwm->duty_fd, pwm->regular, "0");
+	close(pwm->duty_fd);
+	pwm->duty_fd = -1;
+}
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __PWM_SYSFS_H__
+#define __PWM_SYSFS_H__
+
+#define PWM_SYSFS_ROOT	"/sys/class/pwm"
+
+/*
+ * Hardware PWM channel driven through the Linux pwmchip sysfs interface
+ * (<root>/pwmchipN/pwmM). The root may point to a fake tree for testing,
+ * regular files are truncated on every write.
+ */
+struct pwm_sysfs {
+	int	chip, channel;
+	int	duty_fd;	// -1 if the channel is not opened
+	int	regular;	// duty_cycle is a regular file (fake sysfs)
+	int	period;		// usec
+	int	duty;		// usec
+};
+
+void pwm_sysfs_init(struct pwm_sysfs *pwm);
+
+// exports and enables the channel, all times are in usec
+int  pwm_sysfs_open(struct pwm_sysfs *pwm, const char *root, int chip, int channel, int period);
+int  pwm_sysfs_set_duty(struct pwm_sysfs *pwm, int duty);
+void pwm_sysfs_close(struct pwm_sysfs *pwm);
+
+static inline int pwm_sysfs_is_open(struct pwm_sysfs *pwm)
+{
+	return pwm->duty_fd >= 0;
+}
+
+#endif
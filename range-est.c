@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "range-est.h"
+#include "track.h"
+#include "servo.h"
+#include "sonic.h"
+
+struct range_priv {
+	struct device		*track, *servo, *sonic;
+	int			full_speed;	// cm/s at the full track duty
+	struct range_kf		kf;
+	unsigned		pings;
+	struct timespec		last_predict, last_update;
+	atomic_int		distance, closing;
+};
+
+static long long range_commanded(struct range_priv *priv)
+{
+	return range_kf_commanded(priv->full_speed, track_get_duty_right(priv->track),
+				  track_get_duty_left(priv->track));
+}
+
+static int range_start_request(struct device *dev)
+{
+	struct range_priv *priv = dev->priv;
+	struct timespec start;
+	int value;
+
+	if (dev->state != DEV_STATE_STOPPED)
+		return -EINVAL;
+	priv->kf.valid = 0;
+	priv->pings = sonic_last_ping(priv->sonic, &value, &start);
+	dev->state = DEV_STATE_STARTING;
+	return 0;
+}
+
+static void range_timer_action(struct device *dev, struct timespec *ts)
+{
+	struct range_priv *priv = dev->priv;
+	long long u = range_commanded(priv);
+	struct timespec start;
+	unsigned pings;
+	int value;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return;
+	if (dev->state == DEV_STATE_STOPPING) {
+		atomic_store_explicit(&priv->distance, -1, memory_order_relaxed);
+		dev->state = DEV_STATE_STOPPED;
+		return;
+	}
+	if (dev->state == DEV_STATE_STARTING) {
+		dev->state = DEV_STATE_STARTED;
+		priv->last_predict = *ts;
+	}
+
+	// samples of another direction say nothing about the way ahead
+	if (abs(angle_position(priv->servo) - angle_def(priv->servo)) > RANGE_ANGLE)
+		priv->kf.valid = 0;
+
+	if (priv->kf.valid)
+		range_kf_predict(&priv->kf, u, device_timespec_diff(ts, &priv->last_predict));
+	priv->last_predict = *ts;
+
+	pings = sonic_last_ping(priv->sonic, &value, &start);
+	if (pings != priv->pings) {
+		priv->pings = pings;
+		if ((value >= 0) && (abs(angle_position(priv->servo) - angle_def(priv->servo)) <= RANGE_ANGLE)) {
+			range_kf_update(&priv->kf, u, value, device_timespec_diff(ts, &start));
+			priv->last_update = *ts;
+		}
+	}
+	if (priv->kf.valid && (device_timespec_diff(ts, &priv->last_update) > RANGE_HOLD))
+		priv->kf.valid = 0;
+
+	atomic_store_explicit(&priv->distance, range_kf_distance(&priv->kf), memory_order_relaxed);
+	atomic_store_explicit(&priv->closing, range_kf_closing(&priv->kf, u), memory_order_relaxed);
+
+	device_timespec_update(&dev->next_action, ts,
+			       (u != 0 || priv->sonic->state != DEV_STATE_STOPPED) ? RANGE_PERIOD : RANGE_IDLE);
+}
+
+static void range_destroy_priv(struct device *dev)
+{
+	free(dev->priv);
+}
+
+static struct device_ops range_ops = {
+	.start_request	= range_start_request,
+	.stop_request	= device_stop_request,
+	.timer_action	= range_timer_action,
+	.destroy_priv	= range_destroy_priv,
+};
+
+int range_init(struct device *dev, struct device *track, struct device *servo, struct device *sonic,
+	       int full_speed)
+{
+	struct range_priv *priv;
+	int ret;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -errno;
+	memset(priv, 0, sizeof(*priv));
+	priv->track = track;
+	priv->servo = servo;
+	priv->sonic = sonic;
+	priv->full_speed = full_speed;
+	atomic_init(&priv->distance, -1);
+	atomic_init(&priv->closing, 0);
+
+	ret = device_initialize(dev, "range", &range_ops, priv);
+	if (ret != 0) {
+		free(priv);
+		return ret;
+	}
+	return 0;
+}
+
+int range_get_distance(struct device *dev)
+{
+	struct range_priv *priv = dev->priv;
+
+	return atomic_load_explicit(&priv->distance, memory_order_relaxed);
+}
+
+int range_get_closing(struct device *dev)
+{
+	struct range_priv *priv = dev->priv;
+
+	return atomic_load_explicit(&priv->closing, memory_order_relaxed);
+}
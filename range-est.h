@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __RANGE_EST_H__
+#define __RANGE_EST_H__
+
+#include "device.h"
+#include "range-kf.h"
+
+#define RANGE_PERIOD		5000	// usec, while the tank moves
+#define RANGE_IDLE		50000	// usec, standing still
+#define RANGE_HOLD		500000	// usec, prediction without a sample before it is dropped
+#define RANGE_ANGLE		15	// degrees, the sonic still faces forward
+
+/*
+ * Range predictor. The Kalman filter of range-kf.h is predicted every
+ * RANGE_PERIOD and corrected with every raw sonic sample, so the
+ * distance in front of the tank stays current between the 60 ms pings.
+ */
+int  range_init(struct device *dev, struct device *track, struct device *servo, struct device *sonic,
+		int full_speed);
+
+// may be read from any thread: cm, -1 if there is no estimate; cm/s, positive when approaching
+int  range_get_distance(struct device *dev);
+int  range_get_closing(struct device *dev);
+
+#endif
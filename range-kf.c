@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <stdlib.h>
+#include "range-kf.h"
+#include "track.h"
+
+// a track below the minimal duty does not move
+long long range_kf_commanded(int full_speed, int duty_right, int duty_left)
+{
+	if (abs(duty_right) < TRACK_MINTIME)
+		duty_right = 0;
+	if (abs(duty_left) < TRACK_MINTIME)
+		duty_left = 0;
+	return (long long)full_speed * 256 * (duty_right + duty_left) / (2 * TRACK_PERIOD);
+}
+
+static void range_kf_reset(struct range_kf *kf, long long z)
+{
+	kf->d = z;
+	kf->b = 0;
+	kf->p00 = RANGE_NOISE * 256;
+	kf->p01 = 0;
+	kf->p11 = RANGE_BIAS_MAX * RANGE_BIAS_MAX * 256;
+	kf->valid = 1;
+}
+
+void range_kf_predict(struct range_kf *kf, long long u, int usec)
+{
+	long long dt = (long long)usec * 65536 / 1000000;	// Q16 s
+
+	kf->d -= ((u + kf->b) * dt) >> 16;
+	kf->p00 += ((((kf->p11 * dt) >> 16) * dt) >> 16) - ((2 * kf->p01 * dt) >> 16) +
+		   ((RANGE_Q_DISTANCE * 256 * dt) >> 16);
+	kf->p01 -= (kf->p11 * dt) >> 16;
+	kf->p11 += (RANGE_Q_BIAS * 256 * dt) >> 16;
+}
+
+void range_kf_update(struct range_kf *kf, long long u, int value, int age)
+{
+	long long z = (long long)value * 256 - (((u + kf->b) * ((long long)age * 65536 / 1000000)) >> 16);
+	long long y, s, k0, k1;
+
+	y = z - kf->d;
+	if (!kf->valid || (llabs(y) > RANGE_GATE * 256)) {
+		range_kf_reset(kf, z);
+		return;
+	}
+
+	s = kf->p00 + RANGE_NOISE * 256;
+	k0 = kf->p00 * 65536 / s;
+	k1 = kf->p01 * 65536 / s;
+	kf->d += (k0 * y) >> 16;
+	kf->b += (k1 * y) >> 16;
+	if (llabs(kf->b) > RANGE_BIAS_MAX * 256)
+		kf->b = (kf->b > 0 ? 1 : -1) * RANGE_BIAS_MAX * 256;
+
+	kf->p11 -= (k1 * kf->p01) >> 16;
+	kf->p01 -= (k0 * kf->p01) >> 16;
+	kf->p00 -= (k0 * kf->p00) >> 16;
+}
+
+int range_kf_distance(struct range_kf *kf)
+{
+	return kf->valid ? (int)((kf->d > 0 ? kf->d : 0) + 128) / 256 : -1;
+}
+
+int range_kf_closing(struct range_kf *kf, long long u)
+{
+	return kf->valid ? (int)((u + kf->b) / 256) : 0;
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __RANGE_KF_H__
+#define __RANGE_KF_H__
+
+#define RANGE_GATE		30	// cm, a larger innovation is a new obstacle: restart from it
+
+#define RANGE_NOISE		4	// cm^2, sonic sample variance
+#define RANGE_Q_DISTANCE	4	// cm^2/s, distance process noise
+#define RANGE_Q_BIAS		400	// (cm/s)^2/s, speed model error
+#define RANGE_BIAS_MAX		100	// cm/s
+
+/*
+ * Two state Kalman filter of the range predictor: distance and the error
+ * of the closing rate derived from the commanded track speed. Fixed
+ * point only: Q8 for the state, Q16 for the gains and the time step,
+ * 64 bit intermediates. u is the commanded closing rate, Q8 cm/s.
+ */
+struct range_kf {
+	int		valid;
+	long long	d, b;		// Q8: cm, cm/s
+	long long	p00, p01, p11;	// Q8 covariance
+};
+
+// Q8 cm/s the track duties (usec of TRACK_PERIOD) close in at, full_speed is cm/s at the full duty
+long long range_kf_commanded(int full_speed, int duty_right, int duty_left);
+
+void range_kf_predict(struct range_kf *kf, long long u, int usec);
+
+// value (cm) was measured age usec ago
+void range_kf_update(struct range_kf *kf, long long u, int value, int age);
+
+// cm, -1 if there is no estimate; cm/s, positive when approaching
+int  range_kf_distance(struct range_kf *kf);
+int  range_kf_closing(struct range_kf *kf, long long u);
+
+#endif
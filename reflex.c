@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <stdlib.h>
+#include "reflex.h"
+#include "client_server.h"
+#include "track.h"
+#include "servo.h"
+#include "sonic.h"
+#include "range-est.h"
+#include "metrics.h"
+
+void reflex_init(struct reflex *reflex, int margin, int full_speed)
+{
+	reflex->margin = margin;
+	reflex->full_speed = (full_speed > 0) ? full_speed : REFLEX_FULL_SPEED;
+	reflex->armed = (margin > 0);
+	reflex->pings = 0;
+	atomic_init(&reflex->state, reflex->armed ? TANK_REFLEX_ARMED : TANK_REFLEX_OFF);
+	atomic_init(&reflex->events, 0);
+	atomic_init(&reflex->distance, -1);
+	atomic_init(&reflex->latency, 0);
+	atomic_init(&reflex->latency_max, 0);
+}
+
+void reflex_arm(struct reflex *reflex, int armed)
+{
+	reflex->armed = armed && (reflex->margin > 0);
+	if (reflex->margin > 0)
+		atomic_store_explicit(&reflex->state, reflex->armed ? TANK_REFLEX_ARMED : TANK_REFLEX_OVERRIDE,
+				      memory_order_relaxed);
+}
+
+// forward duty that still stops short of the margin, 0 if none does
+static int reflex_limit(struct reflex *reflex, int distance)
+{
+	long long duty;
+
+	if (distance <= reflex->margin)
+		return 0;
+	duty = (long long)(distance - reflex->margin) * TRACK_PERIOD * 1000000 /
+	       ((long long)reflex->full_speed * REFLEX_STOP_TIME);
+	if (duty < TRACK_MINTIME)
+		return 0;
+	return (duty < TRACK_PERIOD) ? (int)duty : TRACK_PERIOD;
+}
+
+int reflex_check(struct reflex *reflex, struct device *track, struct device *servo,
+		 struct device *sonic, struct device *range, struct timespec *ts)
+{
+	int r = track_get_speed_right(track), l = track_get_speed_left(track);
+	int distance, limit, value, latency;
+	struct timespec start;
+	unsigned pings;
+	int fresh;
+
+	if (!reflex->armed)
+		return 0;
+	pings = sonic_last_ping(sonic, &value, &start);
+	fresh = (pings != reflex->pings);
+	reflex->pings = pings;
+
+	// only moving forward is limited, a pivot has one track backward
+	if ((r <= 0) || (l <= 0) || (abs(angle_position(servo) - angle_def(servo)) > REFLEX_ANGLE)) {
+		// a reflex stop is shown until the tank moves again
+		if ((r != 0) || (l != 0) || (atomic_load_explicit(&reflex->state, memory_order_relaxed) != TANK_REFLEX_STOP))
+			atomic_store_explicit(&reflex->state, TANK_REFLEX_ARMED, memory_order_relaxed);
+		return 0;
+	}
+
+	// a stopped sonic keeps a stale distance, range for as long as the tank moves forward
+	if (sonic->state == DEV_STATE_STOPPED) {
+		if (sonic_get_mode(sonic) != SONIC_MODE_DEMAND) {
+			sonic_change_mode(sonic, SONIC_MODE_CONTINUOUS);
+			sonic->ops->start_request(sonic);
+		}
+		return 0;
+	}
+
+	distance = range_get_distance(range);
+	if (distance < 0)
+		distance = sonic_get_distance(sonic);
+	if (distance < 0)
+		return 0;
+	limit = reflex_limit(reflex, distance);
+	if ((r <= limit) && (l <= limit))
+		return 0;
+
+	// the turn is kept, both tracks are scaled down together
+	if (r >= l) {
+		l = (long long)l * limit / r;
+		r = limit;
+	} else {
+		r = (long long)r * limit / l;
+		l = limit;
+	}
+	// a cap slows down along the track ramp, a stop cuts the pulses at once
+	if ((r < TRACK_MINTIME) || (l < TRACK_MINTIME)) {
+		r = l = 0;
+		track_emergency_stop(track);
+	} else
+		track_set_speed(track, r, l);
+
+	// an approach lowers the cap sample by sample, that is one intervention
+	if (atomic_load_explicit(&reflex->state, memory_order_relaxed) == TANK_REFLEX_ARMED) {
+		atomic_fetch_add_explicit(&reflex->events, 1, memory_order_relaxed);
+		metrics_add(METRICS_REFLEX_EVENTS, 1);
+	}
+	atomic_store_explicit(&reflex->state, (r == 0) ? TANK_REFLEX_STOP : TANK_REFLEX_CAP, memory_order_relaxed);
+	atomic_store_explicit(&reflex->distance, distance, memory_order_relaxed);
+
+	// a fresh sample made the decision, not a new speed command
+	if (fresh) {
+		latency = device_timespec_diff(ts, &start);
+		atomic_store_explicit(&reflex->latency, latency, memory_order_relaxed);
+		if (latency > atomic_load_explicit(&reflex->latency_max, memory_order_relaxed))
+			atomic_store_explicit(&reflex->latency_max, latency, memory_order_relaxed);
+	}
+	return 1;
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __REFLEX_H__
+#define __REFLEX_H__
+
+#include <stdatomic.h>
+#include <time.h>
+#include "device.h"
+
+#define REFLEX_MARGIN		15	// cm, kept in front of the tank after the stop
+#define REFLEX_FULL_SPEED	60	// cm/s at the full track duty
+#define REFLEX_STOP_TIME	250000	// usec, sample age and motor spin down
+#define REFLEX_ANGLE		15	// degrees, the sonic still faces forward
+
+/*
+ * Collision avoidance reflex. The loop thread checks it before the
+ * devices run, so a new sonic sample caps the forward speed before the
+ * next track frame: the stopping distance is margin plus the distance
+ * covered in REFLEX_STOP_TIME at the current speed, a closer obstacle
+ * lowers the forward duty until it fits, to zero at the margin.
+ * Backward and turning on the spot are never limited.
+ */
+struct reflex {
+	int		margin;		// cm, 0 if the reflex is disabled
+	int		full_speed;	// cm/s
+	int		armed;		// cleared by the controller override
+	unsigned	pings;		// last sonic sample seen
+	atomic_char	state;		// TANK_REFLEX_*, for the telemetry
+	atomic_uint	events;		// interventions
+	atomic_int	distance;	// cm, of the last intervention
+	atomic_int	latency;	// usec from the ping to the cap, of the last sample triggered one
+	atomic_int	latency_max;
+};
+
+void reflex_init(struct reflex *reflex, int margin, int full_speed);
+
+// controller override, loop thread; a disabled reflex stays off
+void reflex_arm(struct reflex *reflex, int armed);
+
+/*
+ * loop thread, returns non zero if the track speed was lowered; the
+ * predicted distance of the range device is used while there is one,
+ * the filtered sonic distance otherwise
+ */
+int  reflex_check(struct reflex *reflex, struct device *track, struct device *servo,
+		  struct device *sonic, struct device *range, struct timespec *ts);
+
+#endif
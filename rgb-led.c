@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rgb-led.h"
+
+struct led_priv {
+	struct gpio_out		*pin[LED_CHANNELS];
+	atomic_uchar		color[LED_CHANNELS];
+	int			pulse[LED_CHANNELS];	// usec of the current frame
+	unsigned		on;			// channels to switch off in this frame
+	enum led_effect		effect;
+	int			param;
+	struct timespec		effect_start, frame_start;
+};
+
+static long long led_usec_since(struct timespec *ts, struct timespec *start)
+{
+	return (long long)(ts->tv_sec - start->tv_sec) * 1000000 + (ts->tv_nsec - start->tv_nsec) / 1000;
+}
+
+// 0..255 scale of the colour at ts
+static int led_effect_scale(struct led_priv *priv, struct timespec *ts)
+{
+	long long msec = led_usec_since(ts, &priv->effect_start) / 1000;
+	int period, phase, half;
+
+	switch (priv->effect) {
+	case LED_BLINK:
+		period = priv->param > 0 ? priv->param : LED_BLINK_PERIOD;
+		return (msec % period) < period / 2 ? 255 : 0;
+	case LED_BREATHE:
+		// triangle squared, it looks closer to linear to the eye
+		period = priv->param > 0 ? priv->param : LED_BREATHE_PERIOD;
+		half = period / 2 > 0 ? period / 2 : 1;
+		phase = msec % period;
+		phase = phase < half ? phase * 255 / half : (period - phase) * 255 / half;
+		if (phase > 255)
+			phase = 255;
+		return phase * phase / 255;
+	case LED_CODE:
+		period = priv->param * 2 * LED_CODE_FLASH + LED_CODE_PAUSE;
+		phase = msec % period;
+		return (phase < priv->param * 2 * LED_CODE_FLASH) && (phase % (2 * LED_CODE_FLASH) < LED_CODE_FLASH) ?
+		       255 : 0;
+	default:
+		return 255;
+	}
+}
+
+static void led_wake(struct device *dev)
+{
+	if (dev->state == DEV_STATE_STOPPED)
+		dev->state = DEV_STATE_STARTING;
+}
+
+static int led_start_request(struct device *dev)
+{
+	if (dev->state != DEV_STATE_STOPPED)
+		return -EINVAL;
+	dev->state = DEV_STATE_STARTING;
+	return 0;
+}
+
+static void led_off(struct led_priv *priv)
+{
+	struct gpio_out_batch batch;
+	int i;
+
+	gpio_out_batch_init(&batch);
+	for (i = 0; i < LED_CHANNELS; i++)
+		gpio_out_batch_set(&batch, priv->pin[i], 0);
+	gpio_out_batch_commit(&batch);
+	priv->on = 0;
+}
+
+// the earliest fall left in the frame, or the next frame
+static void led_schedule(struct device *dev, struct led_priv *priv, struct timespec *ts)
+{
+	int i, delay = LED_PERIOD;
+
+	for (i = 0; i < LED_CHANNELS; i++)
+		if ((priv->on & (1u << i)) && (priv->pulse[i] < delay))
+			delay = priv->pulse[i];
+	if (priv->on != 0)
+		device_timespec_update(&dev->next_action, &priv->frame_start, delay);
+	else
+		device_frame_next(&dev->next_action, ts, LED_PERIOD);
+}
+
+static void led_frame(struct device *dev, struct led_priv *priv, struct timespec *ts)
+{
+	struct gpio_out_batch batch;
+	int i, level, scale = led_effect_scale(priv, ts);
+	int pwm = 0;
+
+	gpio_out_batch_init(&batch);
+	for (i = 0; i < LED_CHANNELS; i++) {
+		level = atomic_load_explicit(&priv->color[i], memory_order_relaxed) * scale / 255;
+		priv->pulse[i] = level * LED_PERIOD / 255;
+		gpio_out_batch_set(&batch, priv->pin[i], level > 0);
+		if ((level > 0) && (level < 255)) {
+			priv->on |= 1u << i;
+			pwm = 1;
+		}
+	}
+	gpio_out_batch_commit(&batch);
+	device_timestamp(&priv->frame_start);
+
+	// full and dark channels hold their level by themselves
+	if (!pwm && (priv->effect == LED_STEADY)) {
+		dev->state = DEV_STATE_STOPPED;
+		return;
+	}
+	led_schedule(dev, priv, ts);
+}
+
+static void led_timer_action(struct device *dev, struct timespec *ts)
+{
+	struct led_priv *priv = dev->priv;
+	struct gpio_out_batch batch;
+	long long elapsed;
+	int i;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return;
+	if (dev->state == DEV_STATE_STOPPING) {
+		led_off(priv);
+		dev->state = DEV_STATE_STOPPED;
+		return;
+	}
+	if (dev->state == DEV_STATE_STARTING) {
+		dev->state = DEV_STATE_STARTED;
+		priv->on = 0;
+	}
+
+	if (priv->on == 0) {
+		led_frame(dev, priv, ts);
+		return;
+	}
+
+	elapsed = led_usec_since(ts, &priv->frame_start);
+	gpio_out_batch_init(&batch);
+	for (i = 0; i < LED_CHANNELS; i++) {
+		if ((priv->on & (1u << i)) && (priv->pulse[i] <= elapsed + LED_MERGE)) {
+			gpio_out_batch_set(&batch, priv->pin[i], 0);
+			priv->on &= ~(1u << i);
+		}
+	}
+	gpio_out_batch_commit(&batch);
+	led_schedule(dev, priv, ts);
+}
+
+static void led_destroy_priv(struct device *dev)
+{
+	struct led_priv *priv = dev->priv;
+
+	led_off(priv);
+	free(priv);
+}
+
+static struct device_ops led_ops = {
+	.start_request	= led_start_request,
+	.stop_request	= device_stop_request,
+	.timer_action	= led_timer_action,
+	.destroy_priv	= led_destroy_priv,
+};
+
+int led_init(struct device *dev, struct gpio_out *red, struct gpio_out *green, struct gpio_out *blue)
+{
+	struct led_priv *priv;
+	int i, ret;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -errno;
+	memset(priv, 0, sizeof(*priv));
+	priv->pin[0] = red;
+	priv->pin[1] = green;
+	priv->pin[2] = blue;
+	for (i = 0; i < LED_CHANNELS; i++)
+		atomic_init(&priv->color[i], 0);
+	priv->effect = LED_STEADY;
+
+	ret = device_initialize(dev, "led", &led_ops, priv);
+	if (ret != 0) {
+		free(priv);
+		return ret;
+	}
+	led_off(priv);
+	return 0;
+}
+
+void led_set_channel(struct device *dev, int channel, int level)
+{
+	struct led_priv *priv = dev->priv;
+
+	if ((channel < 0) || (channel >= LED_CHANNELS))
+		return;
+	if (level < 0)
+		level = 0;
+	if (level > 255)
+		level = 255;
+	atomic_store_explicit(&priv->color[channel], level, memory_order_relaxed);
+	led_wake(dev);
+}
+
+void led_set_color(struct device *dev, int red, int green, int blue)
+{
+	led_set_channel(dev, 0, red);
+	led_set_channel(dev, 1, green);
+	led_set_channel(dev, 2, blue);
+}
+
+void led_toggle(struct device *dev, int channel)
+{
+	led_set_channel(dev, channel, led_get_channel(dev, channel) ? 0 : 255);
+}
+
+void led_set_effect(struct device *dev, enum led_effect effect, int param)
+{
+	struct led_priv *priv = dev->priv;
+
+	priv->effect = effect;
+	priv->param = param;
+	if ((effect == LED_CODE) && (param <= 0))
+		priv->param = 1;
+	device_timestamp(&priv->effect_start);
+	led_wake(dev);
+}
+
+int led_get_channel(struct device *dev, int channel)
+{
+	struct led_priv *priv = dev->priv;
+
+	return atomic_load_explicit(&priv->color[channel], memory_order_relaxed);
+}
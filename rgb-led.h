@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __RGB_LED_H__
+#define __RGB_LED_H__
+
+#include "device.h"
+#include "gpio-out.h"
+
+#define LED_CHANNELS		3	// red, green, blue
+#define LED_PERIOD		10000	// usec, 100 Hz, divides TRACK_PERIOD so the frames rise together
+#define LED_MERGE		300	// usec, channels falling this close go off in one wakeup
+
+#define LED_BLINK_PERIOD	1000	// msec
+#define LED_BREATHE_PERIOD	2000	// msec
+#define LED_CODE_FLASH		200	// msec on and as much off per flash
+#define LED_CODE_PAUSE		1000	// msec between the codes
+
+enum led_effect {
+	LED_STEADY,
+	LED_BLINK,		// param: period, msec
+	LED_BREATHE,		// param: period, msec
+	LED_CODE,		// param: flashes per code
+};
+
+/*
+ * RGB LED with 8-bit brightness per channel. Channels are switched on
+ * together at the frame start on the shared frame grid (see
+ * device_frame_next()) and off one by one, so a colour mix costs at most
+ * a wakeup per distinct level. A steady colour of full and dark channels
+ * needs no PWM at all and the device sleeps. Effects are computed from
+ * the frame time, the loop thread only.
+ */
+int  led_init(struct device *dev, struct gpio_out *red, struct gpio_out *green, struct gpio_out *blue);
+
+void led_set_color(struct device *dev, int red, int green, int blue);
+void led_set_channel(struct device *dev, int channel, int level);
+void led_toggle(struct device *dev, int channel);	// dark to full and back
+void led_set_effect(struct device *dev, enum led_effect effect, int param);
+
+// any thread: requested brightness of the channel
+int  led_get_channel(struct device *dev, int channel);
+
+#endif
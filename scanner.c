@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scanner.h"
+#include "servo.h"
+#include "sonic.h"
+#include "metrics.h"
+#include "timed-cmd.h"
+
+enum scan_state {
+	SCAN_MOVE,
+	SCAN_PING,
+	SCAN_WAIT_ECHO,
+};
+
+struct scanner_priv {
+	struct device		*servo, *sonic;
+	struct scan_ring	*out;
+	int			from, to, step, dir;
+	int			angle;		// target, relative to the servo default
+	unsigned		sweep, pings;
+	int			sonic_mode;	// restored on stop
+	struct timespec		settled;
+	enum scan_state		state;
+};
+
+void scan_ring_init(struct scan_ring *ring)
+{
+	memset(ring->point, 0, sizeof(ring->point));
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+static void scan_ring_push(struct scan_ring *ring, const struct scan_point *point)
+{
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail >= SCAN_RING_SIZE) {
+		metrics_add(METRICS_SCAN_DROPPED, 1);
+		return;
+	}
+	ring->point[head & (SCAN_RING_SIZE - 1)] = *point;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int scan_ring_pop(struct scan_ring *ring, struct scan_point *point)
+{
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return 0;
+	*point = ring->point[tail & (SCAN_RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+static int scanner_start_request(struct device *dev)
+{
+	// started by scanner_start() only
+	(void)dev;
+	return -EINVAL;
+}
+
+// wakes up when the servo is expected to have settled
+static void scanner_settle(struct device *dev, struct scanner_priv *priv, struct timespec *ts)
+{
+	device_timespec_update(&priv->settled, ts, angle_eta(priv->servo) + SCAN_SETTLE_FIXED);
+	dev->next_action = priv->settled;
+	priv->state = SCAN_PING;
+}
+
+static void scanner_move(struct device *dev, struct scanner_priv *priv, struct timespec *ts)
+{
+	angle_set(priv->servo, angle_def(priv->servo) + priv->angle);
+	scanner_settle(dev, priv, ts);
+}
+
+static void scanner_next(struct scanner_priv *priv)
+{
+	int lo = priv->from < priv->to ? priv->from : priv->to;
+	int hi = priv->from < priv->to ? priv->to : priv->from;
+
+	priv->angle += priv->dir * priv->step;
+	if ((priv->angle > hi) || (priv->angle < lo)) {
+		// back the other way, the end point is not measured twice
+		priv->dir = -priv->dir;
+		priv->angle += 2 * priv->dir * priv->step;
+		priv->sweep++;
+		if ((priv->angle > hi) || (priv->angle < lo))
+			priv->angle = lo;
+	}
+}
+
+static void scanner_timer_action(struct device *dev, struct timespec *ts)
+{
+	struct scanner_priv *priv = dev->priv;
+	struct scan_point point;
+	struct timespec start;
+	int value;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return;
+	if (dev->state == DEV_STATE_STOPPING) {
+		scanner_stop(dev);
+		return;
+	}
+	if (dev->state == DEV_STATE_STARTING) {
+		dev->state = DEV_STATE_STARTED;
+		priv->state = SCAN_MOVE;
+	}
+
+	switch (priv->state) {
+	case SCAN_MOVE:
+		scanner_move(dev, priv, ts);
+		return;
+	case SCAN_PING:
+		// a frame late or the target moved by someone else
+		if (!angle_in_position(priv->servo)) {
+			scanner_settle(dev, priv, ts);
+			return;
+		}
+		priv->pings = sonic_last_ping(priv->sonic, &value, &start);
+		sonic_ping(priv->sonic, ts);
+		priv->state = SCAN_WAIT_ECHO;
+		device_timespec_update(&dev->next_action, ts, SCAN_POLL);
+		return;
+	case SCAN_WAIT_ECHO:
+		// only a ping triggered after the servo settled counts
+		if ((sonic_last_ping(priv->sonic, &value, &start) == priv->pings) ||
+		    (device_timespec_cmp(&start, &priv->settled) < 0)) {
+			if (sonic_get_mode(priv->sonic) == SONIC_MODE_DEMAND && priv->sonic->state == DEV_STATE_STOPPED)
+				sonic_ping(priv->sonic, ts);
+			device_timespec_update(&dev->next_action, ts, SCAN_POLL);
+			return;
+		}
+		point.angle = angle_position(priv->servo) - angle_def(priv->servo);
+		point.distance = value;
+		point.ts = timed_usec(&start);
+		point.sweep = priv->sweep;
+		scan_ring_push(priv->out, &point);
+
+		scanner_next(priv);
+		scanner_move(dev, priv, ts);
+		return;
+	}
+}
+
+static void scanner_destroy_priv(struct device *dev)
+{
+	free(dev->priv);
+}
+
+static struct device_ops scanner_ops = {
+	.start_request	= scanner_start_request,
+	.stop_request	= device_stop_request,
+	.timer_action	= scanner_timer_action,
+	.destroy_priv	= scanner_destroy_priv,
+};
+
+int scanner_init(struct device *dev, struct device *servo, struct device *sonic, struct scan_ring *out)
+{
+	struct scanner_priv *priv;
+	int ret;
+
+	priv = malloc(sizeof(*priv));
+	if (priv == NULL)
+		return -errno;
+	memset(priv, 0, sizeof(*priv));
+	priv->servo = servo;
+	priv->sonic = sonic;
+	priv->out = out;
+
+	ret = device_initialize(dev, "scanner", &scanner_ops, priv);
+	if (ret != 0) {
+		free(priv);
+		return ret;
+	}
+	return 0;
+}
+
+void scanner_start(struct device *dev, int from, int to, int step)
+{
+	struct scanner_priv *priv = dev->priv;
+
+	if (step <= 0) {
+		scanner_stop(dev);
+		return;
+	}
+	if (dev->state == DEV_STATE_STOPPED) {
+		priv->sonic_mode = sonic_get_mode(priv->sonic);
+		sonic_change_mode(priv->sonic, SONIC_MODE_DEMAND);
+	}
+	priv->from = from;
+	priv->to = to;
+	priv->step = step;
+	priv->dir = (to >= from) ? 1 : -1;
+	priv->angle = from;
+	priv->sweep++;
+	dev->state = DEV_STATE_STARTING;
+}
+
+void scanner_stop(struct device *dev)
+{
+	struct scanner_priv *priv = dev->priv;
+
+	if (dev->state == DEV_STATE_STOPPED)
+		return;
+	dev->state = DEV_STATE_STOPPED;
+	sonic_change_mode(priv->sonic, priv->sonic_mode);
+	if (priv->sonic_mode == SONIC_MODE_CONTINUOUS)
+		priv->sonic->ops->start_request(priv->sonic);
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __SCANNER_H__
+#define __SCANNER_H__
+
+#include <stdatomic.h>
+#include "device.h"
+
+#define SCAN_RING_SIZE		64	// must be a power of 2
+#define SCAN_SETTLE_FIXED	10000	// usec, servo ringing after the profile ends
+#define SCAN_POLL		500	// usec, ping completion check
+
+// one measurement, angle is relative to the servo default position
+struct scan_point {
+	int			angle;
+	int			distance;	// cm, -1 if no echo
+	long long		ts;		// usec of CLOCK_MONOTONIC_RAW, ping trigger
+	unsigned		sweep;		// bumped at every end of the arc
+};
+
+// single producer / single consumer, loop thread to network thread
+struct scan_ring {
+	atomic_uint		head;
+	atomic_uint		tail;
+	struct scan_point	point[SCAN_RING_SIZE];
+};
+
+void scan_ring_init(struct scan_ring *ring);
+int  scan_ring_pop(struct scan_ring *ring, struct scan_point *point);	// 1 if taken
+
+/*
+ * Sweep scanner. It steps the servo through the arc back and forth,
+ * waits until the servo profile is in position and settled, asks the
+ * sonic for one ping and moves on as soon as the echo is in, so the
+ * rate is bound by the servo and the sound, not by the network. Points
+ * go to the ring, a full ring drops them.
+ */
+int  scanner_init(struct device *dev, struct device *servo, struct device *sonic, struct scan_ring *out);
+
+// angles in degrees from the servo default position, the sonic is put on demand until the stop
+void scanner_start(struct device *dev, int from, int to, int step);
+void scanner_stop(struct device *dev);
+
+#endif
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sched-conf.h"
+
+static const struct {
+	const char	*name;
+	int		policy;
+} sched_conf_policies[] = {
+	{ "other",	SCHED_OTHER },
+	{ "fifo",	SCHED_FIFO },
+	{ "rr",		SCHED_RR },
+};
+
+#define SCHED_CONF_POLICIES	(sizeof(sched_conf_policies) / sizeof(sched_conf_policies[0]))
+
+static const char *sched_conf_policy_name(int policy)
+{
+	unsigned i;
+
+	for (i = 0; i < SCHED_CONF_POLICIES; i++) {
+		if (sched_conf_policies[i].policy == policy)
+			return sched_conf_policies[i].name;
+	}
+	return "unknown";
+}
+
+void sched_conf_init(struct sched_conf *conf, const char *role)
+{
+	conf->role = role;
+	conf->cpu = SCHED_CONF_ANY;
+	conf->policy = SCHED_CONF_ANY;
+	conf->prio = 0;
+}
+
+int sched_conf_parse(struct sched_conf *confs, int cnt, const char *arg)
+{
+	struct sched_conf *conf = NULL;
+	const char *eq, *p;
+	char *end;
+	unsigned j;
+	int i;
+
+	eq = strchr(arg, '=');
+	if (eq == NULL)
+		return -EINVAL;
+
+	for (i = 0; i < cnt; i++) {
+		if ((strlen(confs[i].role) == (size_t)(eq - arg)) &&
+		    (strncmp(confs[i].role, arg, eq - arg) == 0))
+			conf = &confs[i];
+	}
+	if (conf == NULL)
+		return -ENOENT;
+
+	p = eq + 1;
+	if (*p == '*') {
+		conf->cpu = SCHED_CONF_ANY;
+		p++;
+	} else {
+		conf->cpu = strtol(p, &end, 10);
+		if ((end == p) || (conf->cpu < 0) || (conf->cpu >= CPU_SETSIZE))
+			return -EINVAL;
+		p = end;
+	}
+	if (*p == '\0')
+		return 0;
+	if (*p++ != ',')
+		return -EINVAL;
+
+	for (j = 0; j < SCHED_CONF_POLICIES; j++) {
+		if (strncmp(p, sched_conf_policies[j].name, strlen(sched_conf_policies[j].name)) != 0)
+			continue;
+		conf->policy = sched_conf_policies[j].policy;
+		p += strlen(sched_conf_policies[j].name);
+		break;
+	}
+	if (j == SCHED_CONF_POLICIES)
+		return -EINVAL;
+
+	conf->prio = 0;
+	if (*p == ':') {
+		conf->prio = strtol(p + 1, &end, 10);
+		if (end == p + 1)
+			return -EINVAL;
+		p = end;
+	}
+	if ((conf->policy != SCHED_OTHER) &&
+	    ((conf->prio < sched_get_priority_min(conf->policy)) ||
+	     (conf->prio > sched_get_priority_max(conf->policy))))
+		return -ERANGE;
+
+	return (*p == '\0') ? 0 : -EINVAL;
+}
+
+int sched_conf_apply(struct sched_conf *conf, pthread_t thread)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int ret;
+
+	if (conf->cpu != SCHED_CONF_ANY) {
+		CPU_ZERO(&cpus);
+		CPU_SET(conf->cpu, &cpus);
+		ret = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+		if (ret != 0)
+			return -ret;
+	}
+
+	if (conf->policy != SCHED_CONF_ANY) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = (conf->policy == SCHED_OTHER) ? 0 : conf->prio;
+		ret = pthread_setschedparam(thread, conf->policy, &param);
+		if (ret != 0)
+			return -ret;
+	}
+	return 0;
+}
+
+void sched_conf_describe(pthread_t thread, char *buf, int size)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int i, len, policy;
+
+	len = snprintf(buf, size, "cpu");
+	if (pthread_getaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+		len += snprintf(buf + len, size - len, " ?");
+	} else if (CPU_COUNT(&cpus) == sysconf(_SC_NPROCESSORS_CONF)) {
+		len += snprintf(buf + len, size - len, " any");
+	} else {
+		for (i = 0; (i < CPU_SETSIZE) && (len < size); i++) {
+			if (CPU_ISSET(i, &cpus))
+				len += snprintf(buf + len, size - len, "%s%d", (len == 3) ? " " : ",", i);
+		}
+	}
+	if (len >= size)
+		return;
+
+	if (pthread_getschedparam(thread, &policy, &param) != 0)
+		snprintf(buf + len, size - len, ", policy ?");
+	else if (policy == SCHED_OTHER)
+		snprintf(buf + len, size - len, ", %s", sched_conf_policy_name(policy));
+	else
+		snprintf(buf + len, size - len, ", %s:%d", sched_conf_policy_name(policy), param.sched_priority);
+}
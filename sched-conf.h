@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __SCHED_CONF_H__
+#define __SCHED_CONF_H__
+
+#include <pthread.h>
+
+#define SCHED_CONF_ANY		-1
+
+// cpu and scheduling policy of one thread role ("loop", "net")
+struct sched_conf {
+	const char	*role;
+	int		cpu;		// SCHED_CONF_ANY or cpu number
+	int		policy;		// SCHED_CONF_ANY or SCHED_OTHER/SCHED_FIFO/SCHED_RR
+	int		prio;
+};
+
+void sched_conf_init(struct sched_conf *conf, const char *role);
+
+// parses "role=cpu[,policy[:prio]]", policy is other, fifo or rr; cpu may be '*'
+int  sched_conf_parse(struct sched_conf *confs, int cnt, const char *arg);
+
+int  sched_conf_apply(struct sched_conf *conf, pthread_t thread);
+
+// describes cpus and policy really in effect for the thread
+void sched_conf_describe(pthread_t thread, char *buf, int size);
+
+#endif
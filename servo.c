@@ -8,12 +8,15 @@
 #include <errno.h>
 #include <string.h>
 #include "servo.h"
+#include "pwm-sysfs.h"
+#include "gpio-out.h"
 
 #define OFF	0
 #define ON	1
 
 #define SERVO_PERIOD	20000
 #define MAX_LOOPS		50
+#define MAX_ETA_FRAMES	500
 
 enum servo_state{
 	SERVO_OFF=0,
@@ -22,11 +25,72 @@ enum servo_state{
 
 struct servo_priv {
 	struct gpiod_line *out;
+	struct gpio_out pin;
 	int angle, next_angle, min_angle, max_angle, def_angle;
+	int pos, vel;			// profile: 1/256 degree, 1/256 degree/s
+	int max_velocity, max_accel;	// degree/s, degree/s^2, no slew if max_velocity is 0
 	int loops;
 	enum servo_state state;
+	struct timespec frame_start, rise;
+	int pulse_error;
+	struct pwm_sysfs hw;
 };
 
+static long long servo_isqrt (long long x) {
+	long long r = 0, bit = 1LL << 62;
+
+	while (bit > x) bit >>= 2;
+	while (bit != 0) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else r >>= 1;
+		bit >>= 2;
+	};
+	return r;
+}
+
+/*
+ * One frame of the trapezoidal profile: speed up by max_accel up to
+ * max_velocity, and never faster than the target can still be reached
+ * at rest while braking by max_accel every frame.
+ * Returns 0 if the servo already is in position.
+ */
+static int servo_slew (struct servo_priv *priv, int *pos, int *vel) {
+	long long d = (long long)priv->next_angle*256 - *pos;
+	long long dv = (long long)priv->max_accel*256*SERVO_PERIOD/1000000;
+	long long v, brake, step;
+	int dir = d < 0 ? -1 : 1;
+
+	if ((d == 0) && (*vel == 0)) return 0;
+	if ((priv->max_velocity == 0) || (dv == 0)) {
+		*pos = priv->next_angle*256;
+		*vel = 0;
+		return 1;
+	};
+
+	d = d*dir;
+	v = (long long)*vel*dir + dv;
+	if (v > priv->max_velocity*256) v = priv->max_velocity*256;
+	// v + (v - dv) + (v - 2dv) + ... frames of travel fit into d
+	brake = servo_isqrt (2*d*priv->max_accel*256 + dv*dv/4) - dv/2;
+	if (v > brake) v = brake;
+
+	step = v*SERVO_PERIOD/1000000;
+	if (step >= d) {
+		*pos = priv->next_angle*256;
+		*vel = 0;
+	} else {
+		*pos += dir*step;
+		*vel = dir*v;
+	};
+	return 1;
+}
+
+static int servo_width (struct servo_priv *priv) {
+	return priv->pos*11/256+500;
+}
+
 int servo_start_request (struct device *dev) {
 	struct servo_priv *priv = (struct servo_priv *) dev->priv;
 	if (dev->state!=DEV_STATE_STOPPED) return -EINVAL;
@@ -37,38 +101,73 @@ int servo_start_request (struct device *dev) {
 
 void servo_destroy_priv (struct device *dev) {
 	struct servo_priv *priv = (struct servo_priv *) dev->priv;
-	gpiod_line_set_value (priv->out, OFF);
+	gpio_out_set (&priv->pin, OFF);
+	pwm_sysfs_close (&priv->hw);
 	free (priv);
 }
 
+// hardware PWM generates the pulses itself, the device only wakes up to move the duty along the profile
+int servo_hw_start_request (struct device *dev) {
+	if (dev->state==DEV_STATE_STOPPED) dev->state=DEV_STATE_STARTING;
+	return 0;
+}
+
+void servo_hw_timer_action (struct device *dev, struct timespec *ts) {
+	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+
+	if (dev->state==DEV_STATE_STOPPED) return;
+	if (dev->state==DEV_STATE_STARTING) dev->state=DEV_STATE_STARTED;
+
+	if ((dev->state==DEV_STATE_STOPPING) || !servo_slew (priv, &priv->pos, &priv->vel)) {
+		dev->state=DEV_STATE_STOPPED;
+		return;
+	};
+	priv->angle = (priv->pos+128)/256;
+	pwm_sysfs_set_duty (&priv->hw, servo_width (priv));
+	device_timespec_update(&dev->next_action, ts, SERVO_PERIOD);
+}
+
 void servo_timer_action (struct device *dev, struct timespec *ts) {
 	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+	struct timespec fall;
+	int width;
 	
 	if (dev->state==DEV_STATE_STOPPED) return;
 
 	if (dev->state==DEV_STATE_STARTING) {
 		dev->state=DEV_STATE_STARTED;
 		priv->loops = MAX_LOOPS;
+		priv->frame_start = *ts;
 	};
 	
+	width = servo_width (priv);
 	if (priv->state == SERVO_OFF) {
 		if ((priv->loops == 0) || (dev->state==DEV_STATE_STOPPING)) {
 			dev->state=DEV_STATE_STOPPED;
 			priv->loops = 0;
 			return;
 		};
-		if (priv->angle != priv->next_angle) {
-			priv->angle = priv->next_angle;
+		if (servo_slew (priv, &priv->pos, &priv->vel)) {
+			priv->angle = (priv->pos+128)/256;
 			priv->loops = MAX_LOOPS;
+			width = servo_width (priv);
 		};
 		priv->state = SERVO_ON;
 		priv->loops--;
-		gpiod_line_set_value (priv->out, ON);
-		device_timespec_update(&dev->next_action, ts, priv->angle*11+500);
+		gpio_out_set (&priv->pin, ON);
+		// the falling edge is scheduled from the real rising edge, not from a late wakeup
+		device_timestamp (&priv->rise);
+		device_timespec_update(&dev->next_action, &priv->rise, width);
 	} else {
 		priv->state = SERVO_OFF;
-		gpiod_line_set_value (priv->out, OFF);
-		device_timespec_update(&dev->next_action, ts, SERVO_PERIOD-priv->angle*11-500);
+		gpio_out_set (&priv->pin, OFF);
+		device_timestamp (&fall);
+		priv->pulse_error = device_timespec_diff (&fall, &priv->rise) - width;
+
+		// next frame is anchored to the previous frame start, resync if a whole frame was lost
+		device_timespec_update(&priv->frame_start, &priv->frame_start, SERVO_PERIOD);
+		if (device_timespec_cmp (&priv->frame_start, &fall) < 0) priv->frame_start = fall;
+		dev->next_action = priv->frame_start;
 	};
 }
 
@@ -79,6 +178,13 @@ struct device_ops servo_ops={
 	.destroy_priv=servo_destroy_priv
 };
 
+struct device_ops servo_hw_ops={
+	.start_request=servo_hw_start_request,
+	.stop_request=device_stop_request,
+	.timer_action=servo_hw_timer_action,
+	.destroy_priv=servo_destroy_priv
+};
+
 int angle_servo_init (struct device *dev, int min_angle, int max_angle, int def_angle,  struct gpiod_line *out)
 {
 	struct servo_priv *priv;
@@ -93,15 +199,22 @@ int angle_servo_init (struct device *dev, int min_angle, int max_angle, int def_
 	priv->def_angle = def_angle;
 	priv->angle = def_angle;
 	priv->next_angle = def_angle;
+	priv->pos = def_angle*256;
+	priv->max_velocity = SERVO_MAX_VELOCITY;
+	priv->max_accel = SERVO_MAX_ACCEL;
 	
 	priv->out = out;
 	gpiod_line_request_output (priv->out, "angle_servo", OFF);
+	gpio_out_init (&priv->pin, priv->out);
+	pwm_sysfs_init (&priv->hw);
 	
 	ret = device_initialize (dev, "servo", &servo_ops, priv);
 	if (ret != 0) {
 		free (priv);
 		return ret;
 	};
+	// one degree is only 11 usec of pulse, so servo edges need a precise wakeup
+	device_set_precise (dev, 1);
 	servo_start_request (dev);
 	return 0;
 }
@@ -112,6 +225,40 @@ int angle_get (struct device *dev) {
 	return priv->next_angle;
 }
 
+int angle_position (struct device *dev) {
+	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+
+	return priv->angle;
+}
+
+int angle_in_position (struct device *dev) {
+	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+
+	return (priv->pos == priv->next_angle*256) && (priv->vel == 0);
+}
+
+int angle_eta (struct device *dev) {
+	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+	int pos = priv->pos, vel = priv->vel, frames = 0;
+
+	// the very same steps the frames will make
+	while ((frames < MAX_ETA_FRAMES) && servo_slew (priv, &pos, &vel)) frames++;
+	return frames*SERVO_PERIOD;
+}
+
+void angle_servo_set_profile (struct device *dev, int max_velocity, int max_accel) {
+	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+
+	priv->max_velocity = max_velocity;
+	priv->max_accel = max_accel;
+}
+
+int angle_pulse_error (struct device *dev) {
+	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+
+	return priv->pulse_error;
+}
+
 int angle_min (struct device *dev) {
 	struct servo_priv *priv = (struct servo_priv *) dev->priv;
 
@@ -136,5 +283,31 @@ void angle_set (struct device *dev, int angle) {
 	if (angle<priv->min_angle) angle=priv->min_angle;
 	if (angle>priv->max_angle) angle=priv->max_angle;
 	priv->next_angle=angle;
+	if (dev->ops == &servo_hw_ops) {
+		// duty cycle writes only, no CPU is spent between the edges
+		servo_hw_start_request (dev);
+		return;
+	};
 	servo_start_request (dev);
 }
+
+int angle_servo_use_hw_pwm (struct device *dev, const char *root, int chip, int channel) {
+	struct servo_priv *priv = (struct servo_priv *) dev->priv;
+	int ret;
+
+	ret = pwm_sysfs_open (&priv->hw, root, chip, channel, SERVO_PERIOD);
+	if (ret != 0) return ret;
+
+	// stop the software pulses, the pin is muxed to the pwm controller now
+	dev->state=DEV_STATE_STOPPED;
+	priv->state=SERVO_OFF;
+	gpiod_line_release (priv->out);
+	priv->out = NULL;
+	gpio_out_init (&priv->pin, NULL);
+
+	dev->ops = &servo_hw_ops;
+	device_set_precise (dev, 0);
+	pwm_sysfs_set_duty (&priv->hw, servo_width (priv));
+	angle_set (dev, priv->next_angle);
+	return 0;
+}
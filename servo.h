@@ -11,16 +11,37 @@
 #include <gpiod.h>
 #include "device.h"
 
+// default motion profile, an SG90 class servo does about 600 degree/s unloaded
+#define SERVO_MAX_VELOCITY	240	// degree/s
+#define SERVO_MAX_ACCEL		4000	// degree/s^2
+
+// the servo moves to the angle along the motion profile, one step per 20 ms frame
 void angle_set (struct device *dev, int angle);
 
+// target angle
 int angle_get (struct device *dev);
 
+// angle the servo is commanded to right now, in position or not
+int angle_position (struct device *dev);
+int angle_in_position (struct device *dev);
+// usec until the last step to the target, 0 if in position
+int angle_eta (struct device *dev);
+
 int angle_min (struct device *dev);
 int angle_max (struct device *dev);
 int angle_def (struct device *dev);
 
+// difference between measured and requested pulse width of the last frame (usec)
+int angle_pulse_error (struct device *dev);
+
 int angle_servo_init (struct device *dev,
 						int min_angle, int max_angle, int def_angle,
 						struct gpiod_line *out);
 
+// degree/s and degree/s^2, a zero velocity jumps to the target in one frame
+void angle_servo_set_profile (struct device *dev, int max_velocity, int max_accel);
+
+// switches the servo to a pwmchip sysfs channel, software PWM is kept on error
+int angle_servo_use_hw_pwm (struct device *dev, const char *root, int chip, int channel);
+
 #endif
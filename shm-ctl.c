@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "shm-ctl.h"
+#include "metrics.h"
+
+static socklen_t shm_ctl_addr(struct sockaddr_un *sun, const char *name)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	// abstract socket: leading zero byte, nothing is left in the filesystem
+	strncpy(sun->sun_path + 1, name, sizeof(sun->sun_path) - 2);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun->sun_path + 1);
+}
+
+int shm_ctl_open(struct shm_ctl *ctl, const char *name, int wake_fd)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	int fd, ret;
+
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->sock = -1;
+	ctl->wake_fd = wake_fd;
+	if ((name[0] == '\0') || (strchr(name, '/') != NULL) ||
+	    (strlen(name) + 1 >= SHM_CTL_NAME_MAX))
+		return -EINVAL;
+	snprintf(ctl->name, sizeof(ctl->name), "/%s", name);
+
+	fd = shm_open(ctl->name, O_RDWR | O_CREAT | O_TRUNC, 0660);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, sizeof(struct tank_shm)) != 0) {
+		ret = -errno;
+		close(fd);
+		shm_unlink(ctl->name);
+		return ret;
+	}
+	ctl->shm = mmap(NULL, sizeof(struct tank_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ctl->shm == MAP_FAILED) {
+		ret = -errno;
+		ctl->shm = NULL;
+		goto error;
+	}
+
+	memset(ctl->shm, 0, sizeof(struct tank_shm));
+	atomic_init(&ctl->shm->seq, 0);
+	atomic_init(&ctl->shm->head, 0);
+	atomic_init(&ctl->shm->tail, 0);
+	ctl->shm->version = TANK_SHM_VERSION;
+	atomic_thread_fence(memory_order_release);
+	ctl->shm->magic = TANK_SHM_MAGIC;
+
+	ctl->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (ctl->sock < 0) {
+		ret = -errno;
+		goto error;
+	}
+	len = shm_ctl_addr(&sun, name);
+	if ((bind(ctl->sock, (struct sockaddr *)&sun, len) != 0) || (listen(ctl->sock, 4) != 0)) {
+		ret = -errno;
+		goto error;
+	}
+	return 0;
+
+error:
+	shm_ctl_close(ctl);
+	return ret;
+}
+
+void shm_ctl_close(struct shm_ctl *ctl)
+{
+	if (ctl->sock >= 0)
+		close(ctl->sock);
+	ctl->sock = -1;
+	if (ctl->shm != NULL) {
+		munmap(ctl->shm, sizeof(struct tank_shm));
+		shm_unlink(ctl->name);
+	}
+	ctl->shm = NULL;
+}
+
+int shm_ctl_enabled(struct shm_ctl *ctl)
+{
+	return ctl->shm != NULL;
+}
+
+void shm_ctl_publish(struct shm_ctl *ctl, const struct tank_shm_state *state)
+{
+	struct tank_shm *shm = ctl->shm;
+	uint32_t seq;
+
+	if (shm == NULL)
+		return;
+
+	seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+	atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&shm->state, state, sizeof(*state));
+	atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+int shm_ctl_pop(struct shm_ctl *ctl, struct tank_setpoint *sp)
+{
+	struct tank_shm *shm = ctl->shm;
+	uint32_t tail;
+
+	if (shm == NULL)
+		return 0;
+
+	tail = atomic_load_explicit(&shm->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&shm->head, memory_order_acquire))
+		return 0;
+
+	*sp = shm->ring[tail & (TANK_SHM_SETPOINTS - 1)];
+	atomic_store_explicit(&shm->tail, tail + 1, memory_order_release);
+	metrics_add(METRICS_SHM_SETPOINTS, 1);
+	return 1;
+}
+
+int shm_ctl_pollfds(struct shm_ctl *ctl, struct pollfd *pfd)
+{
+	if (ctl->sock < 0)
+		return 0;
+	pfd->fd = ctl->sock;
+	pfd->events = POLLIN;
+	return 1;
+}
+
+// passes the loop wakeup eventfd, the shm name goes along as payload
+static void shm_ctl_send_fd(struct shm_ctl *ctl, int fd)
+{
+	char ctrl[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = ctl->name, .iov_len = strlen(ctl->name) + 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl,
+		.msg_controllen = sizeof(ctrl),
+	};
+	struct cmsghdr *cmsg;
+
+	memset(ctrl, 0, sizeof(ctrl));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &ctl->wake_fd, sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "\nshm: can't pass the wakeup fd: %s\n", strerror(errno));
+}
+
+void shm_ctl_handle(struct shm_ctl *ctl, struct pollfd *pfd, int cnt)
+{
+	int fd;
+
+	if ((cnt == 0) || !(pfd->revents & POLLIN))
+		return;
+
+	while ((fd = accept(ctl->sock, NULL, NULL)) >= 0) {
+		shm_ctl_send_fd(ctl, fd);
+		close(fd);
+	}
+}
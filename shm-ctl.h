@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __SHM_CTL_H__
+#define __SHM_CTL_H__
+
+#include <poll.h>
+#include "tank_shm.h"
+
+#define SHM_CTL_NAME_MAX	64
+#define SHM_CTL_POLLFDS		1
+
+/*
+ * Server side of the local control interface (see tank_shm.h). The
+ * device loop publishes the state and pops setpoints, the network
+ * thread hands the loop wakeup eventfd to attaching processes.
+ */
+struct shm_ctl {
+	struct tank_shm	*shm;
+	int		sock;
+	int		wake_fd;
+	char		name[SHM_CTL_NAME_MAX];
+};
+
+int  shm_ctl_open(struct shm_ctl *ctl, const char *name, int wake_fd);
+void shm_ctl_close(struct shm_ctl *ctl);
+int  shm_ctl_enabled(struct shm_ctl *ctl);
+
+// loop thread
+void shm_ctl_publish(struct shm_ctl *ctl, const struct tank_shm_state *state);
+int  shm_ctl_pop(struct shm_ctl *ctl, struct tank_setpoint *sp);
+
+// network thread, poll() integration
+int  shm_ctl_pollfds(struct shm_ctl *ctl, struct pollfd *pfd);
+void shm_ctl_handle(struct shm_ctl *ctl, struct pollfd *pfd, int cnt);
+
+#endif
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <string.h>
+#include "sonic-filter.h"
+
+void sonic_window_init(struct sonic_window *w, enum sonic_filter filter, int window)
+{
+	memset(w, 0, sizeof(*w));
+	w->filter = filter;
+	w->window = (window > 0 && window <= SONIC_WINDOW_MAX) ? window : SONIC_WINDOW;
+	w->distance = -1;
+}
+
+void sonic_window_reset(struct sonic_window *w)
+{
+	w->position = 0;
+	w->cnt = 0;
+	w->valid = 0;
+	w->sum = 0;
+	w->distance = -1;
+	w->confidence = 0;
+}
+
+// first position in sorted with a value not less than 'value'
+static int sonic_sorted_find(struct sonic_window *w, int value)
+{
+	int lo = 0, hi = w->valid, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (w->sorted[mid] < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void sonic_sorted_insert(struct sonic_window *w, int value)
+{
+	int i = sonic_sorted_find(w, value);
+
+	memmove(&w->sorted[i + 1], &w->sorted[i], (w->valid - i) * sizeof(int));
+	w->sorted[i] = value;
+	w->valid++;
+	w->sum += value;
+}
+
+static void sonic_sorted_remove(struct sonic_window *w, int value)
+{
+	int i = sonic_sorted_find(w, value);
+
+	w->valid--;
+	w->sum -= value;
+	memmove(&w->sorted[i], &w->sorted[i + 1], (w->valid - i) * sizeof(int));
+}
+
+// the window slides by one sample, no pass over the whole window
+void sonic_window_add(struct sonic_window *w, int value)
+{
+	int n, k, i, sum, tol;
+
+	if (w->cnt == w->window) {
+		if (w->raw[w->position] >= 0)
+			sonic_sorted_remove(w, w->raw[w->position]);
+	} else
+		w->cnt++;
+	w->raw[w->position] = value;
+	if (++w->position >= w->window)
+		w->position = 0;
+	if (value >= 0)
+		sonic_sorted_insert(w, value);
+	if (w->cnt < w->window)
+		return;
+
+	n = w->valid;
+	if (2 * n <= w->window) {
+		w->distance = -1;
+		w->confidence = 0;
+		return;
+	}
+
+	if (w->filter == SONIC_FILTER_TRIMMED) {
+		k = n / 4;
+		sum = w->sum;
+		for (i = 0; i < k; i++)
+			sum -= w->sorted[i] + w->sorted[n - 1 - i];
+		w->distance = sum / (n - 2 * k);
+	} else
+		w->distance = (w->sorted[(n - 1) / 2] + w->sorted[n / 2]) / 2;
+
+	tol = w->distance / 10 > SONIC_AGREE ? w->distance / 10 : SONIC_AGREE;
+	w->confidence = 100 * (sonic_sorted_find(w, w->distance + tol + 1) -
+			       sonic_sorted_find(w, w->distance - tol)) / w->window;
+}
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __SONIC_FILTER_H__
+#define __SONIC_FILTER_H__
+
+#define SONIC_WINDOW		5	// samples, default filter window
+#define SONIC_WINDOW_MAX	15
+#define SONIC_AGREE		5	// cm, or 10% of the distance if more: samples that agree
+
+enum sonic_filter {
+	SONIC_FILTER_MEDIAN,
+	SONIC_FILTER_TRIMMED,		// mean without the lowest and highest quarter
+};
+
+/*
+ * Streaming filter over the last 'window' raw samples: raw is the ring
+ * of the samples, sorted holds the valid ones in order and sum is their
+ * total, so a new sample costs a binary search and a short memmove.
+ */
+struct sonic_window {
+	enum sonic_filter	filter;
+	int			window;
+	int			raw[SONIC_WINDOW_MAX], sorted[SONIC_WINDOW_MAX];
+	int			valid, sum, position, cnt;
+	int			distance;	// cm, -1 until more than half of the window is valid
+	int			confidence;	// percent of the window that agrees with the distance
+};
+
+void sonic_window_init(struct sonic_window *w, enum sonic_filter filter, int window);
+void sonic_window_reset(struct sonic_window *w);
+
+// value is a raw sample in cm, -1 without an echo
+void sonic_window_add(struct sonic_window *w, int value);
+
+static inline int sonic_window_full(struct sonic_window *w)
+{
+	return w->cnt == w->window;
+}
+
+#endif
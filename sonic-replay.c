@@ -0,0 +1,473 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+
+/*
+ * Replays a recorded sonic stream through the range filters and scores
+ * them against the true distance. A stream is a text file, one ping per
+ * line: "usec raw_cm truth_cm [duty_right duty_left]", raw_cm is -1
+ * without an echo, truth_cm is -1 where it is not known, the duties are
+ * the commanded track duties at the ping (usec of TRACK_PERIOD, as
+ * track_get_duty_*() returns them; '#' starts a comment). Without a file
+ * a stream is read from stdin; -g writes a synthetic one instead: the
+ * tank drives to a wall and back, with sensor noise, lost echoes, short
+ * spurious ones and tracks slower than commanded.
+ *
+ * For every filter the report gives the share of pings without an
+ * output, the error against the truth (mean, 95th percentile, max and
+ * the bias, which is mostly lag while the distance changes), the share
+ * of outputs off by more than SPIKE_CM and the cost per sample. The old
+ * 5 sample average is scored too, as the reference. -o prints the
+ * filtered stream of one filter instead.
+ *
+ * With the duties the range predictor is replayed as well, ticking every
+ * RANGE_PERIOD like the device, and scored at every tick against the
+ * truth interpolated between the pings, next to what the tank had
+ * without it: the last raw sample and the last filtered distance.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "range-est.h"
+#include "sonic.h"
+#include "track.h"
+
+#define REPLAY_MAX_SAMPLES	1000000
+#define REPLAY_BENCH_NSEC	200000000LL	// replays a stream this long to time it
+#define SPIKE_CM		20
+
+#define GEN_PERIOD		60000	// usec between the pings
+#define GEN_NOISE		1.5	// cm, sensor noise deviation
+#define GEN_LOST		8	// percent of pings without an echo
+#define GEN_SPURIOUS		4	// percent of pings with a short spurious echo
+#define GEN_MODEL		85	// percent of the commanded speed the tracks make
+#define FULL_SPEED		60	// cm/s at the full duty, as tank -R
+
+struct sample {
+	long long	usec;
+	int		raw, truth;
+	int		duty_right, duty_left;
+};
+
+struct stream {
+	struct sample	*s;
+	int		cnt;
+	int		duties;		// every sample has the track duties
+};
+
+// errors of one estimate against the truth
+struct range_score {
+	const char	*name;
+	int		n, blank;
+	long long	sum, bias;
+	int		*err;
+};
+
+// the old filter: average of the valid samples of the last five, at least three
+struct mean5 {
+	int	raw[5];
+	int	cnt, position, distance;
+};
+
+static void mean5_add(struct mean5 *m, int value)
+{
+	int i, n = 0, sum = 0;
+
+	m->raw[m->position] = value;
+	m->position = (m->position + 1) % 5;
+	if (m->cnt < 5)
+		m->cnt++;
+	for (i = 0; i < m->cnt; i++) {
+		if (m->raw[i] < 0)
+			continue;
+		sum += m->raw[i];
+		n++;
+	}
+	m->distance = (m->cnt == 5 && n >= 3) ? sum / n : -1;
+}
+
+struct filter_conf {
+	const char		*name;
+	enum sonic_filter	filter;
+	int			window;		// 0 for the old average
+};
+
+static const struct filter_conf confs[] = {
+	{ "mean",	SONIC_FILTER_MEDIAN,	0 },
+	{ "median",	SONIC_FILTER_MEDIAN,	3 },
+	{ "median",	SONIC_FILTER_MEDIAN,	5 },
+	{ "median",	SONIC_FILTER_MEDIAN,	9 },
+	{ "median",	SONIC_FILTER_MEDIAN,	15 },
+	{ "trimmed",	SONIC_FILTER_TRIMMED,	5 },
+	{ "trimmed",	SONIC_FILTER_TRIMMED,	9 },
+	{ "trimmed",	SONIC_FILTER_TRIMMED,	15 },
+};
+
+static long long now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// runs the filter over the stream, out[i] is the distance after sample i
+static void replay(const struct filter_conf *conf, struct stream *st, int *out, int *conf_out)
+{
+	struct sonic_window w;
+	struct mean5 m;
+	int i;
+
+	memset(&m, 0, sizeof(m));
+	sonic_window_init(&w, conf->filter, conf->window);
+	for (i = 0; i < st->cnt; i++) {
+		if (conf->window == 0) {
+			mean5_add(&m, st->s[i].raw);
+			out[i] = m.distance;
+			if (conf_out != NULL)
+				conf_out[i] = 0;
+			continue;
+		}
+		sonic_window_add(&w, st->s[i].raw);
+		out[i] = w.distance;
+		if (conf_out != NULL)
+			conf_out[i] = w.confidence;
+	}
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void score(const struct filter_conf *conf, struct stream *st, int *out, int *err)
+{
+	long long start, elapsed, sum = 0, bias = 0;
+	int i, n = 0, blank = 0, spikes = 0, runs = 0, e;
+
+	start = now_nsec();
+	do {
+		replay(conf, st, out, NULL);
+		runs++;
+		elapsed = now_nsec() - start;
+	} while (elapsed < REPLAY_BENCH_NSEC);
+
+	for (i = 0; i < st->cnt; i++) {
+		if (st->s[i].truth < 0)
+			continue;
+		if (out[i] < 0) {
+			blank++;
+			continue;
+		}
+		e = out[i] - st->s[i].truth;
+		bias += e;
+		err[n++] = abs(e);
+		sum += abs(e);
+		if (abs(e) > SPIKE_CM)
+			spikes++;
+	}
+	qsort(err, n, sizeof(int), cmp_int);
+
+	if (conf->window == 0)
+		printf("%-8s %6s", conf->name, "5");
+	else
+		printf("%-8s %6d", conf->name, conf->window);
+	if (n == 0) {
+		printf("  no output\n");
+		return;
+	}
+	printf(" %6.1f%% %7.2f %5d %5d %+7.2f %6.2f%% %8.1f\n",
+	       100.0 * blank / (n + blank), (double)sum / n, err[n * 95 / 100], err[n - 1],
+	       (double)bias / n, 100.0 * spikes / n, (double)elapsed / runs / st->cnt);
+}
+
+static int read_stream(FILE *f, struct stream *st)
+{
+	char line[256];
+	struct sample *s;
+	int n;
+
+	st->s = malloc(REPLAY_MAX_SAMPLES * sizeof(*st->s));
+	if (st->s == NULL)
+		return -1;
+	st->cnt = 0;
+	st->duties = 1;
+	while (fgets(line, sizeof(line), f) != NULL && st->cnt < REPLAY_MAX_SAMPLES) {
+		if (line[0] == '#')
+			continue;
+		s = &st->s[st->cnt];
+		n = sscanf(line, "%lld %d %d %d %d", &s->usec, &s->raw, &s->truth, &s->duty_right, &s->duty_left);
+		if (n < 3)
+			continue;
+		if (n < 5)
+			st->duties = 0;
+		st->cnt++;
+	}
+	return 0;
+}
+
+static double gen_gauss(unsigned *seed)
+{
+	double u1 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+// cm/s towards the wall: drive up, wait, back off, wait
+static int gen_speed(long long usec)
+{
+	long long t = usec % 10000000;
+
+	if (t < 4000000)
+		return 45;
+	if (t < 6000000)
+		return 0;
+	if (t < 9000000)
+		return -60;
+	return 0;
+}
+
+static void generate(int seconds, unsigned seed, int full_speed)
+{
+	long long usec;
+	double truth = 250;
+	int raw, duty;
+
+	printf("# synthetic run, seed %u: usec raw_cm truth_cm duty_right duty_left\n", seed);
+	for (usec = 0; usec < seconds * 1000000LL; usec += GEN_PERIOD) {
+		duty = gen_speed(usec) * 100 / GEN_MODEL * TRACK_PERIOD / full_speed;
+		if (duty > TRACK_PERIOD)
+			duty = TRACK_PERIOD;
+		if (duty < -TRACK_PERIOD)
+			duty = -TRACK_PERIOD;
+		truth -= gen_speed(usec) * GEN_PERIOD / 1e6;
+		if (truth < 20)
+			truth = 20;
+		if (rand_r(&seed) % 100 < GEN_LOST)
+			raw = -1;
+		else if (rand_r(&seed) % 100 < GEN_SPURIOUS)
+			raw = 10 + rand_r(&seed) % (int)truth;
+		else
+			raw = (int)lround(truth + GEN_NOISE * gen_gauss(&seed));
+		printf("%lld %d %d %d %d\n", usec, raw, (int)lround(truth), duty, duty);
+	}
+}
+
+static void range_score_add(struct range_score *sc, int value, int truth)
+{
+	int e;
+
+	if (value < 0) {
+		sc->blank++;
+		return;
+	}
+	e = value - truth;
+	sc->err[sc->n++] = abs(e);
+	sc->sum += abs(e);
+	sc->bias += e;
+}
+
+static void range_score_print(struct range_score *sc)
+{
+	qsort(sc->err, sc->n, sizeof(int), cmp_int);
+	if (sc->n == 0) {
+		printf("%-16s no output\n", sc->name);
+		return;
+	}
+	printf("%-16s %6.1f%% %7.2f %5d %5d %+7.2f\n", sc->name, 100.0 * sc->blank / (sc->n + sc->blank),
+	       (double)sc->sum / sc->n, sc->err[sc->n * 95 / 100], sc->err[sc->n - 1], (double)sc->bias / sc->n);
+}
+
+// usec from the trigger until the echo is in, as the sonic device sees it
+static int echo_usec(int raw)
+{
+	return raw >= 0 ? raw * 1000 / 17 + 200 : SONIC_PERIOD / 2;
+}
+
+// nsec per predict and per update of the fixed point filter
+static void range_bench(double *predict, double *update)
+{
+	struct range_kf kf;
+	long long start;
+	int i, runs = 1000000;
+
+	memset(&kf, 0, sizeof(kf));
+	range_kf_update(&kf, 0, 100, 0);
+	start = now_nsec();
+	for (i = 0; i < runs; i++)
+		range_kf_predict(&kf, 40 * 256, RANGE_PERIOD);
+	*predict = (double)(now_nsec() - start) / runs;
+
+	start = now_nsec();
+	for (i = 0; i < runs; i++)
+		range_kf_update(&kf, 40 * 256, 100 + (i & 7), 2000 + (i & 1023));
+	*update = (double)(now_nsec() - start) / runs;
+}
+
+/*
+ * The predictor ticks every RANGE_PERIOD as the device does, a sample is
+ * taken in at the first tick after its echo, with its age. Every tick is
+ * scored against the truth interpolated between the pings around it.
+ */
+static void range_evaluate(struct stream *st, int full_speed)
+{
+	struct range_score kf_score = { .name = "predictor" };
+	struct range_score raw_score = { .name = "last raw" };
+	struct range_score win_score = { .name = "last median5" };
+	struct sonic_window w;
+	struct range_kf kf;
+	long long t, u = 0, last_update = 0, closing_err = 0;
+	int j = 0, k = 0, ticks = 0, closing_n = 0, held_raw = -1, truth, closing;
+	double predict, update;
+
+	kf_score.err = malloc((st->s[st->cnt - 1].usec - st->s[0].usec) / RANGE_PERIOD * sizeof(int) + sizeof(int));
+	raw_score.err = malloc((st->s[st->cnt - 1].usec - st->s[0].usec) / RANGE_PERIOD * sizeof(int) + sizeof(int));
+	win_score.err = malloc((st->s[st->cnt - 1].usec - st->s[0].usec) / RANGE_PERIOD * sizeof(int) + sizeof(int));
+	if ((kf_score.err == NULL) || (raw_score.err == NULL) || (win_score.err == NULL)) {
+		perror("malloc");
+		return;
+	}
+	memset(&kf, 0, sizeof(kf));
+	sonic_window_init(&w, SONIC_FILTER_MEDIAN, SONIC_WINDOW);
+
+	for (t = st->s[0].usec; t < st->s[st->cnt - 1].usec; t += RANGE_PERIOD, ticks++) {
+		while ((k + 1 < st->cnt) && (st->s[k + 1].usec <= t))
+			k++;
+		if (kf.valid)
+			range_kf_predict(&kf, u, RANGE_PERIOD);
+		u = range_kf_commanded(full_speed, st->s[k].duty_right, st->s[k].duty_left);
+
+		while ((j < st->cnt) && (st->s[j].usec + echo_usec(st->s[j].raw) <= t)) {
+			if (st->s[j].raw >= 0) {
+				range_kf_update(&kf, u, st->s[j].raw, t - st->s[j].usec);
+				last_update = t;
+				held_raw = st->s[j].raw;
+			}
+			sonic_window_add(&w, st->s[j].raw);
+			j++;
+		}
+		if (kf.valid && (t - last_update > RANGE_HOLD))
+			kf.valid = 0;
+
+		if ((st->s[k].truth < 0) || (st->s[k + 1].truth < 0))
+			continue;
+		truth = st->s[k].truth + (int)((st->s[k + 1].truth - st->s[k].truth) * (t - st->s[k].usec) /
+					       (st->s[k + 1].usec - st->s[k].usec));
+		range_score_add(&kf_score, range_kf_distance(&kf), truth);
+		range_score_add(&raw_score, held_raw, truth);
+		range_score_add(&win_score, w.distance, truth);
+
+		if (kf.valid) {
+			closing = (int)((long long)(st->s[k].truth - st->s[k + 1].truth) * 1000000 /
+					(st->s[k + 1].usec - st->s[k].usec));
+			closing_err += llabs(range_kf_closing(&kf, u) - closing);
+			closing_n++;
+		}
+	}
+
+	range_bench(&predict, &update);
+	printf("\nrange predictor, %d ticks of %d usec, full speed %d cm/s\n", ticks, RANGE_PERIOD, full_speed);
+	printf("estimate          blank   err cm   p95   max    bias\n");
+	range_score_print(&kf_score);
+	range_score_print(&raw_score);
+	range_score_print(&win_score);
+	printf("closing rate error %.1f cm/s mean, predict %.1f nsec, update %.1f nsec\n",
+	       closing_n ? (double)closing_err / closing_n : 0.0, predict, update);
+	free(kf_score.err);
+	free(raw_score.err);
+	free(win_score.err);
+}
+
+int main(int argc, char *argv[])
+{
+	struct filter_conf out_conf = { NULL, SONIC_FILTER_MEDIAN, SONIC_WINDOW };
+	struct stream st;
+	FILE *f = stdin;
+	int *out, *conf, *err;
+	int opt, i, gen = 0, full_speed = FULL_SPEED;
+	unsigned seed = 1;
+	char *p;
+
+	while ((opt = getopt(argc, argv, "g:s:o:f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			full_speed = atoi(optarg);
+			break;
+		case 'g':
+			gen = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out_conf.name = optarg;
+			p = strchr(optarg, ':');
+			if (p != NULL)
+				out_conf.window = atoi(p + 1);
+			if (strncmp(optarg, "trimmed", 7) == 0)
+				out_conf.filter = SONIC_FILTER_TRIMMED;
+			else if (strncmp(optarg, "mean", 4) == 0)
+				out_conf.window = 0;
+			else if (strncmp(optarg, "median", 6) != 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (gen > 0) {
+		generate(gen, seed, full_speed);
+		return 0;
+	}
+	if ((optind < argc) && ((f = fopen(argv[optind], "r")) == NULL)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (read_stream(f, &st) != 0) {
+		perror("malloc");
+		return 1;
+	}
+	if (st.cnt == 0) {
+		fprintf(stderr, "no samples\n");
+		return 1;
+	}
+	out = malloc(st.cnt * sizeof(int));
+	conf = malloc(st.cnt * sizeof(int));
+	err = malloc(st.cnt * sizeof(int));
+	if ((out == NULL) || (conf == NULL) || (err == NULL)) {
+		perror("malloc");
+		return 1;
+	}
+
+	if (out_conf.name != NULL) {
+		replay(&out_conf, &st, out, conf);
+		printf("# usec raw_cm truth_cm distance_cm confidence\n");
+		for (i = 0; i < st.cnt; i++)
+			printf("%lld %d %d %d %d\n", st.s[i].usec, st.s[i].raw, st.s[i].truth, out[i], conf[i]);
+		return 0;
+	}
+
+	printf("%d samples\n", st.cnt);
+	printf("filter   window  blank   err cm   p95   max    bias  >%dcm  nsec/sample\n", SPIKE_CM);
+	for (i = 0; i < (int)(sizeof(confs) / sizeof(confs[0])); i++)
+		score(&confs[i], &st, out, err);
+	if (st.duties && (st.cnt > 1))
+		range_evaluate(&st, full_speed);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-f full_speed] [-o filter[:window]] [stream]\n"
+			"       %s -g seconds [-s seed] [-f full_speed] > stream\n"
+			"  filter: median, trimmed or mean (the old 5 sample average)\n"
+			"  full_speed: cm/s at the full track duty (%d), as tank -R\n",
+		argv[0], argv[0], FULL_SPEED);
+	return 1;
+}
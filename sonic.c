@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <string.h>
 #include "sonic.h"
+#include "gpio-out.h"
+#include "metrics.h"
 #include <stdio.h>
 
 #define OFF	0
@@ -16,7 +18,15 @@ enum sonic_state {
 
 struct sonic_priv {
 	struct gpiod_line *in, *out;
-	int distance[5], position, cnt, last_dist, mode;
+	struct gpio_out trig;
+	struct sonic_window win;
+	int mode;
+	int last_raw, request;
+	unsigned pings;
+	struct timespec ping_start, ready;	// last ping trigger, earliest next trigger
+	int min_period;	// adaptive ranging, 0 if off
+	sonic_listener_t listener;
+	void *listener_ctx;
 	struct timespec start_time, start_signal;
 	enum sonic_state state;
 };
@@ -34,9 +44,19 @@ void sonic_change_mode (struct device *dev, int mode) {
 	priv->mode = mode;
 };
 
+void sonic_set_adaptive (struct device *dev, int min_period) {
+	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
+	priv->min_period = (min_period > 0 && min_period < SONIC_PERIOD) ? min_period : 0;
+};
+
 int sonic_get_distance (struct device *dev) {
 	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
-	return priv->last_dist;
+	return priv->win.distance;
+};
+
+int sonic_get_confidence (struct device *dev) {
+	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
+	return priv->win.confidence;
 };
 
 int sonic_start_request (struct device *dev) {
@@ -45,35 +65,79 @@ int sonic_start_request (struct device *dev) {
 	if (dev->state!=DEV_STATE_STOPPED) return -EINVAL;
 	dev->state=DEV_STATE_STARTING;
 	priv->state = SONIC_OFF;
-	priv->position = 0;
-	priv->cnt = 0;
-	priv->last_dist = -1;
+	sonic_window_reset(&priv->win);
 	return 0;
 };
 
 
 void sonic_destroy_priv (struct device *dev) {
 	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
-	gpiod_line_set_value (priv->out, OFF);
+	gpio_out_set (&priv->trig, OFF);
 	free (priv);
 };
 
 void sonic_add_value(struct sonic_priv *priv, int value) {
-	priv->distance[priv->position++]=value;
-	if (priv->position >= 5) priv->position = 0;
-	if (priv->cnt < 5) priv->cnt++;
-	if (priv->cnt < 5) return;
-
-	int distance=0, cnt=0;
-	for (int i=0; i<5;i++){
-		if (priv->distance[i]<0) continue;
-		distance+=priv->distance[i];
-		cnt++;
+	metrics_add(value < 0 ? METRICS_SONIC_INVALID : METRICS_SONIC_VALID, 1);
+	sonic_window_add(&priv->win, value);
+}
+
+/*
+ * A near echo (echo_end is set) lets the sensor fire again after the
+ * ring-down guard, otherwise the next ping waits the full period.
+ */
+static void sonic_ping_done(struct device *dev, struct sonic_priv *priv, int value, struct timespec *echo_end) {
+	sonic_add_value(priv, value);
+	priv->last_raw = value;
+	priv->ping_start = priv->start_time;
+	priv->pings++;
+	priv->state = SONIC_OFF;
+	if (priv->listener != NULL) priv->listener(priv->listener_ctx, value, &priv->start_time);
+
+	if (echo_end != NULL) device_timespec_update(&priv->ready, echo_end, SONIC_GUARD);
+	else device_timespec_update(&priv->ready, &priv->start_time, SONIC_PERIOD);
+
+	if (priv->mode == SONIC_MODE_DEMAND || (echo_end != NULL && priv->min_period != 0)) {
+		dev->next_action = priv->ready;
+		if (priv->mode != SONIC_MODE_DEMAND &&
+		    device_timespec_diff(&dev->next_action, &priv->start_time) < priv->min_period)
+			device_timespec_update(&dev->next_action, &priv->start_time, priv->min_period);
+		return;
 	}
-	if (cnt >= 3) priv->last_dist=distance/cnt;
-	else priv->last_dist = -1;
+	device_timespec_update(&dev->next_action, &priv->start_time, SONIC_PERIOD);
 }
 
+void sonic_ping (struct device *dev, struct timespec *ts) {
+	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
+
+	priv->request = 1;
+	if (dev->state == DEV_STATE_STOPPED) {
+		dev->state = DEV_STATE_STARTED;
+		priv->state = SONIC_OFF;
+	} else if (priv->state != SONIC_OFF || priv->mode != SONIC_MODE_DEMAND) return;
+
+	dev->next_action = *ts;
+	if (device_timespec_cmp(&priv->ready, ts) > 0) dev->next_action = priv->ready;
+};
+
+unsigned sonic_last_ping (struct device *dev, int *value, struct timespec *start) {
+	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
+
+	*value = priv->last_raw;
+	*start = priv->ping_start;
+	return priv->pings;
+};
+
+void sonic_set_listener (struct device *dev, sonic_listener_t listener, void *ctx) {
+	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
+	priv->listener = listener;
+	priv->listener_ctx = ctx;
+};
+
+int sonic_get_mode (struct device *dev) {
+	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
+	return priv->mode;
+};
+
 void sonic_timer_action (struct device *dev, struct timespec *ts) {
 	struct sonic_priv *priv = (struct sonic_priv *) dev->priv;
 	int period_time=device_timespec_diff(ts, &priv->start_time);
@@ -83,29 +147,30 @@ void sonic_timer_action (struct device *dev, struct timespec *ts) {
 		dev->state=DEV_STATE_STARTED;
 	};
 	if (priv->state == SONIC_OFF) {
-		if (dev->state==DEV_STATE_STOPPING || (priv->mode == 0 && priv->cnt == 5)) {
+		if (dev->state==DEV_STATE_STOPPING || (priv->mode == SONIC_MODE_SINGLE && sonic_window_full(&priv->win)) ||
+		    (priv->mode == SONIC_MODE_DEMAND && !priv->request)) {
 			dev->state=DEV_STATE_STOPPED;
 			return;
 		};
+		priv->request = 0;
 		priv->state = SEND_PULSE;
-		gpiod_line_set_value (priv->out, ON);
+		gpio_out_set (&priv->trig, ON);
 		priv->start_time=*ts;
 		device_timespec_update(&dev->next_action, ts, 10);
 		return;
 	};
 	if (priv->state == SEND_PULSE){
 		priv->state=WAIT_REPLY;
-		gpiod_line_set_value (priv->out, OFF);
+		gpio_out_set (&priv->trig, OFF);
 		device_timespec_update(&dev->next_action, ts,100);
 		return;
 	};
 	if (priv->state == WAIT_REPLY){
 		if(period_time >= SONIC_PERIOD / 2){
-			sonic_add_value(priv, -1);
-			priv->state = SONIC_OFF;
-			device_timespec_update(&dev->next_action, &priv->start_time, SONIC_PERIOD);
+			sonic_ping_done(dev, priv, -1, NULL);
 			return;
 		};
+		metrics_add(METRICS_GPIO_SYSCALLS, 1);
 		if (gpiod_line_get_value(priv->in)==OFF){
 			device_timespec_update(&dev->next_action, ts,15);
 			return;
@@ -116,15 +181,14 @@ void sonic_timer_action (struct device *dev, struct timespec *ts) {
 		return;
 	}
 	if (priv->state == REPLY_TIME){
+		metrics_add(METRICS_GPIO_SYSCALLS, 1);
 		if (gpiod_line_get_value(priv->in)==OFF){
-			sonic_add_value(priv, calculate_distance(device_timespec_diff(ts, &priv->start_signal)));
-			priv->state = SONIC_OFF;
-			device_timespec_update(&dev->next_action, &priv->start_time, SONIC_PERIOD);
+			int echo = device_timespec_diff(ts, &priv->start_signal);
+			sonic_ping_done(dev, priv, calculate_distance(echo), echo < SONIC_NEAR_ECHO ? ts : NULL);
 			return;
 		}
 		if(period_time >= SONIC_PERIOD){
-			sonic_add_value(priv, -1);
-			priv->state = SONIC_OFF;
+			sonic_ping_done(dev, priv, -1, NULL);
 			return;
 		}
 		device_timespec_update(&dev->next_action, ts,15);
@@ -139,7 +203,8 @@ struct device_ops sonic_ops={
 	.destroy_priv=sonic_destroy_priv
 };
 
-int sonic_init (struct device *dev, struct gpiod_line *in, struct gpiod_line *out)
+int sonic_init (struct device *dev, struct gpiod_line *in, struct gpiod_line *out,
+		enum sonic_filter filter, int window)
 {
 	struct sonic_priv *priv;
 	int ret;
@@ -150,10 +215,11 @@ int sonic_init (struct device *dev, struct gpiod_line *in, struct gpiod_line *ou
 	memset (priv, 0, sizeof(struct sonic_priv));
 
 	priv->mode = 0;
-	priv->last_dist = -1;
+	sonic_window_init(&priv->win, filter, window);
 
 	priv->out = out;
 	gpiod_line_request_output (priv->out, "sonic", OFF);
+	gpio_out_init (&priv->trig, priv->out);
 
 	priv->in = in;
 	gpiod_line_request_input (priv->in, "sonic");
@@ -3,12 +3,48 @@
 
 #include <gpiod.h>
 #include "device.h"
+#include "sonic-filter.h"
 
 #define SONIC_PERIOD	60000
+#define SONIC_GUARD	2000	// usec of ring-down after the echo before the next trigger
+#define SONIC_NEAR_ECHO	15000	// usec, longer echoes (about 2.5 m) keep the full period
 
-int sonic_init (struct device *dev, struct gpiod_line *in, struct gpiod_line *out);
+#define SONIC_MODE_SINGLE	0	// a window of pings, then stop
+#define SONIC_MODE_CONTINUOUS	1
+#define SONIC_MODE_DEMAND	2	// one ping per sonic_ping() call
+
+/*
+ * window is the number of last samples the distance is filtered over,
+ * it is published once more than half of them are valid.
+ */
+int sonic_init (struct device *dev, struct gpiod_line *in, struct gpiod_line *out,
+		enum sonic_filter filter, int window);
 
 int sonic_get_distance (struct device *dev);
 
+// percent of the window that agrees with the distance, 0 if there is none
+int sonic_get_confidence (struct device *dev);
+
 void sonic_change_mode (struct device *dev, int mode);
+int  sonic_get_mode (struct device *dev);
+
+/*
+ * Asks for a ping as soon as the sensor is ready (SONIC_MODE_DEMAND),
+ * the raw result of the last ping and its trigger time are read with
+ * sonic_last_ping(), it returns the number of pings done so far.
+ */
+void sonic_ping (struct device *dev, struct timespec *ts);
+unsigned sonic_last_ping (struct device *dev, int *value, struct timespec *start);
+
+/*
+ * Adaptive ranging: after a near echo the next trigger goes out once the
+ * guard time passed, but not earlier than min_period (usec) after the
+ * previous one. Far echoes and misses still wait SONIC_PERIOD. 0
+ * disables it.
+ */
+void sonic_set_adaptive (struct device *dev, int min_period);
+
+// called by the loop thread with every raw sample (-1 without an echo) and its trigger time
+typedef void (*sonic_listener_t)(void *ctx, int value, struct timespec *start);
+void sonic_set_listener (struct device *dev, sonic_listener_t listener, void *ctx);
 #endif
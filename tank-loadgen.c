@@ -0,0 +1,541 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+
+/*
+ * Load generator for the tank server. Every step opens the given number
+ * of connections, a few of them stream traced commands (only one of them
+ * gets the control, the rest exercise the reject path), the others just
+ * watch. The step reports handshake time, command acknowledge latency,
+ * telemetry rate per client and, if the metrics endpoint is given, the
+ * device loop jitter of the server. Run the server on the simulated GPIO
+ * backend (tank-sim) to load it on any box.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "client_server.h"
+
+#define LOADGEN_MAX_CLIENTS	1024
+#define LOADGEN_MAX_STEPS	16
+#define LOADGEN_SAMPLES		65536
+#define LOADGEN_TRACE_IDS	256
+#define LOADGEN_SETTLE		200000	// usec, lets the server drop the previous step
+#define LOADGEN_HANDSHAKE_WAIT	5000000	// usec
+#define LOADGEN_IN_SIZE		256
+
+enum loadgen_phase {
+	LOADGEN_CONNECTING,
+	LOADGEN_HELLO,
+	LOADGEN_WAIT_STATE,	// hello sent, the first telemetry frame confirms the handshake
+	LOADGEN_RUNNING,
+	LOADGEN_CLOSED,
+};
+
+struct loadgen_client {
+	int			fd;
+	enum loadgen_phase	phase;
+	int			controller;	// streams commands
+	long long		start, next_cmd, last_send;
+	unsigned		frames, key;
+	uint16_t		id;
+	long long		sent[LOADGEN_TRACE_IDS];
+	int			bytes;
+	char			buf[LOADGEN_IN_SIZE];
+};
+
+struct loadgen_samples {
+	int			cnt;
+	int			val[LOADGEN_SAMPLES];
+};
+
+struct loadgen_metrics {
+	double			wakeups, jitter, jitter_max, iterations, duration;
+	double			dropped, rejected, bytes_out;
+};
+
+struct loadgen {
+	struct addrinfo		*addr;
+	const char		*metrics_host, *metrics_port;
+	int			clients, controllers, rate, duration;
+	struct loadgen_client	client[LOADGEN_MAX_CLIENTS];
+	struct pollfd		pfd[LOADGEN_MAX_CLIENTS];
+	struct loadgen_samples	handshake, ack;
+	int			failed;
+};
+
+// the commands toggle the tracks and a LED, so every one changes the telemetry
+static const char loadgen_keys[] = {
+	TANK_CLNT_CMD_FORWARD, TANK_CLNT_CMD_RED_LED, TANK_CLNT_CMD_STOP, TANK_CLNT_CMD_RED_LED,
+};
+
+static long long loadgen_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void loadgen_sample(struct loadgen_samples *s, long long usec)
+{
+	if (s->cnt < LOADGEN_SAMPLES)
+		s->val[s->cnt++] = usec;
+}
+
+static int loadgen_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static int loadgen_percentile(struct loadgen_samples *s, int permille)
+{
+	if (s->cnt == 0)
+		return -1;
+	return s->val[(long long)(s->cnt - 1) * permille / 1000];
+}
+
+static int loadgen_parse_list(const char *arg, int *val, int max)
+{
+	char *end;
+	int cnt = 0;
+
+	while (cnt < max) {
+		val[cnt] = strtol(arg, &end, 10);
+		if ((end == arg) || (val[cnt] <= 0))
+			return -1;
+		cnt++;
+		if (*end == '\0')
+			return cnt;
+		if (*end != ',')
+			return -1;
+		arg = end + 1;
+	}
+	return -1;
+}
+
+/*
+ * Scrapes the metrics endpoint, values of a name are summed over all
+ * label sets. Returns -1 if the endpoint is not available.
+ */
+static int loadgen_scrape(struct loadgen *lg, struct loadgen_metrics *m)
+{
+	static char buf[65536];
+	static const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	struct addrinfo hints, *res;
+	char *line, *val, *save;
+	double *dst;
+	int fd, len = 0, ret;
+
+	memset(m, 0, sizeof(*m));
+	if (lg->metrics_port == NULL)
+		return -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(lg->metrics_host, lg->metrics_port, &hints, &res) != 0)
+		return -1;
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if ((fd < 0) || (connect(fd, res->ai_addr, res->ai_addrlen) != 0) ||
+	    (write(fd, req, sizeof(req) - 1) != sizeof(req) - 1)) {
+		if (fd >= 0)
+			close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+	while ((len < (int)sizeof(buf) - 1) && ((ret = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0))
+		len += ret;
+	close(fd);
+	buf[len] = '\0';
+
+	for (line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		if (line[0] == '#')
+			continue;
+		val = strrchr(line, ' ');
+		if (val == NULL)
+			continue;
+		if (!strncmp(line, "tank_loop_wakeups_total", 23))		dst = &m->wakeups;
+		else if (!strncmp(line, "tank_loop_jitter_usec_total", 27))	dst = &m->jitter;
+		else if (!strncmp(line, "tank_loop_jitter_max_usec", 25))	dst = &m->jitter_max;
+		else if (!strncmp(line, "tank_loop_iterations_total", 26))	dst = &m->iterations;
+		else if (!strncmp(line, "tank_loop_duration_usec_total", 29))	dst = &m->duration;
+		else if (!strncmp(line, "tank_net_dropped_frames_total", 29))	dst = &m->dropped;
+		else if (!strncmp(line, "tank_net_rejected_commands_total", 32))	dst = &m->rejected;
+		else if (!strncmp(line, "tank_net_bytes_out_total", 24))	dst = &m->bytes_out;
+		else continue;
+		*dst += atof(val + 1);
+	}
+	return 0;
+}
+
+static int loadgen_send(struct loadgen_client *c, const void *buf, int len, long long now)
+{
+	if (write(c->fd, buf, len) != len)
+		return -1;
+	c->last_send = now;
+	return 0;
+}
+
+static int loadgen_connect(struct loadgen *lg, struct loadgen_client *c, int controller)
+{
+	int one = 1;
+
+	memset(c, 0, sizeof(*c));
+	c->controller = controller;
+	c->start = loadgen_usec();
+	c->fd = socket(lg->addr->ai_family, lg->addr->ai_socktype | SOCK_NONBLOCK, lg->addr->ai_protocol);
+	if (c->fd < 0)
+		return -errno;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((connect(c->fd, lg->addr->ai_addr, lg->addr->ai_addrlen) != 0) && (errno != EINPROGRESS)) {
+		close(c->fd);
+		c->fd = -1;
+		return -errno;
+	}
+	c->phase = LOADGEN_CONNECTING;
+	return 0;
+}
+
+static void loadgen_close(struct loadgen *lg, struct loadgen_client *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	if (c->phase != LOADGEN_RUNNING)
+		lg->failed++;
+	c->phase = LOADGEN_CLOSED;
+}
+
+// returns the size of the first message in the buffer, 0 if it is incomplete
+static int loadgen_msg_size(struct loadgen_client *c)
+{
+	int size;
+
+	switch (c->buf[0]) {
+	case TANK_SRV_MSG_TYPE_ALIVE_CHECK:
+		size = 1;
+		break;
+	case TANK_SRV_MSG_TYPE_ROLE:
+		size = TANK_SRV_MSG_ROLE_SIZE;
+		break;
+	case TANK_SRV_MSG_TYPE_CLOCK:
+		size = TANK_SRV_MSG_CLOCK_SIZE;
+		break;
+	case TANK_SRV_MSG_TYPE_TRACE:
+		size = TANK_SRV_MSG_TRACE_SIZE;
+		break;
+	case TANK_SRV_MSG_TYPE_MACRO:
+		size = TANK_SRV_MSG_MACRO_SIZE;
+		break;
+	case TANK_SRV_MSG_TYPE_SCAN:
+		size = TANK_SRV_MSG_SCAN_SIZE;
+		break;
+	case TANK_SRV_MSG_TYPE_TILE:
+		size = TANK_SRV_MSG_TILE_SIZE;
+		break;
+	case TANK_SRV_MSG_TYPE_INFO_DATA:
+		size = sizeof(struct tank_srv_msg);
+		break;
+	default:
+		return -1;
+	}
+	return (c->bytes >= size) ? size : 0;
+}
+
+static int loadgen_input(struct loadgen *lg, struct loadgen_client *c, long long now)
+{
+	int hellc = strlen(HELLO_CLIENT), ret, size;
+	struct tank_srv_msg msg;
+	char heartbeat = TANK_CLNT_CMD_CONNECT_CHEK, take = TANK_CLNT_CMD_TAKE_CONTROL;
+
+	ret = read(c->fd, c->buf + c->bytes, sizeof(c->buf) - c->bytes);
+	if (ret <= 0)
+		return ((ret < 0) && (errno == EAGAIN)) ? 0 : -1;
+	c->bytes += ret;
+
+	if (c->phase == LOADGEN_HELLO) {
+		if (c->bytes < hellc)
+			return 0;
+		if (strncmp(c->buf, HELLO_CLIENT, hellc) != 0)
+			return -1;
+		c->bytes -= hellc;
+		memmove(c->buf, c->buf + hellc, c->bytes);
+		if (loadgen_send(c, HELLO_SERVER, strlen(HELLO_SERVER), now) != 0)
+			return -1;
+		c->phase = LOADGEN_WAIT_STATE;
+	}
+
+	while ((c->bytes > 0) && ((size = loadgen_msg_size(c)) != 0)) {
+		if (size < 0)
+			return -1;
+		memcpy(&msg, c->buf, size);
+		c->bytes -= size;
+		memmove(c->buf, c->buf + size, c->bytes);
+
+		switch (msg.type) {
+		case TANK_SRV_MSG_TYPE_ALIVE_CHECK:
+			if (loadgen_send(c, &heartbeat, 1, now) != 0)
+				return -1;
+			break;
+		case TANK_SRV_MSG_TYPE_TRACE:
+			loadgen_sample(&lg->ack, now - c->sent[ntohs(msg.trace.id) % LOADGEN_TRACE_IDS]);
+			break;
+		case TANK_SRV_MSG_TYPE_INFO_DATA:
+			c->frames++;
+			if (c->phase != LOADGEN_WAIT_STATE)
+				break;
+			loadgen_sample(&lg->handshake, now - c->start);
+			c->phase = LOADGEN_RUNNING;
+			c->frames = 0;
+			c->next_cmd = now;
+			if (c->controller && (loadgen_send(c, &take, 1, now) != 0))
+				return -1;
+			break;
+		}
+	}
+	return 0;
+}
+
+static int loadgen_output(struct loadgen *lg, struct loadgen_client *c, long long now)
+{
+	struct tank_clnt_traced cmd;
+	char heartbeat = TANK_CLNT_CMD_CONNECT_CHEK;
+
+	if ((c->phase != LOADGEN_RUNNING) || !c->controller)
+		return 0;
+
+	if (now >= c->next_cmd) {
+		cmd.cmd = TANK_CLNT_CMD_TRACED;
+		cmd.key = loadgen_keys[c->key++ % sizeof(loadgen_keys)];
+		cmd.id = htons(c->id);
+		c->sent[c->id++ % LOADGEN_TRACE_IDS] = now;
+		c->next_cmd += 1000000 / lg->rate;
+		// don't burst to catch up after a stall
+		if (c->next_cmd < now)
+			c->next_cmd = now;
+		return loadgen_send(c, &cmd, sizeof(cmd), now);
+	}
+	// keep the control lease
+	if (now - c->last_send >= TANK_CLNT_HEARTBEAT_PERIOD)
+		return loadgen_send(c, &heartbeat, 1, now);
+	return 0;
+}
+
+static void loadgen_poll(struct loadgen *lg, long long until, int running_only)
+{
+	struct loadgen_client *c;
+	long long now, wake;
+	int i, err, running;
+	socklen_t len;
+
+	while ((now = loadgen_usec()) < until) {
+		running = 0;
+		wake = until;
+		for (i = 0; i < lg->clients; i++) {
+			c = &lg->client[i];
+			lg->pfd[i].fd = c->fd;
+			lg->pfd[i].events = (c->phase == LOADGEN_CONNECTING) ? POLLOUT : POLLIN;
+			lg->pfd[i].revents = 0;
+			if (c->phase == LOADGEN_RUNNING) {
+				running++;
+				if (c->controller && (c->next_cmd < wake))
+					wake = c->next_cmd;
+			}
+		}
+		if (running_only && (running + lg->failed == lg->clients))
+			return;
+
+		poll(lg->pfd, lg->clients, (wake > now) ? (wake - now + 999) / 1000 : 0);
+		now = loadgen_usec();
+
+		for (i = 0; i < lg->clients; i++) {
+			c = &lg->client[i];
+			if (c->fd < 0)
+				continue;
+			if (c->phase == LOADGEN_CONNECTING) {
+				if (!(lg->pfd[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+					continue;
+				len = sizeof(err);
+				if ((getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0)) {
+					loadgen_close(lg, c);
+					continue;
+				}
+				c->phase = LOADGEN_HELLO;
+				continue;
+			}
+			if ((lg->pfd[i].revents & (POLLIN | POLLERR | POLLHUP)) && (loadgen_input(lg, c, now) != 0)) {
+				loadgen_close(lg, c);
+				continue;
+			}
+			if (loadgen_output(lg, c, now) != 0)
+				loadgen_close(lg, c);
+		}
+	}
+}
+
+static void loadgen_step(struct loadgen *lg, int clients, int rate)
+{
+	struct loadgen_metrics m0, m1;
+	unsigned frames_min = ~0u;
+	unsigned long long frames = 0;
+	long long start, end;
+	int i, running = 0, scraped;
+	double wakeups, iterations;
+
+	lg->clients = clients;
+	lg->rate = rate;
+	lg->failed = 0;
+	lg->handshake.cnt = 0;
+	lg->ack.cnt = 0;
+
+	start = loadgen_usec();
+	for (i = 0; i < clients; i++) {
+		if (loadgen_connect(lg, &lg->client[i], i < lg->controllers) != 0)
+			loadgen_close(lg, &lg->client[i]);
+	}
+	loadgen_poll(lg, start + LOADGEN_HANDSHAKE_WAIT, 1);
+
+	// the measured window starts once everybody is in
+	lg->ack.cnt = 0;
+	for (i = 0; i < clients; i++)
+		lg->client[i].frames = 0;
+	scraped = loadgen_scrape(lg, &m0) == 0;
+	start = loadgen_usec();
+	loadgen_poll(lg, start + lg->duration * 1000000LL, 0);
+	end = loadgen_usec();
+	scraped = scraped && (loadgen_scrape(lg, &m1) == 0);
+
+	for (i = 0; i < clients; i++) {
+		if (lg->client[i].phase == LOADGEN_RUNNING) {
+			running++;
+			frames += lg->client[i].frames;
+			if (lg->client[i].frames < frames_min)
+				frames_min = lg->client[i].frames;
+		}
+		loadgen_close(lg, &lg->client[i]);
+	}
+
+	qsort(lg->handshake.val, lg->handshake.cnt, sizeof(int), loadgen_cmp);
+	qsort(lg->ack.val, lg->ack.cnt, sizeof(int), loadgen_cmp);
+	if (running == 0)
+		frames_min = 0;
+
+	printf("%7d %5d %5d | %7d %7d | %7d %7d %7d %7.1f | %7.2f %7.2f",
+	       clients, rate, clients - running,
+	       loadgen_percentile(&lg->handshake, 500), loadgen_percentile(&lg->handshake, 990),
+	       loadgen_percentile(&lg->ack, 500), loadgen_percentile(&lg->ack, 990),
+	       loadgen_percentile(&lg->ack, 1000), lg->ack.cnt * 1e6 / (end - start),
+	       running ? frames * 1e6 / running / (end - start) : 0.0, frames_min * 1e6 / (end - start));
+	if (scraped) {
+		wakeups = m1.wakeups - m0.wakeups;
+		iterations = m1.iterations - m0.iterations;
+		printf(" | %7.1f %7.0f %7.1f | %7.0f %7.0f %9.0f",
+		       wakeups > 0 ? (m1.jitter - m0.jitter) / wakeups : 0.0, m1.jitter_max,
+		       iterations > 0 ? (m1.duration - m0.duration) / iterations : 0.0,
+		       m1.dropped - m0.dropped, m1.rejected - m0.rejected,
+		       (m1.bytes_out - m0.bytes_out) * 1e6 / (end - start));
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct loadgen lg;
+	struct addrinfo hints;
+	const char *host = "127.0.0.1", *port = NULL;
+	int clients[LOADGEN_MAX_STEPS] = { 16, 64, 256 }, rates[LOADGEN_MAX_STEPS] = { 20 };
+	int n_clients = 3, n_rates = 1, opt, i, j, ret;
+
+	lg.controllers = 1;
+	lg.duration = 5;
+	lg.metrics_host = host;
+
+	while ((opt = getopt(argc, argv, "H:M:n:c:r:t:")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			lg.metrics_host = optarg;
+			break;
+		case 'M':
+			lg.metrics_port = optarg;
+			break;
+		case 'n':
+			n_clients = loadgen_parse_list(optarg, clients, LOADGEN_MAX_STEPS);
+			if (n_clients < 0)
+				goto usage;
+			break;
+		case 'c':
+			lg.controllers = atoi(optarg);
+			break;
+		case 'r':
+			n_rates = loadgen_parse_list(optarg, rates, LOADGEN_MAX_STEPS);
+			if (n_rates < 0)
+				goto usage;
+			break;
+		case 't':
+			lg.duration = atoi(optarg);
+			if (lg.duration <= 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind + 1 != argc) {
+usage:
+		fprintf(stderr, "Usage: %s [-H host] [-M metrics_port] [-n clients[,clients]...]\n"
+				"          [-c controllers] [-r rate[,rate]...] [-t seconds] port\n"
+				"  clients:     connections per step (default 16,64,256, up to %d)\n"
+				"  controllers: connections streaming commands (default 1)\n"
+				"  rate:        commands per second of every controller (default 20)\n"
+				"  seconds:     measured time of every step (default 5)\n",
+			argv[0], LOADGEN_MAX_CLIENTS);
+		exit(EXIT_FAILURE);
+	}
+	port = argv[optind];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &lg.addr);
+	if (ret != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("                      | handshake, usec | command ack, usec          acks/s | frames/s/client");
+	if (lg.metrics_port != NULL)
+		printf(" | loop jitter/duration, usec | dropped rejected bytes_out/s");
+	printf("\nclients  rate  fail |     p50     p99 |     p50     p99     max         |    mean     min");
+	if (lg.metrics_port != NULL)
+		printf(" |    mean     max    loop |");
+	printf("\n");
+
+	for (i = 0; i < n_clients; i++) {
+		if (clients[i] > LOADGEN_MAX_CLIENTS)
+			clients[i] = LOADGEN_MAX_CLIENTS;
+		for (j = 0; j < n_rates; j++) {
+			loadgen_step(&lg, clients[i], rates[j]);
+			usleep(LOADGEN_SETTLE);
+		}
+	}
+
+	freeaddrinfo(lg.addr);
+	return 0;
+}
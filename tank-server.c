@@ -0,0 +1,656 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "device.h"
+#include "metrics.h"
+#include "client_server.h"
+#include "tank-server.h"
+
+static int tank_client_write(int fd, const void *buf, int len)
+{
+	ssize_t ret = write(fd, buf, len);
+
+	if (ret > 0) {
+		metrics_add(METRICS_BYTES_OUT, ret);
+		return ret;
+	}
+	if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		return 0;
+	return (ret < 0) ? -errno : -EPIPE;
+}
+
+// client's own messages are sent between the telemetry frames
+static void tank_client_send(struct tank_client *c, const void *msg, int len)
+{
+	if (c->out_len + len > TANK_SERVER_OUT_SIZE) {
+		metrics_add(METRICS_DROPPED_FRAMES, 1);
+		return;
+	}
+	memcpy(c->out + c->out_len, msg, len);
+	c->out_len += len;
+}
+
+static int tank_client_pending(struct tank_server *srv, struct tank_client *c)
+{
+	return (c->out_len > 0) || (c->off > 0) ||
+	       (c->handshake && (c->seq < srv->telemetry.head));
+}
+
+// writes as much as the socket takes, returns -errno on a broken connection
+static int tank_client_flush(struct tank_server *srv, struct tank_client *c)
+{
+	struct fanout_frame *frame;
+	unsigned skipped;
+	int ret;
+
+	while (1) {
+		if ((c->off == 0) && (c->out_len > 0)) {
+			ret = tank_client_write(c->fd, c->out, c->out_len);
+			if (ret < 0)
+				return ret;
+			c->out_len -= ret;
+			memmove(c->out, c->out + ret, c->out_len);
+			if (c->out_len > 0)
+				return 0;
+			continue;
+		}
+
+		if (!c->handshake)
+			return 0;
+
+		if (c->off == 0) {
+			skipped = fanout_catch_up(&srv->telemetry, &c->seq);
+			if (skipped > 0)
+				metrics_add(METRICS_DROPPED_FRAMES, skipped);
+		} else if (fanout_overwritten(&srv->telemetry, c->seq)) {
+			/*
+			 * the head of the frame is on the wire but its tail
+			 * is gone, the stream can't be resynced
+			 */
+			metrics_add(METRICS_DROPPED_FRAMES, 1);
+			return -ENOBUFS;
+		}
+
+		frame = fanout_get(&srv->telemetry, c->seq);
+		if (frame == NULL)
+			return 0;
+
+		ret = tank_client_write(c->fd, frame->data + c->off, frame->len - c->off);
+		if (ret < 0)
+			return ret;
+		c->off += ret;
+		if (c->off < frame->len)
+			return 0;
+		c->off = 0;
+		c->seq++;
+	}
+}
+
+static void tank_client_role(struct tank_client *c, char role)
+{
+	char msg[2] = { TANK_SRV_MSG_TYPE_ROLE, role };
+
+	tank_client_send(c, msg, sizeof(msg));
+}
+
+static void tank_server_release(struct tank_server *srv)
+{
+	srv->controller = -1;
+	lease_release(srv->lease);
+	// nobody drives the tank anymore
+	srv->ops->cmd_push(srv->ctx, TANK_CLNT_CMD_STOP);
+}
+
+static void tank_client_close(struct tank_server *srv, int i, const char *reason)
+{
+	struct tank_client *c = &srv->client[i];
+
+	printf("\nclose connection %d, %s\n", i, reason);
+	close(c->fd);
+	c->fd = -1;
+	srv->clients--;
+	if (c->handshake)
+		srv->handshaken--;
+	if (srv->controller == i)
+		tank_server_release(srv);
+}
+
+static void tank_server_take(struct tank_server *srv, int i, struct timespec *ts)
+{
+	int old = srv->controller;
+
+	// a live controller keeps the tank, a silent one loses it
+	if ((old >= 0) && (old != i) && (lease_remaining(srv->lease, ts) > WAKEUP_NOW)) {
+		tank_client_role(&srv->client[i], TANK_SRV_ROLE_OBSERVER);
+		return;
+	}
+
+	if ((old >= 0) && (old != i)) {
+		tank_client_role(&srv->client[old], TANK_SRV_ROLE_OBSERVER);
+		printf("\nclient %d lost control\n", old);
+	}
+	if (old != i)
+		printf("\nclient %d takes control\n", i);
+
+	srv->controller = i;
+	lease_refresh(srv->lease, ts);
+	tank_client_role(&srv->client[i], TANK_SRV_ROLE_CONTROLLER);
+}
+
+static void tank_client_clock_probe(struct tank_client *c, struct timespec *ts)
+{
+	struct tank_srv_msg msg;
+	long long sec, usec;
+
+	msg.type = TANK_SRV_MSG_TYPE_CLOCK;
+	msg.clock.t1_sec = htonl(ts->tv_sec);
+	msg.clock.t1_usec = htonl(ts->tv_nsec / 1000);
+	msg.clock.rtt = htonl(c->clock.srtt);
+	sec = c->clock.clock_offset / 1000000;
+	usec = c->clock.clock_offset % 1000000;
+	if (usec < 0) {
+		sec--;
+		usec += 1000000;
+	}
+	msg.clock.offset_sec = htonl(sec);
+	msg.clock.offset_usec = htonl(usec);
+	tank_client_send(c, &msg, TANK_SRV_MSG_CLOCK_SIZE);
+	c->last_clock = *ts;
+}
+
+static long long tank_clock_usec(uint32_t sec, uint32_t usec)
+{
+	return (long long)ntohl(sec) * 1000000 + ntohl(usec);
+}
+
+static void tank_client_clock(struct tank_client *c, const char *buf, struct timespec *ts)
+{
+	struct tank_clnt_clock msg;
+
+	memcpy(&msg, buf, sizeof(msg));
+	clock_sync_add(&c->clock, tank_clock_usec(msg.t1_sec, msg.t1_usec),
+		       tank_clock_usec(msg.t2_sec, msg.t2_usec),
+		       tank_clock_usec(msg.t3_sec, msg.t3_usec),
+		       timed_usec(ts));
+	// an answer is as good as an alive check reply
+	c->sucsess_check = 1;
+}
+
+static int tank_setpoint_check(struct tank_server *srv, const struct tank_setpoint *sp)
+{
+	switch (sp->type) {
+	case TANK_SETPOINT_TRACKS:
+	case TANK_SETPOINT_SERVO:
+	case TANK_SETPOINT_LED:
+	case TANK_SETPOINT_BUZZER:
+	case TANK_SETPOINT_SCAN:
+	case TANK_SETPOINT_REFLEX:
+	case TANK_SETPOINT_MAP:
+	case TANK_SETPOINT_RGB:
+	case TANK_SETPOINT_TONE:
+		return 1;
+	case TANK_SETPOINT_CMD:
+		return srv->ops->cmd_check(sp->a);
+	default:
+		return 0;
+	}
+}
+
+// returns non zero if the client must be dropped
+static int tank_client_timed(struct tank_server *srv, int i, const char *buf, struct timespec *ts)
+{
+	struct tank_clnt_timed msg;
+	struct timed_cmd cmd;
+
+	if (srv->controller != i) {
+		metrics_add(METRICS_REJECTED_CMDS, 1);
+		return 0;
+	}
+
+	memcpy(&msg, buf, sizeof(msg));
+	cmd.sp.type = msg.type;
+	cmd.sp.a = (int16_t)ntohs(msg.a);
+	cmd.sp.b = (int16_t)ntohs(msg.b);
+	cmd.at = (long long)ntohl(msg.at_sec) * 1000000 + ntohl(msg.at_usec);
+
+	if (!tank_setpoint_check(srv, &cmd.sp))
+		return 1;
+
+	// the loop can't sleep that long, most likely a broken clock offset
+	if (cmd.at - timed_usec(ts) > TIMED_HORIZON) {
+		metrics_add(METRICS_TIMED_DROPPED, 1);
+		return 0;
+	}
+
+	srv->ops->timed_push(srv->ctx, &cmd);
+	return 0;
+}
+
+// returns non zero if the client must be dropped
+static int tank_client_traced(struct tank_server *srv, int i, const char *buf, struct timespec *ts)
+{
+	struct tank_clnt_traced msg;
+
+	if (srv->controller != i) {
+		metrics_add(METRICS_REJECTED_CMDS, 1);
+		return 0;
+	}
+
+	memcpy(&msg, buf, sizeof(msg));
+	if (!srv->ops->cmd_check(msg.key))
+		return 1;
+	srv->ops->traced_push(srv->ctx, msg.key, ntohs(msg.id), i, srv->client[i].conn, ts);
+	return 0;
+}
+
+// size of the sequence upload at buf, the header must be there already
+static int tank_client_macro_size(const char *buf)
+{
+	return sizeof(struct tank_clnt_macro) + (uint8_t)buf[1] * sizeof(struct tank_clnt_macro_step);
+}
+
+static void tank_client_macro(struct tank_server *srv, int i, const char *buf)
+{
+	struct tank_clnt_macro hdr;
+	struct tank_clnt_macro_step step;
+	struct macro m;
+	struct tank_srv_msg msg;
+	int j, ret;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	msg.type = TANK_SRV_MSG_TYPE_MACRO;
+	msg.macro.id = hdr.id;
+	msg.macro.reserved = 0;
+
+	if (srv->controller != i) {
+		metrics_add(METRICS_REJECTED_CMDS, 1);
+		msg.macro.status = TANK_MACRO_OBSERVER;
+		goto reply;
+	}
+
+	m.id = ntohs(hdr.id);
+	m.steps = hdr.steps;
+	msg.macro.status = TANK_MACRO_INVALID;
+	for (j = 0; j < m.steps; j++) {
+		memcpy(&step, buf + sizeof(hdr) + j * sizeof(step), sizeof(step));
+		m.step[j].sp.type = step.type;
+		m.step[j].sp.a = (int16_t)ntohs(step.a);
+		m.step[j].sp.b = (int16_t)ntohs(step.b);
+		m.step[j].delay = ntohl(step.delay) > MACRO_MAX_DELAY ? -1 : (int)ntohl(step.delay);
+		if (!tank_setpoint_check(srv, &m.step[j].sp))
+			goto reply;
+	}
+
+	ret = srv->ops->macro_push(srv->ctx, &m);
+	msg.macro.status = (ret == 0) ? TANK_MACRO_ACCEPTED : (ret == -EBUSY) ? TANK_MACRO_BUSY : TANK_MACRO_INVALID;
+reply:
+	tank_client_send(&srv->client[i], &msg, TANK_SRV_MSG_MACRO_SIZE);
+}
+
+// returns non zero if the client must be dropped
+static int tank_client_input(struct tank_server *srv, int i, struct timespec *ts)
+{
+	struct tank_client *c = &srv->client[i];
+	char cmd;
+	int j;
+
+	for (j = 0; j < c->bytes; j++) {
+		cmd = c->buf[j];
+		switch (cmd) {
+		case TANK_CLNT_CMD_CONNECT_CHEK:
+			c->sucsess_check = 1;
+			break;
+		case TANK_CLNT_CMD_TAKE_CONTROL:
+			tank_server_take(srv, i, ts);
+			break;
+		case TANK_CLNT_CMD_TIMED:
+			// wait for the rest of the frame
+			if (c->bytes - j < (int)sizeof(struct tank_clnt_timed))
+				goto partial;
+			if (tank_client_timed(srv, i, c->buf + j, ts) != 0)
+				return 1;
+			j += sizeof(struct tank_clnt_timed) - 1;
+			break;
+		case TANK_CLNT_CMD_CLOCK:
+			if (c->bytes - j < (int)sizeof(struct tank_clnt_clock))
+				goto partial;
+			tank_client_clock(c, c->buf + j, ts);
+			j += sizeof(struct tank_clnt_clock) - 1;
+			break;
+		case TANK_CLNT_CMD_TRACED:
+			if (c->bytes - j < (int)sizeof(struct tank_clnt_traced))
+				goto partial;
+			if (tank_client_traced(srv, i, c->buf + j, ts) != 0)
+				return 1;
+			j += sizeof(struct tank_clnt_traced) - 1;
+			break;
+		case TANK_CLNT_CMD_MACRO:
+			if (c->bytes - j < (int)sizeof(struct tank_clnt_macro))
+				goto partial;
+			// it would never fit into the input buffer
+			if ((uint8_t)c->buf[j + 1] > TANK_MACRO_MAX_STEPS)
+				return 1;
+			if (c->bytes - j < tank_client_macro_size(c->buf + j))
+				goto partial;
+			tank_client_macro(srv, i, c->buf + j);
+			j += tank_client_macro_size(c->buf + j) - 1;
+			break;
+		case TANK_CLNT_CMD_SUBSCRIBE:
+			if (c->bytes - j < (int)sizeof(struct tank_clnt_subscribe))
+				goto partial;
+			// a new map subscriber starts with every tile
+			if ((uint8_t)c->buf[j + 1] & ~c->subs & TANK_SUB_MAP)
+				c->tiles = ~0ULL;
+			c->subs = (uint8_t)c->buf[j + 1];
+			j += sizeof(struct tank_clnt_subscribe) - 1;
+			break;
+		case TANK_CLNT_CMD_RELEASE_CONTROL:
+			if (srv->controller == i) {
+				tank_server_release(srv);
+				printf("\nclient %d released control\n", i);
+			}
+			tank_client_role(c, TANK_SRV_ROLE_OBSERVER);
+			break;
+		default:
+			if (srv->controller != i) {
+				metrics_add(METRICS_REJECTED_CMDS, 1);
+				break;
+			}
+			if (!srv->ops->cmd_check(cmd))
+				return 1;
+			srv->ops->cmd_push(srv->ctx, cmd);
+		}
+	}
+
+partial:
+	// any byte from the controller keeps the lease alive
+	if ((srv->controller == i) && (c->bytes > 0))
+		lease_refresh(srv->lease, ts);
+
+	c->bytes -= j;
+	memmove(c->buf, c->buf + j, c->bytes);
+	return 0;
+}
+
+static void tank_client_read(struct tank_server *srv, int i, struct timespec *ts)
+{
+	struct tank_client *c = &srv->client[i];
+	int hells = strlen(HELLO_SERVER);
+	ssize_t bytes;
+
+	bytes = read(c->fd, c->buf + c->bytes, sizeof(c->buf) - c->bytes);
+	if (bytes <= 0) {
+		if ((bytes < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			return;
+		if (bytes < 0)
+			printf("\nread error: %s\n", strerror(errno));
+		tank_client_close(srv, i, "bad read");
+		return;
+	}
+	metrics_add(METRICS_BYTES_IN, bytes);
+	c->bytes += bytes;
+
+	if (!c->handshake) {
+		if (c->bytes < hells)
+			return;
+		if (strncmp(c->buf, HELLO_SERVER, hells) != 0) {
+			tank_client_close(srv, i, "wrong hello string");
+			return;
+		}
+		c->handshake = 1;
+		srv->handshaken++;
+		c->bytes -= hells;
+		memmove(c->buf, c->buf + hells, c->bytes);
+		c->last_check = *ts;
+		c->sucsess_check = 1;
+		clock_sync_init(&c->clock);
+		if (srv->clock_period > 0)
+			tank_client_clock_probe(c, ts);
+		// a new client starts from the current state
+		c->seq = (srv->telemetry.head > 0) ? srv->telemetry.head - 1 : 0;
+		srv->fresh = 1;
+	}
+
+	if (tank_client_input(srv, i, ts) != 0)
+		tank_client_close(srv, i, "wrong command");
+}
+
+static void tank_server_accept(struct tank_server *srv)
+{
+	struct sockaddr_storage	peer_addr;
+	socklen_t		peer_addr_len;
+	char			host[NI_MAXHOST], service[NI_MAXSERV];
+	struct tank_client	*c;
+	int			fd, i, ret, one = 1;
+
+	while (1) {
+		peer_addr_len = sizeof(peer_addr);
+		fd = accept4(srv->fd, (struct sockaddr *)&peer_addr, &peer_addr_len, SOCK_NONBLOCK);
+		if (fd < 0)
+			return;
+
+		ret = getnameinfo((struct sockaddr *)&peer_addr, peer_addr_len,
+				  host, NI_MAXHOST, service, NI_MAXSERV, NI_NUMERICSERV);
+		if (ret == 0)
+			printf("\nReceived connection from %s:%s\n", host, service);
+		else
+			fprintf(stderr, "\ngetnameinfo: %s\n", gai_strerror(ret));
+
+		for (i = 0; i < TANK_SERVER_MAX_CLIENTS; i++) {
+			if (srv->client[i].fd < 0)
+				break;
+		}
+		if (i == TANK_SERVER_MAX_CLIENTS) {
+			fprintf(stderr, "\nMax connections reached, drop new connection\n");
+			close(fd);
+			continue;
+		}
+
+		// small frames go out at once, not after the peer's delayed ack
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c = &srv->client[i];
+		memset(c, 0, sizeof(*c));
+		c->fd = fd;
+		c->conn = ++srv->conns;
+		tank_client_send(c, HELLO_CLIENT, strlen(HELLO_CLIENT));
+		srv->clients++;
+		if (i >= srv->used)
+			srv->used = i + 1;
+	}
+}
+
+static void tank_server_alive(struct tank_server *srv, struct timespec *ts)
+{
+	char alive_check = TANK_SRV_MSG_TYPE_ALIVE_CHECK;
+	struct tank_client *c;
+	int i;
+
+	for (i = 0; i < srv->used; i++) {
+		c = &srv->client[i];
+		if ((c->fd < 0) || !c->handshake)
+			continue;
+		if ((srv->clock_period > 0) && (device_timespec_diff(ts, &c->last_clock) >= srv->clock_period))
+			tank_client_clock_probe(c, ts);
+		if (device_timespec_diff(ts, &c->last_check) < TANK_SERVER_ALIVE_WAIT)
+			continue;
+		if (!c->sucsess_check) {
+			tank_client_close(srv, i, "timeout happens");
+			continue;
+		}
+		tank_client_send(c, &alive_check, sizeof(alive_check));
+		c->sucsess_check = 0;
+		c->last_check = *ts;
+	}
+}
+
+int tank_server_init(struct tank_server *srv, int fd, struct lease *lease,
+		     const struct tank_server_ops *ops, void *ctx)
+{
+	int i, flags;
+
+	memset(srv, 0, sizeof(*srv));
+	for (i = 0; i < TANK_SERVER_MAX_CLIENTS; i++)
+		srv->client[i].fd = -1;
+	srv->controller = -1;
+	srv->clock_period = TANK_SERVER_CLOCK_PERIOD;
+	srv->lease = lease;
+	srv->ops = ops;
+	srv->ctx = ctx;
+	fanout_init(&srv->telemetry);
+
+	flags = fcntl(fd, F_GETFL);
+	if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0))
+		return -errno;
+	srv->fd = fd;
+	return 0;
+}
+
+void tank_server_close(struct tank_server *srv)
+{
+	int i;
+
+	for (i = 0; i < srv->used; i++) {
+		if (srv->client[i].fd >= 0)
+			close(srv->client[i].fd);
+		srv->client[i].fd = -1;
+	}
+	srv->used = 0;
+	srv->clients = 0;
+	srv->handshaken = 0;
+	srv->controller = -1;
+	close(srv->fd);
+	srv->fd = -1;
+}
+
+int tank_server_pollfds(struct tank_server *srv, struct pollfd *pfd)
+{
+	struct tank_client *c;
+	int i, cnt = 0;
+
+	pfd[cnt].fd = srv->fd;
+	pfd[cnt].events = POLLIN;
+	srv->poll_client[cnt++] = -1;
+
+	while ((srv->used > 0) && (srv->client[srv->used - 1].fd < 0))
+		srv->used--;
+
+	for (i = 0; i < srv->used; i++) {
+		c = &srv->client[i];
+		if (c->fd < 0)
+			continue;
+		pfd[cnt].fd = c->fd;
+		pfd[cnt].events = POLLIN;
+		if (tank_client_pending(srv, c))
+			pfd[cnt].events |= POLLOUT;
+		srv->poll_client[cnt++] = i;
+	}
+	return cnt;
+}
+
+void tank_server_handle(struct tank_server *srv, struct pollfd *pfd, int cnt, struct timespec *ts)
+{
+	struct tank_client *c;
+	int i, k;
+
+	for (k = 1; k < cnt; k++) {
+		i = srv->poll_client[k];
+		c = &srv->client[i];
+		if ((c->fd != pfd[k].fd) || !(pfd[k].revents & (POLLIN | POLLERR | POLLHUP)))
+			continue;
+		tank_client_read(srv, i, ts);
+	}
+
+	if ((cnt > 0) && (pfd[0].revents & POLLIN))
+		tank_server_accept(srv);
+
+	tank_server_alive(srv, ts);
+
+	for (i = 0; i < srv->used; i++) {
+		c = &srv->client[i];
+		if ((c->fd < 0) || !tank_client_pending(srv, c))
+			continue;
+		if (tank_client_flush(srv, c) != 0)
+			tank_client_close(srv, i, "can't send");
+	}
+}
+
+void tank_server_publish(struct tank_server *srv, const void *frame, int len)
+{
+	struct tank_client *c;
+	int i;
+
+	if (fanout_publish(&srv->telemetry, frame, len) != 0)
+		return;
+
+	for (i = 0; i < srv->used; i++) {
+		c = &srv->client[i];
+		if ((c->fd < 0) || !c->handshake)
+			continue;
+		if (tank_client_flush(srv, c) != 0)
+			tank_client_close(srv, i, "can't send status_tank");
+	}
+}
+
+void tank_server_send(struct tank_server *srv, int client, unsigned conn, const void *msg, int len)
+{
+	struct tank_client *c = &srv->client[client];
+
+	if ((c->fd < 0) || (c->conn != conn) || !c->handshake)
+		return;
+	tank_client_send(c, msg, len);
+}
+
+void tank_server_broadcast(struct tank_server *srv, unsigned subs, const void *msg, int len)
+{
+	struct tank_client *c;
+	int i;
+
+	for (i = 0; i < srv->used; i++) {
+		c = &srv->client[i];
+		if ((c->fd >= 0) && c->handshake && (c->subs & subs))
+			tank_client_send(c, msg, len);
+	}
+}
+
+void tank_server_tiles(struct tank_server *srv, unsigned long long dirty, tank_server_pack_t pack, void *ctx)
+{
+	struct tank_client *c;
+	const void *msg;
+	int i, tile, len, flushed;
+
+	for (i = 0; i < srv->used; i++) {
+		c = &srv->client[i];
+		if ((c->fd < 0) || !c->handshake || !(c->subs & TANK_SUB_MAP))
+			continue;
+		c->tiles |= dirty;
+		flushed = 0;
+		while (c->tiles != 0) {
+			tile = __builtin_ctzll(c->tiles);
+			len = pack(ctx, tile, &msg);
+			if (c->out_len + len > TANK_SERVER_OUT_SIZE) {
+				// one write to make room, a slow client keeps the rest marked
+				if (flushed++ || (tank_client_flush(srv, c) != 0))
+					break;
+				continue;
+			}
+			if (len > 0)
+				tank_client_send(c, msg, len);
+			c->tiles &= ~(1ULL << tile);
+		}
+	}
+}
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __TANK_SERVER_H__
+#define __TANK_SERVER_H__
+
+#include <poll.h>
+#include <time.h>
+#include "fanout.h"
+#include "lease.h"
+#include "timed-cmd.h"
+#include "clock-sync.h"
+#include "macro.h"
+
+#define TANK_SERVER_MAX_CLIENTS	256
+#define TANK_SERVER_IN_SIZE	512	// fits the largest sequence upload
+#define TANK_SERVER_OUT_SIZE	512	// a few map tiles
+#define TANK_SERVER_ALIVE_WAIT	30000000	// usec
+#define TANK_SERVER_CLOCK_PERIOD	1000000		// usec
+
+// listening socket and the clients
+#define TANK_SERVER_POLLFDS	(1 + TANK_SERVER_MAX_CLIENTS)
+
+struct tank_client {
+	int			fd;
+	int			handshake;
+	int			bytes;
+	char			buf[TANK_SERVER_IN_SIZE];
+	struct timespec		last_check;
+	int			sucsess_check;
+	unsigned		conn;		// connection number, tells a reused slot from the old client
+	unsigned		subs;		// TANK_SUB_* streams
+	unsigned long long	tiles;		// map tiles still to send
+	struct timespec		last_clock;
+	struct clock_sync	clock;
+
+	unsigned long long	seq;		// next telemetry frame to send
+	int			off;		// bytes of frame 'seq' already sent
+	int			out_len;	// own messages, sent between frames
+	char			out[TANK_SERVER_OUT_SIZE];
+};
+
+struct tank_server_ops {
+	// returns non zero for a known device command
+	int	(*cmd_check)(char cmd);
+	int	(*cmd_push)(void *ctx, char cmd);
+	int	(*timed_push)(void *ctx, const struct timed_cmd *cmd);
+	int	(*traced_push)(void *ctx, char cmd, unsigned id, int client, unsigned conn,
+			       struct timespec *recv);
+	// 0, -EINVAL if the sequence is not valid or -EBUSY
+	int	(*macro_push)(void *ctx, const struct macro *m);
+};
+
+/*
+ * Client sessions. Only one client, the controller, drives the tank and
+ * keeps the control lease alive, all the others are observers: their
+ * device commands are dropped before they are even validated. State
+ * frames are built once into the shared fan-out buffer and each client
+ * just follows it with its own cursor, sockets are non blocking, so a
+ * slow observer never stalls the others.
+ */
+struct tank_server {
+	int				fd;
+	int				controller;	// client index, -1 if nobody controls the tank
+	int				clients, handshaken;
+	int				used;		// highest used client slot + 1
+	int				fresh;		// a client joined, it wants a freshly stamped frame
+	int				clock_period;	// usec between clock probes, 0 to disable
+	unsigned			conns;
+	struct tank_client		client[TANK_SERVER_MAX_CLIENTS];
+	short				poll_client[TANK_SERVER_POLLFDS];
+	struct fanout			telemetry;
+	struct lease			*lease;
+	const struct tank_server_ops	*ops;
+	void				*ctx;
+};
+
+// fd is a bound listening socket
+int  tank_server_init(struct tank_server *srv, int fd, struct lease *lease,
+		      const struct tank_server_ops *ops, void *ctx);
+void tank_server_close(struct tank_server *srv);
+
+// poll() integration, returns number of used pollfd entries
+int  tank_server_pollfds(struct tank_server *srv, struct pollfd *pfd);
+void tank_server_handle(struct tank_server *srv, struct pollfd *pfd, int cnt, struct timespec *ts);
+
+// queues a frame for all handshaken clients
+void tank_server_publish(struct tank_server *srv, const void *frame, int len);
+
+// queues a message for one client, dropped if the connection is gone
+void tank_server_send(struct tank_server *srv, int client, unsigned conn, const void *msg, int len);
+
+// queues a message for the handshaken clients subscribed to any of the TANK_SUB_* subs
+void tank_server_broadcast(struct tank_server *srv, unsigned subs, const void *msg, int len);
+
+/*
+ * Map tiles for the TANK_SUB_MAP subscribers: the dirty tiles are marked
+ * for every one of them, then each gets as many of its marked tiles as
+ * its output buffer takes, the rest waits for the next call. pack builds
+ * the message of a tile and returns its length, 0 if there is nothing to
+ * send for it.
+ */
+typedef int (*tank_server_pack_t)(void *ctx, int tile, const void **msg);
+void tank_server_tiles(struct tank_server *srv, unsigned long long dirty, tank_server_pack_t pack, void *ctx);
+
+#endif
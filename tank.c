@@ -8,6 +8,7 @@
  *	Andrey Kshevetskiy	<andrey.kshevetskiy@gmail.com>
  */
 
+#define _GNU_SOURCE
 #include <time.h>
 #include <unistd.h>
 #include "device.h"
@@ -19,18 +20,37 @@
 #include "track.h"
 #include "servo.h"
 #include "sonic.h"
+#include "scanner.h"
+#include "reflex.h"
+#include "range-est.h"
+#include "grid-map.h"
+#include "rgb-led.h"
+#include "buzzer.h"
+#include "precise-wait.h"
+#include "pwm-sysfs.h"
+#include "gpio-out.h"
+#include "cmd-ring.h"
+#include "sched-conf.h"
+#include "loop-stats.h"
+#include "metrics.h"
+#include "lease.h"
+#include "tank-server.h"
+#include "shm-ctl.h"
+#include "timed-cmd.h"
+#include "cmd-trace.h"
+#include "macro.h"
 
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "client_server.h"
 
-#define MAX_CONNECTION	10
-
-
 #define NUMBER_DEV	4
 
 #define GPIOCHIP5	5
@@ -71,23 +91,54 @@
 #define SERVO3_MAX	160
 #define SERVO3_DEF	60
 
-#define TIME_WAIT	30000000
+#define NET_POLL	10000
+#define TELEMETRY_REFRESH	1000000	// usec, unchanged state is resent with a new timestamp
+#define MAP_REFRESH		100000	// usec, changes of a map tile are sent together
 
 
+enum tank_thread {
+	TANK_THREAD_LOOP,
+	TANK_THREAD_NET,
+	TANK_THREADS
+};
+
 struct tanker {
-	struct device dev[5];
+	struct device dev[11];
 	int dev_cnt;
 	
 	struct gpiod_line *red, *green, *blue, *buzzer;
+	struct gpio_out red_pin, green_pin, blue_pin, buzzer_pin;
+
+	/*
+	 * The devices are driven by the loop thread only, the network
+	 * thread passes client commands to it through the ring.
+	 */
+	struct cmd_ring		cmds;
+	int			wake_fd;
+	atomic_int		exit, loop_ready;
+	atomic_uint		state_gen;	// bumped by the loop thread on every applied command
+	struct sched_conf	sched[TANK_THREADS];
+	int			loop_conf_ret;
+	struct precise_wait	pw;
+	struct loop_stats	jitter;
+	struct metrics_thread	metrics[TANK_THREADS];
+	struct lease		lease;
+	struct shm_ctl		shm;		// local control, setpoints are applied by the loop thread
+	struct timed_ring	timed_in;	// time tagged setpoints from the network thread
+	struct timed_heap	timed;		// and their queue, loop thread only
+	struct cmd_trace_table	traces;
+	int			trace_wait;	// traces waiting for a PWM edge, loop thread only
+	struct macro_box	macro_in;	// uploaded sequence, played by dev[5]
+	struct scan_ring	scan_out;	// sweep points of dev[6] to the network thread
+	struct reflex		reflex;		// collision avoidance, loop thread
+	struct tank_srv_msg_tile map_tile[GRID_TILES * GRID_TILES];	// packed tiles of dev[8], network thread
+	unsigned long long	map_packed, map_touched;
+	struct timespec		map_sent;
 };
 
-struct client{
-	int fd;
-	int handshake;
-	int bytes;
-	char buf[100];
-	struct timespec last_check;
-	int sucsess_check;
+struct hw_pwm_map {
+	const char	*name;
+	int		chip, channel;
 };
 
 int sign (int n){
@@ -150,7 +201,7 @@ int servo_setup (struct device *dev, int s_min, int s_max, int s_def, int s_line
 	return angle_servo_init (dev, s_min, s_max, s_def, line);
 }
 
-int sonic_setup (struct device *dev, struct gpiod_chip *chip){
+int sonic_setup (struct device *dev, struct gpiod_chip *chip, enum sonic_filter filter, int window){
 	struct gpiod_line *in, *out;
 	in = gpiod_chip_get_line(chip, SONIC_LINE_IN);
 	if (!in) {
@@ -162,29 +213,30 @@ int sonic_setup (struct device *dev, struct gpiod_chip *chip){
 		printf ("get sonic OUT error\n");
 		return -errno;
 	};
-	return sonic_init(dev, in, out);
+	return sonic_init(dev, in, out, filter, window);
 }
 
 void track_direction(char cmd, struct device *dev){
 	int r = track_get_speed_right (dev);
 	int l = track_get_speed_left (dev);
+	int span = (TRACK_PERIOD-TRACK_MINTIME)/TRACK_DELTA;
+	int throttle, turn;
 	r=(r-sign(r)*TRACK_MINTIME)/TRACK_DELTA;
 	l=(l-sign(l)*TRACK_MINTIME)/TRACK_DELTA;
+	throttle=(r+l)/2;
+	turn=(r-l)/2;
 
 	if (dev->state == DEV_STATE_STOPPED) dev->ops->start_request(dev);
-	if(cmd==TANK_CLNT_CMD_FORWARD) {r=(r+l)/2+1; l=r;};
-	if(cmd==TANK_CLNT_CMD_BACKWARD) {r=(r+l)/2-1; l=r;};
-	if(cmd==TANK_CLNT_CMD_RIGHT) {r+=1; l-=1;};
-	if(cmd==TANK_CLNT_CMD_LEFT) {r-=1; l+=1;};
-	if(cmd==TANK_CLNT_CMD_STOP) {r=0; l=0;};
+	if(cmd==TANK_CLNT_CMD_FORWARD) {throttle+=1; turn=0;};
+	if(cmd==TANK_CLNT_CMD_BACKWARD) {throttle-=1; turn=0;};
+	if(cmd==TANK_CLNT_CMD_RIGHT) turn+=1;
+	if(cmd==TANK_CLNT_CMD_LEFT) turn-=1;
+	if(cmd==TANK_CLNT_CMD_STOP) {throttle=0; turn=0;};
 	
-	if (abs(r)>((TRACK_PERIOD-TRACK_MINTIME)/TRACK_DELTA)) r=sign(r)*((TRACK_PERIOD-TRACK_MINTIME)/TRACK_DELTA);
-	if (abs(l)>((TRACK_PERIOD-TRACK_MINTIME)/TRACK_DELTA)) l=sign(l)*((TRACK_PERIOD-TRACK_MINTIME)/TRACK_DELTA);
+	if (abs(throttle)>span) throttle=sign(throttle)*span;
+	if (abs(turn)>span) turn=sign(turn)*span;
 	
-	r=sign(r)*(TRACK_MINTIME+TRACK_DELTA*abs(r));
-	l=sign(l)*(TRACK_MINTIME+TRACK_DELTA*abs(l));
-	
-	track_set_speed (dev, r, l);
+	track_set_drive (dev, throttle*TRACK_DELTA, turn*TRACK_DELTA);
 }
 
 void servo_direction (char cmd, struct device *dev) {
@@ -207,10 +259,6 @@ void servo_direction (char cmd, struct device *dev) {
 	angle_set (dev, a);
 }
 
-void led_set (struct gpiod_line *line) {
-	gpiod_line_set_value (line, (gpiod_line_get_value(line)+1)%2);
-}
-
 int key_phess_handle(char cmd, struct tanker *tank){
 	switch(cmd){
 		case TANK_CLNT_CMD_FORWARD:
@@ -238,22 +286,24 @@ int key_phess_handle(char cmd, struct tanker *tank){
 			servo_direction(cmd, &tank->dev[3]);
 			return 1;
 		case TANK_CLNT_CMD_RED_LED:
-			led_set(tank->red);
+			led_toggle(&tank->dev[9], 0);
 			return 1;
 		case TANK_CLNT_CMD_GREEN_LED:
-			led_set(tank->green);
+			led_toggle(&tank->dev[9], 1);
 			return 1;
 		case TANK_CLNT_CMD_BLUE_LED:
-			led_set(tank->blue);
+			led_toggle(&tank->dev[9], 2);
 			return 1;
 		case TANK_CLNT_CMD_BUZZER:
-			led_set(tank->buzzer);
+			buzzer_set(&tank->dev[10], buzzer_get_tone(&tank->dev[10]) == 0);
 			return 1;
 		case TANK_CLNT_CMD_SONIC_MOD0:
+			scanner_stop(&tank->dev[6]);
 			sonic_change_mode (&tank->dev[4], 0);
 			tank->dev[4].ops->start_request(&tank->dev[4]);
 			return 1;
 		case TANK_CLNT_CMD_SONIC_MOD1:
+			scanner_stop(&tank->dev[6]);
 			sonic_change_mode (&tank->dev[4], 1);
 			if (tank->dev[4].state == DEV_STATE_STOPPED) tank->dev[4].ops->start_request(&tank->dev[4]);
 			else tank->dev[4].ops->stop_request(&tank->dev[4]);
@@ -268,36 +318,774 @@ void print_state(struct tanker *tank){
 			100*track_get_speed_left (&tank->dev[0])/TRACK_PERIOD, 100*track_get_speed_right (&tank->dev[0])/TRACK_PERIOD,
 			angle_get (&tank->dev[1])-angle_def(&tank->dev[1]),sonic_get_distance(&tank->dev[4]),
 			angle_get (&tank->dev[2])-angle_def(&tank->dev[2]), angle_get (&tank->dev[3])-angle_def(&tank->dev[3]),
-			gpiod_line_get_value(tank->red)==1?'R':'_', gpiod_line_get_value(tank->green)==1?'G':'_', 
-			gpiod_line_get_value(tank->blue)==1?'B':'_', gpiod_line_get_value(tank->buzzer)==0?'P':'_');
+			led_get_channel(&tank->dev[9], 0)?'R':'_', led_get_channel(&tank->dev[9], 1)?'G':'_',
+			led_get_channel(&tank->dev[9], 2)?'B':'_', buzzer_get_tone(&tank->dev[10])!=0?'P':'_');
 	fflush (stdout);
 }
+// parses "name=chip:channel" into the matching map entry
+int hw_pwm_parse(struct hw_pwm_map *map, const char *arg){
+	const char *eq = strchr(arg, '=');
+	int chip, channel;
+
+	if (eq == NULL || sscanf(eq + 1, "%d:%d", &chip, &channel) != 2) return -EINVAL;
+	for (; map->name != NULL; map++){
+		if (strlen(map->name) != (size_t)(eq - arg) || strncmp(map->name, arg, eq - arg) != 0) continue;
+		map->chip = chip;
+		map->channel = channel;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+// switches the devices to hardware PWM where configured, software PWM stays as fallback
+void hw_pwm_setup(struct tanker *tank, const char *root, struct hw_pwm_map *map){
+	int i, ret;
+
+	if (map[0].chip >= 0 && map[1].chip >= 0){
+		ret = track_use_hw_pwm(&tank->dev[0], root, map[0].chip, map[0].channel, map[1].chip, map[1].channel);
+		if (ret == 0) printf("track: hardware PWM pwmchip%d/pwm%d, pwmchip%d/pwm%d\n",
+				map[0].chip, map[0].channel, map[1].chip, map[1].channel);
+		else printf("track: hardware PWM unavailable (%s), using software PWM\n", strerror(-ret));
+	} else if (map[0].chip >= 0 || map[1].chip >= 0) {
+		printf("track: both track_right and track_left are needed for hardware PWM, using software PWM\n");
+	}
+
+	for (i = 1; i < 4; i++){
+		if (map[i + 1].chip < 0) continue;
+		ret = angle_servo_use_hw_pwm(&tank->dev[i], root, map[i + 1].chip, map[i + 1].channel);
+		if (ret == 0) printf("%s: hardware PWM pwmchip%d/pwm%d\n", map[i + 1].name, map[i + 1].chip, map[i + 1].channel);
+		else printf("%s: hardware PWM unavailable (%s), using software PWM\n", map[i + 1].name, strerror(-ret));
+	}
+}
+
+// runs expired devices, returns delay before next activation and the device to wake
+int tank_devices_action(struct tanker *tank, struct timespec *ts, struct device **next){
+	struct device *dev;
+	int i, wakeup, delay = WAKEUP_NEVER;
+
+	*next = NULL;
+	for(i = 0; i < tank->dev_cnt; i++) {
+		dev = &tank->dev[i];
+
+		wakeup = device_get_action_interval(dev, ts);
+		if (wakeup == WAKEUP_NOW) {
+			dev->ops->timer_action(dev, ts);
+			metrics_timer_action(i);
+			wakeup = device_get_action_interval(dev, ts);
+		}
+		if (wakeup <= WAKEUP_NEVER) continue;
+		if ((delay <= WAKEUP_NEVER) || (wakeup < delay)) {
+			delay = wakeup;
+			*next = dev;
+		}
+	}
+	return delay;
+}
+
+// validates a client command in the network thread, key_phess_handle() runs in the loop thread
+int key_phess_check(char cmd){
+	switch(cmd){
+		case TANK_CLNT_CMD_FORWARD:
+		case TANK_CLNT_CMD_BACKWARD:
+		case TANK_CLNT_CMD_RIGHT:
+		case TANK_CLNT_CMD_LEFT:
+		case TANK_CLNT_CMD_STOP:
+		case TANK_CLNT_CMD_SONIC_RIGHT:
+		case TANK_CLNT_CMD_SONIC_LEFT:
+		case TANK_CLNT_CMD_SONIC_CENTRE:
+		case TANK_CLNT_CMD_CAMERA_RIGHT:
+		case TANK_CLNT_CMD_CAMERA_LEFT:
+		case TANK_CLNT_CMD_CAMERA_UP:
+		case TANK_CLNT_CMD_CAMERA_DOWN:
+		case TANK_CLNT_CMD_CAMERA_CENTRE:
+		case TANK_CLNT_CMD_RED_LED:
+		case TANK_CLNT_CMD_GREEN_LED:
+		case TANK_CLNT_CMD_BLUE_LED:
+		case TANK_CLNT_CMD_BUZZER:
+		case TANK_CLNT_CMD_SONIC_MOD0:
+		case TANK_CLNT_CMD_SONIC_MOD1:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void tank_wakeup(struct tanker *tank){
+	uint64_t one = 1;
+
+	if (write(tank->wake_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		fprintf(stderr, "\ncan't wake up the loop thread, error: %s\n", strerror(errno));
+}
+
+// called from the network thread only
+int tank_cmd_push(struct tanker *tank, char cmd){
+	int ret = cmd_ring_push(&tank->cmds, cmd, -1);
+
+	if (ret != 0) {
+		fprintf(stderr, "\ncommand ring is full, drop command '%c'\n", cmd);
+		return ret;
+	}
+	tank_wakeup(tank);
+	return 0;
+}
+
+static int tank_server_cmd_push(void *ctx, char cmd){
+	return tank_cmd_push(ctx, cmd);
+}
+
+static int tank_server_traced_push(void *ctx, char cmd, unsigned id, int client, unsigned conn,
+				   struct timespec *recv){
+	struct tanker *tank = ctx;
+	struct cmd_trace *trace;
+	int slot = cmd_trace_alloc(&tank->traces);
+
+	// too many commands in flight, it still runs, only untraced
+	if (slot < 0) return tank_cmd_push(tank, cmd);
+
+	trace = &tank->traces.slot[slot];
+	trace->id = id;
+	trace->client = client;
+	trace->conn = conn;
+	trace->cmd = cmd;
+	trace->ts[CMD_TRACE_RECV] = timed_usec(recv);
+	cmd_trace_stamp(&tank->traces, slot, CMD_TRACE_DISPATCH);
+	cmd_trace_pass(&tank->traces, slot, CMD_TRACE_LOOP);
+
+	if (cmd_ring_push(&tank->cmds, cmd, slot) != 0) {
+		fprintf(stderr, "\ncommand ring is full, drop command '%c'\n", cmd);
+		cmd_trace_free(&tank->traces, slot);
+		return -ENOSPC;
+	}
+	tank_wakeup(tank);
+	return 0;
+}
+
+static uint16_t trace_delta16(long long delta){
+	return delta > 65535 ? 65535 : delta;
+}
+
+// replies for the finished traces, network thread
+void tank_traces_reply(struct tanker *tank, struct tank_server *srv){
+	struct tank_srv_msg msg;
+	struct cmd_trace *trace;
+	long long *t;
+	int i;
+
+	for (i = 0; i < CMD_TRACE_SLOTS; i++) {
+		if (!cmd_trace_owned(&tank->traces, i, CMD_TRACE_DONE)) continue;
+		trace = &tank->traces.slot[i];
+		t = trace->ts;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.type = TANK_SRV_MSG_TYPE_TRACE;
+		msg.trace.id = htons(trace->id);
+		msg.trace.key = trace->cmd;
+		msg.trace.recv_sec = htonl(t[CMD_TRACE_RECV] / 1000000);
+		msg.trace.recv_usec = htonl(t[CMD_TRACE_RECV] % 1000000);
+		msg.trace.dispatch = htons(trace_delta16(t[CMD_TRACE_DISPATCH] - t[CMD_TRACE_RECV]));
+		msg.trace.apply = htons(trace_delta16(t[CMD_TRACE_APPLY] - t[CMD_TRACE_DISPATCH]));
+		msg.trace.set = htonl(t[CMD_TRACE_SET] - t[CMD_TRACE_APPLY]);
+		if (t[CMD_TRACE_EDGE] != 0) {
+			msg.trace.flags = TANK_TRACE_EDGE;
+			msg.trace.edge = htonl(t[CMD_TRACE_EDGE] - t[CMD_TRACE_SET]);
+		}
+		tank_server_send(srv, trace->client, trace->conn, &msg, TANK_SRV_MSG_TRACE_SIZE);
+		cmd_trace_free(&tank->traces, i);
+	}
+}
+
+// sweep points to the subscribers, network thread
+void tank_scan_publish(struct tanker *tank, struct tank_server *srv){
+	struct tank_srv_msg msg;
+	struct scan_point point;
+
+	while (scan_ring_pop(&tank->scan_out, &point)) {
+		memset(&msg, 0, sizeof(msg));
+		msg.type = TANK_SRV_MSG_TYPE_SCAN;
+		msg.scan.angle = point.angle;
+		msg.scan.distance = htons(point.distance);
+		msg.scan.sweep = htons(point.sweep);
+		msg.scan.ts_sec = htonl(point.ts / 1000000);
+		msg.scan.ts_usec = htonl(point.ts % 1000000);
+		tank_server_broadcast(srv, TANK_SUB_SCAN, &msg, TANK_SRV_MSG_SCAN_SIZE);
+	}
+}
+
+// every tile is packed at most once per round, whatever the number of subscribers
+static int tank_map_pack(void *ctx, int tile, const void **msg){
+	struct tanker *tank = ctx;
+	struct tank_srv_msg_tile *m = &tank->map_tile[tile];
+
+	// never seen tiles are unknown on the client too
+	if (!(tank->map_touched & (1ULL << tile))) return 0;
+	if (!(tank->map_packed & (1ULL << tile))) {
+		m->type = TANK_SRV_MSG_TYPE_TILE;
+		m->tile.tx = tile % GRID_TILES;
+		m->tile.ty = tile / GRID_TILES;
+		m->tile.tiles = GRID_TILES;
+		m->tile.cell = GRID_CELL;
+		grid_tile_pack(&tank->dev[8], tile, m->tile.cells);
+		tank->map_packed |= 1ULL << tile;
+	}
+	*msg = m;
+	return TANK_SRV_MSG_TILE_SIZE;
+}
+
+// changed map tiles to the subscribers, network thread
+void tank_map_publish(struct tanker *tank, struct tank_server *srv, struct timespec *ts){
+	unsigned long long dirty = 0;
+
+	// a sweep touches the same tiles over and over, coalesce the changes
+	if (device_timespec_diff(ts, &tank->map_sent) >= MAP_REFRESH) {
+		dirty = grid_take_dirty(&tank->dev[8]);
+		tank->map_sent = *ts;
+	}
+
+	tank->map_touched = grid_touched(&tank->dev[8]);
+	tank->map_packed = 0;
+	tank_server_tiles(srv, dirty, tank_map_pack, tank);
+}
+
+static int tank_server_macro_push(void *ctx, const struct macro *m){
+	struct tanker *tank = ctx;
+	int ret = macro_validate(m);
+
+	if (ret == 0) ret = macro_box_put(&tank->macro_in, m);
+	if (ret == 0) tank_wakeup(tank);
+	return ret;
+}
+
+static int tank_server_timed_push(void *ctx, const struct timed_cmd *cmd){
+	struct tanker *tank = ctx;
+	int ret = timed_ring_push(&tank->timed_in, cmd);
+
+	if (ret != 0) {
+		fprintf(stderr, "\ntimed command ring is full, drop command\n");
+		metrics_add(METRICS_TIMED_DROPPED, 1);
+		return ret;
+	}
+	tank_wakeup(tank);
+	return 0;
+}
+
+static const struct tank_server_ops tank_server_ops = {
+	.cmd_check	= key_phess_check,
+	.cmd_push	= tank_server_cmd_push,
+	.timed_push	= tank_server_timed_push,
+	.traced_push	= tank_server_traced_push,
+	.macro_push	= tank_server_macro_push,
+};
+
+// telemetry frame, built once for all the clients
+void tank_state_msg(struct tanker *tank, struct tank_srv_msg *msg){
+	struct tank_srv_info *info = &msg->info;
+	struct timespec ts;
+	unsigned id, step;
+	int x, y, heading;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	msg->type=TANK_SRV_MSG_TYPE_INFO_DATA;
+	info->ts_sec=htonl(ts.tv_sec);
+	info->ts_usec=htonl(ts.tv_nsec / 1000);
+	info->sonic_distance=htons(sonic_get_distance(&tank->dev[4]));
+	info->right_speed=htons(100*track_get_speed_right (&tank->dev[0])/TRACK_PERIOD);
+	info->left_speed=htons(100*track_get_speed_left (&tank->dev[0])/TRACK_PERIOD);
+	info->sonik_servo_angle=angle_get (&tank->dev[1])-angle_def(&tank->dev[1]);
+	info->camera_servo1_angle=angle_get (&tank->dev[2])-angle_def(&tank->dev[2]);
+	info->camera_servo2_angle=angle_get (&tank->dev[3])-angle_def(&tank->dev[3]);
+	info->red=led_get_channel(&tank->dev[9], 0)?'R':'_';
+	info->green=led_get_channel(&tank->dev[9], 1)?'G':'_';
+	info->blue=led_get_channel(&tank->dev[9], 2)?'B':'_';
+	info->buzzer=buzzer_get_tone(&tank->dev[10])!=0?'P':'_';
+	macro_progress(&tank->dev[5], &id, &step, &info->macro_state);
+	info->macro_id=htons(id);
+	info->macro_step=step;
+	info->reflex=atomic_load_explicit(&tank->reflex.state, memory_order_relaxed);
+	info->range_distance=htons(range_get_distance(&tank->dev[7]));
+	info->range_closing=htons(range_get_closing(&tank->dev[7]));
+	grid_pose(&tank->dev[8], &x, &y, &heading);
+	info->pose_x=htons(x);
+	info->pose_y=htons(y);
+	info->pose_heading=htons(heading);
+}
+
+// absolute setpoint from the local control interface or a timed command, loop thread only
+int setpoint_apply(struct tanker *tank, const struct tank_setpoint *sp){
+	struct device *dev = &tank->dev[0];
+	struct buzzer_note note;
+	int n;
+
+	switch(sp->type){
+		case TANK_SETPOINT_TRACKS:
+			if (dev->state == DEV_STATE_STOPPED) dev->ops->start_request(dev);
+			track_set_speed(dev, abs(sp->a) > TRACK_PERIOD ? sign(sp->a)*TRACK_PERIOD : sp->a,
+					abs(sp->b) > TRACK_PERIOD ? sign(sp->b)*TRACK_PERIOD : sp->b);
+			return 1;
+		case TANK_SETPOINT_SERVO:
+			if (sp->a < 0 || sp->a > 2) return 0;
+			angle_set(&tank->dev[1 + sp->a], sp->b);
+			return 1;
+		case TANK_SETPOINT_LED:
+			if (sp->a < 0 || sp->a > 2) return 0;
+			led_set_channel(&tank->dev[9], sp->a, sp->b != 0 ? 255 : 0);
+			return 1;
+		case TANK_SETPOINT_RGB:
+			if (TANK_RGB_EFFECT(sp->b) > TANK_LED_CODE) return 0;
+			led_set_color(&tank->dev[9], TANK_RGB_RED(sp->a), TANK_RGB_GREEN(sp->a), TANK_RGB_BLUE(sp->b));
+			n = TANK_RGB_N(sp->b);
+			led_set_effect(&tank->dev[9], TANK_RGB_EFFECT(sp->b),
+				       TANK_RGB_EFFECT(sp->b) == TANK_LED_CODE ? n : n * 250);
+			return 1;
+		case TANK_SETPOINT_BUZZER:
+			buzzer_set(&tank->dev[10], sp->b != 0);
+			return 1;
+		case TANK_SETPOINT_TONE:
+			note.freq = sp->a;
+			note.duration = sp->b;
+			return buzzer_play(&tank->dev[10], &note, 1);
+		case TANK_SETPOINT_CMD:
+			if (!key_phess_check(sp->a)) return 0;
+			return key_phess_handle(sp->a, tank);
+		case TANK_SETPOINT_SCAN:
+			scanner_start(&tank->dev[6], TANK_SCAN_FROM(sp->a), TANK_SCAN_TO(sp->a), sp->b);
+			return 1;
+		case TANK_SETPOINT_REFLEX:
+			reflex_arm(&tank->reflex, sp->a != 0);
+			return 1;
+		case TANK_SETPOINT_MAP:
+			if (sp->a != 0) return 0;
+			grid_clear(&tank->dev[8]);
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// a stop from the local interface or a timed command cancels the queued maneuver, like a network one
+static int setpoint_stop(struct tanker *tank, const struct tank_setpoint *sp){
+	if (!((sp->type == TANK_SETPOINT_CMD && sp->a == TANK_CLNT_CMD_STOP) ||
+	      (sp->type == TANK_SETPOINT_TRACKS && sp->a == 0 && sp->b == 0))) return 0;
+	timed_heap_clear(&tank->timed);
+	return macro_cancel(&tank->dev[5]);
+}
+
+// sequence steps, loop thread
+static int tank_macro_apply(void *ctx, const struct tank_setpoint *sp){
+	struct tanker *tank = ctx;
+	int ret = setpoint_apply(tank, sp);
+
+	// the progress is in the telemetry, so every step is a change
+	atomic_fetch_add(&tank->state_gen, 1);
+	return ret;
+}
+
+int key_is_track(char cmd){
+	return cmd == TANK_CLNT_CMD_FORWARD || cmd == TANK_CLNT_CMD_BACKWARD || cmd == TANK_CLNT_CMD_RIGHT ||
+	       cmd == TANK_CLNT_CMD_LEFT || cmd == TANK_CLNT_CMD_STOP;
+}
+
+// runs a traced command, the trace goes back once the tracks started a frame with it
+int tank_cmd_traced(struct tanker *tank, char cmd, int slot){
+	struct cmd_trace *trace = &tank->traces.slot[slot];
+	int ret;
+
+	cmd_trace_stamp(&tank->traces, slot, CMD_TRACE_APPLY);
+	trace->latch = track_latch_count(&tank->dev[0], NULL);
+	ret = key_phess_handle(cmd, tank);
+	cmd_trace_stamp(&tank->traces, slot, CMD_TRACE_SET);
+
+	if (key_is_track(cmd)) {
+		if (tank->dev[0].state != DEV_STATE_STOPPED || track_latch_count(&tank->dev[0], NULL) != trace->latch) {
+			trace->edge = 1;
+			tank->trace_wait++;
+			return ret;
+		}
+		// stopped and staying so, nothing to wait for
+		trace->ts[CMD_TRACE_EDGE] = trace->ts[CMD_TRACE_SET];
+	}
+	cmd_trace_pass(&tank->traces, slot, CMD_TRACE_DONE);
+	return ret;
+}
+
+// completes the traces whose PWM frame has started
+void tank_traces_edge(struct tanker *tank){
+	struct cmd_trace *trace;
+	struct timespec latch;
+	unsigned cnt;
+	int i;
+
+	if (tank->trace_wait == 0) return;
+	cnt = track_latch_count(&tank->dev[0], &latch);
+	for (i = 0; i < CMD_TRACE_SLOTS; i++) {
+		trace = &tank->traces.slot[i];
+		if (!cmd_trace_owned(&tank->traces, i, CMD_TRACE_LOOP) || !trace->edge || cnt == trace->latch) continue;
+		// a stopped track latches right inside the command
+		trace->ts[CMD_TRACE_EDGE] = timed_usec(&latch);
+		if (trace->ts[CMD_TRACE_EDGE] < trace->ts[CMD_TRACE_SET])
+			trace->ts[CMD_TRACE_EDGE] = trace->ts[CMD_TRACE_SET];
+		trace->edge = 0;
+		tank->trace_wait--;
+		cmd_trace_pass(&tank->traces, i, CMD_TRACE_DONE);
+	}
+}
+
+void tank_cmds_apply(struct tanker *tank, struct timespec *ts){
+	struct tank_setpoint sp;
+	struct timed_cmd tc;
+	long long now = timed_usec(ts);
+	struct macro m;
+	char cmd;
+	int applied = 0, trace;
+
+	// before the commands: a stop sent right after the upload must win
+	if (macro_box_get(&tank->macro_in, &m)) {
+		macro_run(&tank->dev[5], &m, ts);
+		applied = 1;
+	}
+
+	while (cmd_ring_pop(&tank->cmds, &cmd, &trace)) {
+		// a stop cancels the queued maneuver as well
+		if (cmd == TANK_CLNT_CMD_STOP) {
+			timed_heap_clear(&tank->timed);
+			applied |= macro_cancel(&tank->dev[5]);
+		}
+		if (trace >= 0) {
+			applied |= tank_cmd_traced(tank, cmd, trace);
+			continue;
+		}
+		applied |= key_phess_handle(cmd, tank);
+	}
+	while (shm_ctl_pop(&tank->shm, &sp)) {
+		applied |= setpoint_stop(tank, &sp);
+		applied |= setpoint_apply(tank, &sp);
+		// a local controller holds the dead-man lease like a network one
+		if (sp.type == TANK_SETPOINT_TRACKS) lease_refresh(&tank->lease, ts);
+	}
+
+	while (timed_ring_pop(&tank->timed_in, &tc)) {
+		if (tc.at > now) {
+			// a command for later must never run early, a full queue drops it
+			if (timed_heap_push(&tank->timed, &tc) != 0) {
+				fprintf(stderr, "\ntimed command queue is full, drop command\n");
+				metrics_add(METRICS_TIMED_DROPPED, 1);
+			}
+			continue;
+		}
+		if (tc.at != 0) metrics_add(METRICS_TIMED_LATE, 1);
+		applied |= setpoint_stop(tank, &tc.sp);
+		applied |= setpoint_apply(tank, &tc.sp);
+	}
+	while (timed_heap_pop_due(&tank->timed, now, &tc)) {
+		applied |= setpoint_stop(tank, &tc.sp);
+		applied |= setpoint_apply(tank, &tc.sp);
+	}
+
+	if (applied) atomic_fetch_add(&tank->state_gen, 1);
+}
+
+// state for the local control interface, loop thread only
+void tank_shm_publish(struct tanker *tank, struct timespec *ts){
+	struct tank_shm_state state;
+	int i;
+
+	state.ts = (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+	state.right_speed = track_get_speed_right(&tank->dev[0]);
+	state.left_speed = track_get_speed_left(&tank->dev[0]);
+	state.track_period = TRACK_PERIOD;
+	state.sonic_distance = sonic_get_distance(&tank->dev[4]);
+	for (i = 0; i < 3; i++) state.servo_angle[i] = angle_get(&tank->dev[1 + i]);
+	state.red = led_get_channel(&tank->dev[9], 0);
+	state.green = led_get_channel(&tank->dev[9], 1);
+	state.blue = led_get_channel(&tank->dev[9], 2);
+	state.buzzer = buzzer_get_tone(&tank->dev[10]) != 0;
+	shm_ctl_publish(&tank->shm, &state);
+}
+
+// sleeps up to delay usec, returns non zero if woken up by a new command
+int tank_loop_wait(struct tanker *tank, int delay){
+	struct pollfd pfd = { .fd = tank->wake_fd, .events = POLLIN };
+	struct timespec timeout;
+	uint64_t cnt;
+	int ret;
+
+	timeout.tv_sec = delay / 1000000;
+	timeout.tv_nsec = (delay % 1000000) * 1000;
+	ret = ppoll(&pfd, 1, (delay > WAKEUP_NEVER) ? &timeout : NULL, NULL);
+	if (ret <= 0) return 0;
+	if (read(tank->wake_fd, &cnt, sizeof(cnt)) < 0) return 0;
+	return 1;
+}
+
+// precise wait that still takes new commands until the final spin
+static int tank_loop_wait_until(struct tanker *tank, struct timespec *deadline){
+	uint64_t cnt;
+
+	if (!precise_wait_until_fd(&tank->pw, deadline, tank->wake_fd)) return 0;
+	if (read(tank->wake_fd, &cnt, sizeof(cnt)) < 0) return 0;
+	return 1;
+}
+
+// non zero if delay a comes before delay b, WAKEUP_NEVER is never earlier
+static int wakeup_earlier(int a, int b){
+	return (a > WAKEUP_NEVER) && ((b <= WAKEUP_NEVER) || (a < b));
+}
+
+// timing critical device loop thread
+void *tank_loop(void *arg){
+	struct tanker *tank = arg;
+	struct timespec ts, deadline, done;
+	struct device *dev;
+	int delay, lease_delay, timed_delay;
+	unsigned shm_gen = ~0u;
+	int shm_distance = -1;
+	unsigned reflex_events = 0;
+	int held = 0;
+
+	tank->loop_conf_ret = sched_conf_apply(&tank->sched[TANK_THREAD_LOOP], pthread_self());
+	metrics_thread_register(&tank->metrics[TANK_THREAD_LOOP], "loop");
+
+	// calibrate on the final cpu and with the final policy
+	precise_wait_init(&tank->pw);
+	precise_wait_calibrate(&tank->pw, PRECISE_WAIT_CALIBRATE_LOOPS);
+	loop_stats_init(&tank->jitter);
+	atomic_store(&tank->loop_ready, 1);
+
+	while (!atomic_load(&tank->exit)) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		tank_cmds_apply(tank, &ts);
+
+		// dead-man: the controller went silent, stop without waiting for the network
+		if (lease_check(&tank->lease, &ts)) {
+			timed_heap_clear(&tank->timed);
+			macro_cancel(&tank->dev[5]);
+			track_direction(TANK_CLNT_CMD_STOP, &tank->dev[0]);
+			// the next controller gets the reflex back
+			reflex_arm(&tank->reflex, 1);
+			metrics_add(METRICS_LEASE_EXPIRED, 1);
+			atomic_fetch_add(&tank->state_gen, 1);
+			buzzer_alert(&tank->dev[10], BUZZER_ALERT_LEASE);
+			held = 0;
+		}
+		if ((lease_remaining(&tank->lease, &ts) > WAKEUP_NEVER) != held) {
+			held = !held;
+			buzzer_alert(&tank->dev[10], held ? BUZZER_ALERT_CONNECT : BUZZER_ALERT_RELEASE);
+		}
+
+		// before the devices run, so a new speed or sample is capped before the next track frame
+		if (reflex_check(&tank->reflex, &tank->dev[0], &tank->dev[1], &tank->dev[4], &tank->dev[7], &ts)) {
+			atomic_fetch_add(&tank->state_gen, 1);
+			if (atomic_load_explicit(&tank->reflex.events, memory_order_relaxed) != reflex_events) {
+				reflex_events = atomic_load_explicit(&tank->reflex.events, memory_order_relaxed);
+				buzzer_alert(&tank->dev[10], BUZZER_ALERT_DISTANCE);
+			}
+		}
+
+		delay = tank_devices_action(tank, &ts, &dev);
+		tank_traces_edge(tank);
+
+		// LED reads may be syscalls, so only publish on changes
+		if (shm_ctl_enabled(&tank->shm) &&
+		    (atomic_load(&tank->state_gen) != shm_gen || sonic_get_distance(&tank->dev[4]) != shm_distance)) {
+			shm_gen = atomic_load(&tank->state_gen);
+			shm_distance = sonic_get_distance(&tank->dev[4]);
+			tank_shm_publish(tank, &ts);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &done);
+		metrics_add(METRICS_LOOP_ITERATIONS, 1);
+		metrics_loop_duration(device_timespec_diff(&done, &ts));
+
+		if (delay == WAKEUP_NOW) continue;
+
+		lease_delay = lease_remaining(&tank->lease, &ts);
+		timed_delay = timed_heap_delay(&tank->timed, &ts, &deadline);
+		if (timed_delay == WAKEUP_NOW) continue;
+
+		if (wakeup_earlier(lease_delay, delay) && wakeup_earlier(lease_delay, timed_delay)) {
+			tank_loop_wait(tank, lease_delay);
+			continue;
+		}
+
+		// time tagged commands are due exactly at their time
+		if (wakeup_earlier(timed_delay, delay)) {
+			if (tank_loop_wait_until(tank, &deadline)) continue;
+			clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+			loop_stats_add(&tank->jitter, device_timespec_diff(&ts, &deadline));
+			metrics_loop_jitter(device_timespec_diff(&ts, &deadline));
+			continue;
+		}
+
+		if (delay <= WAKEUP_NEVER) {
+			tank_loop_wait(tank, WAKEUP_NEVER);
+			continue;
+		}
+
+		deadline = dev->next_action;
+		// a macro step may be seconds away, a stop must not wait for it
+		if (dev->precise) {
+			if (tank_loop_wait_until(tank, &deadline)) continue;
+		} else if (tank_loop_wait(tank, delay)) continue;
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		loop_stats_add(&tank->jitter, device_timespec_diff(&ts, &deadline));
+		metrics_loop_jitter(device_timespec_diff(&ts, &deadline));
+	}
+	return NULL;
+}
+
 int main (int argc, char *argv[]) {
 	struct timespec ts;
 	struct tanker tank;
 	struct device *dev;
-	int i, delay, ret, state=0;
-	tank.dev_cnt=5;
+	int i, ret, state=0;
+	tank.dev_cnt=11;
 	struct gpiod_chip *chip5, *chip6, *chip7, *chip8;
 	struct kb_key kb;
 	char x[10];
+	int opt;
+	pthread_t loop_thread;
+	unsigned state_gen=0;
+	char loop_desc[128], net_desc[128];
+	const char *pwm_root = PWM_SYSFS_ROOT;
+	const char *mmio_path = NULL;
+	const char *metrics_addr = NULL;
+	const char *shm_name = NULL;
+	int lease_window = LEASE_WINDOW;
+	int sonic_rate = 0, sonic_window = SONIC_WINDOW;
+	int reflex_margin = REFLEX_MARGIN, reflex_speed = REFLEX_FULL_SPEED;
+	int servo_velocity = SERVO_MAX_VELOCITY, servo_accel = SERVO_MAX_ACCEL;
+	int track_accel = TRACK_ACCEL, track_decel = TRACK_DECEL;
+	int track_period = TRACK_PERIOD, track_step = 1, track_dither = 0;
+	int buzzer_precise = 1;
+	enum sonic_filter sonic_filter = SONIC_FILTER_MEDIAN;
+	char *end;
+	int clock_period = TANK_SERVER_CLOCK_PERIOD;
+	struct metrics_server metrics;
+	struct metrics_gauges gauges;
+	struct hw_pwm_map hw_pwm[] = {
+		{ "track_right", -1, -1 },
+		{ "track_left", -1, -1 },
+		{ "servo1", -1, -1 },
+		{ "servo2", -1, -1 },
+		{ "servo3", -1, -1 },
+		{ NULL, -1, -1 },
+	};
 
 	int fd;
-	struct client client[MAX_CONNECTION];
-	struct tank_srv_info tank_state;
+	static struct tank_server server;
+	struct pollfd pfd[TANK_SERVER_POLLFDS + METRICS_POLLFDS + SHM_CTL_POLLFDS];
+	int srv_cnt, metrics_cnt, shm_cnt;
 	struct tank_srv_msg tank_msg;
 
 	struct addrinfo	hints;
 	struct addrinfo	*result, *rp;
 	int retval, reuse_addr;
-	char alive_check=TANK_SRV_MSG_TYPE_ALIVE_CHECK;
-	int client_cnt=0;
-
-	struct timeval time_wait_select;
-
+	unsigned lease_expired=0;
+	unsigned reflex_events=0;
+	struct timespec last_frame;
+
+
+	sched_conf_init(&tank.sched[TANK_THREAD_LOOP], "loop");
+	sched_conf_init(&tank.sched[TANK_THREAD_NET], "net");
+
+	while ((opt = getopt(argc, argv, "W:w:m:a:M:l:L:c:S:f:R:V:T:P:b")) != -1) {
+		switch (opt) {
+		case 'l':
+			lease_window = atoi(optarg) * 1000;
+			if (lease_window > 0) break;
+			fprintf(stderr, "bad lease window '%s'\n", optarg);
+			goto usage;
+		case 'M':
+			metrics_addr = optarg;
+			break;
+		case 'f':
+			if (strncmp(optarg, "median", 6) == 0) {
+				sonic_filter = SONIC_FILTER_MEDIAN;
+				end = optarg + 6;
+			} else if (strncmp(optarg, "trimmed", 7) == 0) {
+				sonic_filter = SONIC_FILTER_TRIMMED;
+				end = optarg + 7;
+			} else goto usage;
+			if (*end == ':') sonic_window = strtol(end + 1, &end, 10);
+			if (*end != '\0' || sonic_window <= 0 || sonic_window > SONIC_WINDOW_MAX) goto usage;
+			break;
+		case 'S':
+			sonic_rate = atoi(optarg);
+			if (sonic_rate <= 0) goto usage;
+			break;
+		case 'R':
+			reflex_margin = strtol(optarg, &end, 10);
+			if (*end == ':') reflex_speed = strtol(end + 1, &end, 10);
+			if (*end != '\0' || reflex_margin < 0 || reflex_speed <= 0) goto usage;
+			break;
+		case 'V':
+			servo_velocity = strtol(optarg, &end, 10);
+			if (*end == ':') servo_accel = strtol(end + 1, &end, 10);
+			if (*end != '\0' || servo_velocity < 0 || servo_accel <= 0) goto usage;
+			break;
+		case 'T':
+			track_accel = strtol(optarg, &end, 10);
+			track_decel = track_accel;
+			if (*end == ':') track_decel = strtol(end + 1, &end, 10);
+			if (*end != '\0' || track_accel < 0 || track_decel < 0) goto usage;
+			break;
+		case 'b':
+			buzzer_precise = 0;
+			break;
+		case 'P':
+			track_period = strtol(optarg, &end, 10);
+			if (*end == ':' && end[1] != 'd') track_step = strtol(end + 1, &end, 10);
+			if (strcmp(end, ":d") == 0) {
+				track_dither = 1;
+				end += 2;
+			}
+			if (*end != '\0') goto usage;
+			break;
+		case 'c':
+			clock_period = atoi(optarg) * 1000;
+			if (clock_period >= 0) break;
+			fprintf(stderr, "bad clock probe period '%s'\n", optarg);
+			goto usage;
+		case 'L':
+			shm_name = optarg;
+			break;
+		case 'a':
+			ret = sched_conf_parse(tank.sched, TANK_THREADS, optarg);
+			if (ret == 0) break;
+			fprintf(stderr, "bad thread configuration '%s': %s\n", optarg, strerror(-ret));
+			goto usage;
+		case 'm':
+			mmio_path = optarg;
+			break;
+		case 'W':
+			pwm_root = optarg;
+			break;
+		case 'w':
+			if (hw_pwm_parse(hw_pwm, optarg) == 0) break;
+			fprintf(stderr, "bad hardware PWM channel '%s'\n", optarg);
+			/* fall through */
+		default:
+			goto usage;
+		}
+	}
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s port\n", argv[0]);
+	if (optind != argc - 1) {
+usage:
+		fprintf(stderr, "Usage: %s [-a role=cpu[,policy[:prio]]]... [-c clock_ms] [-L shm_name] [-l lease_ms] [-M metrics_port|/metrics_socket]\n"
+				"          [-m gpio_mem] [-f filter[:window]] [-S sonic_hz] [-R margin_cm[:cm_per_s]] [-V deg_per_s[:deg_per_s2]]\n"
+				"          [-T accel[:decel]] [-P period_us[:step_us][:d]] [-b] [-W pwm_sysfs_root] [-w device=pwmchip:channel]... port\n"
+				"  role: loop (device timing) or net (network and console), policy: other, fifo or rr\n"
+				"  clock_ms: period of the client clock/RTT probes, 0 disables them\n"
+				"  shm_name: local control, shared memory /shm_name and unix socket @shm_name\n"
+				"  gpio_mem: /dev/mem, /dev/gpiomem or a plain file to map GPIO registers from\n"
+				"  filter: sonic range filter, median (default) or trimmed, window up to 15 samples (5)\n"
+				"  sonic_hz: adaptive ranging, near obstacles are pinged up to this rate\n"
+				"  margin_cm: collision reflex stop margin (15), 0 disables it, cm_per_s: full track speed (60)\n"
+				"  deg_per_s: servo slew rate (240), 0 jumps to the target, deg_per_s2: servo acceleration (4000)\n"
+				"  accel, decel: track ramp in %% of the full duty per second (500:1000), 0 is no limit\n"
+				"  period_us, step_us: track PWM frame (20000) and pulse step (1), d dithers the step remainder\n"
+				"  -b: buzzer tone edges without the spinning wait, far less CPU but rougher tones\n"
+				"  hardware PWM devices: track_right track_left servo1 servo2 servo3\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
@@ -310,7 +1098,7 @@ int main (int argc, char *argv[]) {
 	hints.ai_addr = NULL;
 	hints.ai_next = NULL;
 
-	retval = getaddrinfo(NULL, argv[1], &hints, &result);
+	retval = getaddrinfo(NULL, argv[optind], &hints, &result);
 	if (retval != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(retval));
 		exit(EXIT_FAILURE);
@@ -340,16 +1128,30 @@ int main (int argc, char *argv[]) {
 
 	freeaddrinfo(result);
 
-	if (listen(fd, 5) != 0){
+	// a burst of connects must not overflow the backlog into SYN retries
+	if (listen(fd, TANK_SERVER_MAX_CLIENTS) != 0){
 		fprintf(stderr, "Could not listen, error: %s\n", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	for (int i=0; i < MAX_CONNECTION;i++){
-		client[i].fd=-1;
+	metrics_thread_register(&tank.metrics[TANK_THREAD_NET], "net");
+	metrics.fd = -1;
+	if (metrics_addr != NULL) {
+		ret = metrics_server_open(&metrics, metrics_addr);
+		if (ret != 0) {
+			fprintf(stderr, "Could not open metrics endpoint %s: %s\n", metrics_addr, strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+		printf("metrics: serving on %s%s\n", metrics_addr[0] == '/' ? "" : "127.0.0.1:", metrics_addr);
 	}
 
 	
+	if (mmio_path != NULL) {
+		ret = gpio_out_mmio_open (mmio_path);
+		if (ret == 0) printf ("gpio: registers mapped from %s\n", mmio_path);
+		else printf ("gpio: can't map registers from %s (%s), using libgpiod\n", mmio_path, strerror(-ret));
+	};
+
 	chip5 = gpiod_chip_open_by_number (GPIOCHIP5);
 	if (!chip5) {
 		printf ("Open gpiochip%d error\n", GPIOCHIP5);
@@ -420,6 +1222,11 @@ int main (int argc, char *argv[]) {
 
 	gpiod_line_request_output (tank.buzzer, "LED_gpiod", 1);
 
+	gpio_out_init (&tank.red_pin, tank.red);
+	gpio_out_init (&tank.green_pin, tank.green);
+	gpio_out_init (&tank.blue_pin, tank.blue);
+	gpio_out_init (&tank.buzzer_pin, tank.buzzer);
+
 	dev = &tank.dev[0];
 	ret = track_setup(dev, chip6, chip7);
 	if (ret!=0) {
@@ -431,6 +1238,18 @@ int main (int argc, char *argv[]) {
 	};
 	dev->ops->start_request(dev);
 
+	ret = track_set_pwm(dev, track_period, track_step, track_dither);
+	if (ret!=0) {
+		fprintf(stderr, "bad track PWM %d:%d usec\n", track_period, track_step);
+		gpiod_chip_close (chip5);
+		gpiod_chip_close (chip6);
+		gpiod_chip_close (chip7);
+		gpiod_chip_close (chip8);
+		return ret;
+	};
+	printf("tracks: %d Hz PWM, %d speed levels%s\n", 1000000 / track_period, track_period / track_step,
+	       track_dither ? ", dithered" : "");
+	track_set_ramp(dev, track_accel, track_decel);
 	track_set_speed(dev, 0, 0);
 	
 	ret = servo_setup (&tank.dev[1], SERVO1_MIN, SERVO1_MAX, SERVO1_DEF, SERVO1_LINE, chip5);
@@ -460,13 +1279,58 @@ int main (int argc, char *argv[]) {
 		return ret;
 	};
 	
-	for (i=1; i<tank.dev_cnt-1; i++){
+	for (i=1; i<4; i++){
 		dev = &tank.dev[i];
+		angle_servo_set_profile(dev, servo_velocity, servo_accel);
 		dev->ops->start_request(dev);
 	};
 	
 	dev = &tank.dev[4];
-	ret = sonic_setup(dev, chip7);
+	ret = sonic_setup(dev, chip7, sonic_filter, sonic_window);
+	if (ret!=0) {
+		gpiod_chip_close (chip5);
+		gpiod_chip_close (chip6);
+		gpiod_chip_close (chip7);
+		gpiod_chip_close (chip8);
+		return ret;
+	};
+	if (sonic_rate > 0) {
+		sonic_set_adaptive(dev, 1000000 / sonic_rate);
+		printf("sonic: adaptive ranging up to %d Hz\n", sonic_rate);
+	}
+
+	ret = macro_init(&tank.dev[5], tank_macro_apply, &tank);
+	if (ret!=0) {
+		gpiod_chip_close (chip5);
+		gpiod_chip_close (chip6);
+		gpiod_chip_close (chip7);
+		gpiod_chip_close (chip8);
+		return ret;
+	};
+
+	scan_ring_init(&tank.scan_out);
+	ret = scanner_init(&tank.dev[6], &tank.dev[1], &tank.dev[4], &tank.scan_out);
+	if (ret!=0) {
+		gpiod_chip_close (chip5);
+		gpiod_chip_close (chip6);
+		gpiod_chip_close (chip7);
+		gpiod_chip_close (chip8);
+		return ret;
+	};
+
+	dev = &tank.dev[7];
+	ret = range_init(dev, &tank.dev[0], &tank.dev[1], &tank.dev[4], reflex_speed);
+	if (ret!=0) {
+		gpiod_chip_close (chip5);
+		gpiod_chip_close (chip6);
+		gpiod_chip_close (chip7);
+		gpiod_chip_close (chip8);
+		return ret;
+	};
+	dev->ops->start_request(dev);
+
+	dev = &tank.dev[8];
+	ret = grid_init(dev, &tank.dev[0], &tank.dev[1], &tank.dev[4], reflex_speed);
 	if (ret!=0) {
 		gpiod_chip_close (chip5);
 		gpiod_chip_close (chip6);
@@ -474,21 +1338,88 @@ int main (int argc, char *argv[]) {
 		gpiod_chip_close (chip8);
 		return ret;
 	};
+	dev->ops->start_request(dev);
+
+	ret = led_init(&tank.dev[9], &tank.red_pin, &tank.green_pin, &tank.blue_pin);
+	if (ret!=0) {
+		gpiod_chip_close (chip5);
+		gpiod_chip_close (chip6);
+		gpiod_chip_close (chip7);
+		gpiod_chip_close (chip8);
+		return ret;
+	};
+
+	ret = buzzer_init(&tank.dev[10], &tank.buzzer_pin, buzzer_precise);
+	if (ret!=0) {
+		gpiod_chip_close (chip5);
+		gpiod_chip_close (chip6);
+		gpiod_chip_close (chip7);
+		gpiod_chip_close (chip8);
+		return ret;
+	};
+
+	hw_pwm_setup(&tank, pwm_root, hw_pwm);
 
 	int exit_tank=0;
 	int last_distance=-1;
 
-	tank_state.sonic_distance=htons(sonic_get_distance(&tank.dev[4]));
-	tank_state.right_speed=htons(100*track_get_speed_right (&tank.dev[0])/TRACK_PERIOD);
-	tank_state.left_speed=htons(100*track_get_speed_left (&tank.dev[0])/TRACK_PERIOD);
-	tank_state.sonik_servo_angle=angle_get (&tank.dev[1])-angle_def(&tank.dev[1]);
-	tank_state.camera_servo1_angle=angle_get (&tank.dev[2])-angle_def(&tank.dev[2]);
-	tank_state.camera_servo2_angle=angle_get (&tank.dev[3])-angle_def(&tank.dev[3]);
-	tank_state.red=gpiod_line_get_value(tank.red)==1?'R':'_';
-	tank_state.green=gpiod_line_get_value(tank.green)==1?'G':'_';
-	tank_state.blue=gpiod_line_get_value(tank.blue)==1?'B':'_';
-	tank_state.buzzer=gpiod_line_get_value(tank.buzzer)==0?'P':'_';
-	tank_msg.info=tank_state;
+	cmd_ring_init(&tank.cmds);
+	timed_ring_init(&tank.timed_in);
+	cmd_trace_init(&tank.traces);
+	macro_box_init(&tank.macro_in);
+	tank.trace_wait = 0;
+	timed_heap_init(&tank.timed);
+	lease_init(&tank.lease, lease_window);
+	reflex_init(&tank.reflex, reflex_margin, reflex_speed);
+	if (reflex_margin > 0)
+		printf("collision reflex: %d cm margin, %d cm/s full speed\n", reflex_margin, reflex_speed);
+	printf("control lease: %d ms\n", lease_window / 1000);
+	ret = tank_server_init(&server, fd, &tank.lease, &tank_server_ops, &tank);
+	if (ret != 0) {
+		fprintf(stderr, "Could not set up the server socket, error: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	server.clock_period = clock_period;
+	atomic_init(&tank.exit, 0);
+	atomic_init(&tank.loop_ready, 0);
+	atomic_init(&tank.state_gen, 0);
+	tank.wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (tank.wake_fd < 0) {
+		fprintf(stderr, "Could not create eventfd, error: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	tank.shm.shm = NULL;
+	tank.shm.sock = -1;
+	if (shm_name != NULL) {
+		ret = shm_ctl_open(&tank.shm, shm_name, tank.wake_fd);
+		if (ret != 0) {
+			fprintf(stderr, "Could not open local control /%s: %s\n", shm_name, strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+		printf("local control: shared memory /%s, socket @%s\n", shm_name, shm_name);
+	}
+
+	ret = pthread_create(&loop_thread, NULL, tank_loop, &tank);
+	if (ret != 0) {
+		fprintf(stderr, "Could not start loop thread, error: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	ret = sched_conf_apply(&tank.sched[TANK_THREAD_NET], pthread_self());
+	if (ret != 0) printf("net: can't apply thread configuration: %s\n", strerror(-ret));
+	while (!atomic_load(&tank.loop_ready)) usleep(1000);
+	if (tank.loop_conf_ret != 0) printf("loop: can't apply thread configuration: %s\n", strerror(-tank.loop_conf_ret));
+
+	sched_conf_describe(loop_thread, loop_desc, sizeof(loop_desc));
+	sched_conf_describe(pthread_self(), net_desc, sizeof(net_desc));
+	printf("loop thread: %s\nnet thread: %s\n", loop_desc, net_desc);
+	printf("precise wait: spin margin %d usec (max overshoot %d usec)\n",
+		tank.pw.margin, tank.pw.overshoot_max);
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &last_frame);
+	tank.map_sent = last_frame;
+	tank_state_msg(&tank, &tank_msg);
+	tank_server_publish(&server, &tank_msg, sizeof(tank_msg));
 	kb_key_init(&kb);
 	kb_key_echo(&kb, 0);
 	kb_key_nonblock(&kb, 1);
@@ -519,237 +1450,123 @@ int main (int argc, char *argv[]) {
 
 
 	while(1) {
-		fd_set	rfds;
-		int	i, retval, max;
-
-		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-
 		state = 0;
 		while(kb_key_read(&kb, x, sizeof(x))){
 			if (strlen(x) == 1) {
 				if (x[0] == 'q') exit_tank=1;
-				else state |= key_phess_handle(x[0], &tank);
+				else if (key_phess_check(x[0])) tank_cmd_push(&tank, x[0]);
 			}else if (strcmp(x, "\e[A")==0) {
-				state |= key_phess_handle(TANK_CLNT_CMD_CAMERA_UP, &tank);
+				tank_cmd_push(&tank, TANK_CLNT_CMD_CAMERA_UP);
 			}else if (strcmp(x, "\e[B")==0) {
-				state |= key_phess_handle(TANK_CLNT_CMD_CAMERA_DOWN, &tank);
+				tank_cmd_push(&tank, TANK_CLNT_CMD_CAMERA_DOWN);
 			}else if (strcmp(x, "\e[C")==0) {
-				state |= key_phess_handle(TANK_CLNT_CMD_CAMERA_RIGHT, &tank);
+				tank_cmd_push(&tank, TANK_CLNT_CMD_CAMERA_RIGHT);
 			}else if (strcmp(x, "\e[D")==0) {
-				state |= key_phess_handle(TANK_CLNT_CMD_CAMERA_LEFT, &tank);
+				tank_cmd_push(&tank, TANK_CLNT_CMD_CAMERA_LEFT);
 			}
 		}
 
-		FD_ZERO(&rfds);
+		srv_cnt = tank_server_pollfds(&server, pfd);
+		metrics_cnt = metrics_server_pollfds(&metrics, pfd + srv_cnt);
+		shm_cnt = shm_ctl_pollfds(&tank.shm, pfd + srv_cnt + metrics_cnt);
 
-		max = fd;
-		FD_SET(fd, &rfds);
-		for(i = 0; i < MAX_CONNECTION; i++){
-			if (client[i].fd<0) continue;
-			if (client[i].fd > max) max = client[i].fd;
-			FD_SET(client[i].fd, &rfds);
-		}
-
-		time_wait_select.tv_sec=0;
-		time_wait_select.tv_usec=0;
-		retval = select(max + 1, &rfds, NULL, NULL, &time_wait_select);
+		// the devices run in their own thread, so the network may block here
+		retval = poll(pfd, srv_cnt + metrics_cnt + shm_cnt, NET_POLL / 1000);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
 		if (retval == -1){
-			fprintf(stderr, "\nCould not select, error: %s\n", strerror(errno));
+			fprintf(stderr, "\nCould not poll, error: %s\n", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
 
-		if (FD_ISSET(fd, &rfds)){
-			struct 	sockaddr_storage	peer_addr;
-			socklen_t			peer_addr_len;
-			char				host[NI_MAXHOST], service[NI_MAXSERV];
-			int				fd1, none_client=-1;
-
-			peer_addr_len = sizeof(peer_addr);
-			fd1 = accept(fd, (struct sockaddr *) &peer_addr, &peer_addr_len);
-			if (fd1 != -1){
-				retval = getnameinfo((struct sockaddr *) &peer_addr,
-						peer_addr_len, host, NI_MAXHOST,
-						service, NI_MAXSERV, NI_NUMERICSERV);
-				if (retval == 0) printf("\nReceived connection from %s:%s\n", host, service);
-				else fprintf(stderr, "\ngetnameinfo: %s\n", gai_strerror(retval));
-
-				for (int i=0; i<MAX_CONNECTION; i++){
-					if (client[i].fd<0){
-						none_client=i;
-						break;
-					};
-				};
-				if (none_client!=-1){
-					int ret_val = write(fd1, HELLO_CLIENT, strlen(HELLO_CLIENT));
-					if (ret_val!=strlen(HELLO_CLIENT)){
-					printf("\nclose connection %d, can't send hello string, %s\n", none_client, strerror(errno));
-					close(fd1);
-
-					}else{
-						client[none_client].fd = fd1;
-						client[none_client].bytes=0;
-						client[none_client].handshake=0;
-					}
-
-				}else{
-					fprintf(stderr, "\nMax connections reached, drop new connection\n");
-					close(fd1);
-				}
+		if (metrics.fd >= 0) {
+			gauges.clients_connected = server.clients;
+			gauges.clients_handshaken = server.handshaken;
+			gauges.controller = server.controller >= 0;
+			gauges.sonic_confidence = sonic_get_confidence(&tank.dev[4]);
+			gauges.reflex_latency = atomic_load(&tank.reflex.latency);
+			gauges.range_distance = range_get_distance(&tank.dev[7]);
+			gauges.range_closing = range_get_closing(&tank.dev[7]);
+			gauges.reflex_latency_max = atomic_load(&tank.reflex.latency_max);
+			gauges.buzzer_tone = buzzer_get_tone(&tank.dev[10]);
+			buzzer_edge_late(&tank.dev[10], &gauges.buzzer_late, &gauges.buzzer_late_max);
+			gauges.servo_pulse_error = angle_pulse_error(&tank.dev[1]);
+			gauges.controller_rtt = -1;
+			gauges.controller_offset = 0;
+			if (server.controller >= 0) {
+				gauges.controller_rtt = server.client[server.controller].clock.srtt;
+				gauges.controller_offset = server.client[server.controller].clock.clock_offset;
 			}
+			gauges.dev = tank.dev;
+			gauges.dev_cnt = tank.dev_cnt;
+			metrics_server_handle(&metrics, pfd + srv_cnt, metrics_cnt, &gauges);
 		}
-		for(i = 0; i < MAX_CONNECTION; i++){
-			ssize_t			bytes;
-
-			if (!FD_ISSET(client[i].fd, &rfds)) continue;
-
-			bytes = read(client[i].fd, client[i].buf+client[i].bytes, sizeof(client[i].buf)-client[i].bytes);
-			if (bytes <= 0){
-				if (bytes < 0){
-					// error
-					printf("\nread error: %s\n", strerror(errno));
-				}
-				printf("\nclose connection %d, bad read\n", i);
-				close(client[i].fd);
-				client[i].fd=-1;
-				continue;
-			}
 
-			client[i].bytes+=bytes;
-
-			if (client[i].handshake!=1){
-				if (client[i].bytes<strlen(HELLO_SERVER)) continue;
-				if (strncmp(client[i].buf, HELLO_SERVER, strlen(HELLO_SERVER))==0){
-					client[i].handshake=1;
-					client[i].bytes-=strlen(HELLO_SERVER);
-					client_cnt+=1;
-					tank_msg.info=tank_state;
-					tank_msg.type=TANK_SRV_MSG_TYPE_INFO_DATA;
-					int ret_val = write(client[i].fd, &tank_msg, sizeof(tank_msg));
-					if (ret_val!=sizeof(tank_msg)){
-						printf("\nclose connection %d, can't send status_tank, %s\n", i, strerror(errno));
-						close(client[i].fd);
-						client[i].fd=-1;
-						client_cnt-=1;
-					}
-					client[i].last_check=ts;
-					client[i].sucsess_check=1;
-					if (client[i].bytes>0)
-						memmove(client[i].buf, client[i].buf+strlen(HELLO_SERVER), client[i].bytes);
-
-				}else{
-					close(client[i].fd);
-					client[i].fd=-1;
-					printf("\nwrong client[%d] hello string\n", i);
-					continue;
-				}
-			};
-
-
-			for(int j=0; j<client[i].bytes; j++){
-				if (client[i].buf[j]==TANK_CLNT_CMD_CONNECT_CHEK){
-					client[i].sucsess_check=1;
-				}else if (key_phess_handle(client[i].buf[j], &tank) != 0){
-					state = 1;
-				}else {
-					close(client[i].fd);
-					client[i].fd=-1;
-					client_cnt-=1;
-					printf("\nwrong client[%d] comand\n", i);
-					continue;
-				}
-			}
-			client[i].bytes=0;
-		};
+		tank_server_handle(&server, pfd, srv_cnt, &ts);
+		tank_traces_reply(&tank, &server);
+		tank_scan_publish(&tank, &server);
+		tank_map_publish(&tank, &server, &ts);
+		shm_ctl_handle(&tank.shm, pfd + srv_cnt + metrics_cnt, shm_cnt);
 
-		if(sonic_get_distance(&tank.dev[4])!=last_distance){
-			last_distance=sonic_get_distance(&tank.dev[4]);
+		if(atomic_load(&tank.state_gen)!=state_gen){
+			state_gen=atomic_load(&tank.state_gen);
 			state=1;
 		}
 
-		if (exit_tank==1) break;
-		for(i=0; i<MAX_CONNECTION; i++){
-			if (client[i].fd==-1 || client[i].handshake!=1) continue;
-			if (device_timespec_diff(&ts, &client[i].last_check)>=TIME_WAIT){
-				if(client[i].sucsess_check==1){
-					int ret_val = write(client[i].fd, &alive_check, sizeof(alive_check));
-					if (ret_val!=sizeof(alive_check)){
-						printf("\nclose connection %d, can't ping, %s\n", i, strerror(errno));
-						close(client[i].fd);
-						client[i].fd=-1;
-						client_cnt-=1;
-					}
-					client[i].sucsess_check=0;
-					client[i].last_check=ts;
-					continue;
-				}
-				printf("\nclose connection %d, timeout happens\n", i);
-				close(client[i].fd);
-				client[i].fd=-1;
-				if (client_cnt<0){
-					char stop=TANK_CLNT_CMD_STOP;
-					track_direction(stop, &tank.dev[0]);
-				}
-			}
-			if (state == 1) {
-				tank_state.sonic_distance=htons(sonic_get_distance(&tank.dev[4]));
-				tank_state.right_speed=htons(100*track_get_speed_right (&tank.dev[0])/TRACK_PERIOD);
-				tank_state.left_speed=htons(100*track_get_speed_left (&tank.dev[0])/TRACK_PERIOD);
-				tank_state.sonik_servo_angle=angle_get (&tank.dev[1])-angle_def(&tank.dev[1]);
-				tank_state.camera_servo1_angle=angle_get (&tank.dev[2])-angle_def(&tank.dev[2]);
-				tank_state.camera_servo2_angle=angle_get (&tank.dev[3])-angle_def(&tank.dev[3]);
-				tank_state.red=gpiod_line_get_value(tank.red)==1?'R':'_';
-				tank_state.green=gpiod_line_get_value(tank.green)==1?'G':'_';
-				tank_state.blue=gpiod_line_get_value(tank.blue)==1?'B':'_';
-				tank_state.buzzer=gpiod_line_get_value(tank.buzzer)==0?'P':'_';
-				tank_msg.info=tank_state;
-				tank_msg.type=TANK_SRV_MSG_TYPE_INFO_DATA;
-				int ret_val = write(client[i].fd, &tank_msg, sizeof(tank_msg));
-				if (ret_val!=sizeof(tank_msg)){
-					printf("\nclose connection %d, can't send status_tank, %s\n", i, strerror(errno));
-					close(client[i].fd);
-					client[i].fd=-1;
-					client_cnt-=1;
-					continue;
-				}
-			};
+		if(atomic_load(&tank.reflex.events)!=reflex_events){
+			reflex_events=atomic_load(&tank.reflex.events);
+			printf("\ncollision reflex: obstacle at %dcm, forward speed limited (%u times)\n",
+			       atomic_load(&tank.reflex.distance), reflex_events);
 		}
-		if (state == 1) print_state(&tank);
 
-                delay = WAKEUP_NEVER;
-                for(i = 0; i < tank.dev_cnt; i++) {
-                        dev = &tank.dev[i];
+		if(atomic_load(&tank.lease.expired)!=lease_expired){
+			lease_expired=atomic_load(&tank.lease.expired);
+			printf("\ncontrol lease expired (%u times), tracks stopped\n", lease_expired);
+		}
+
+		if(sonic_get_distance(&tank.dev[4])!=last_distance){
+			last_distance=sonic_get_distance(&tank.dev[4]);
+			state=1;
+		}
 
-                        int wakeup = device_get_action_interval(dev, &ts);
-                        if (wakeup == WAKEUP_NOW) {
-                                dev->ops->timer_action(dev, &ts);
-                                wakeup = device_get_action_interval(dev, &ts);
-                        }
-                        if (wakeup <= WAKEUP_NEVER) continue;
-                        if ((delay <= WAKEUP_NEVER) || (wakeup < delay)) delay = wakeup;
-                }
+		// keeps the server clock in the telemetry fresh for timed commands
+		if(server.fresh || device_timespec_diff(&ts, &last_frame)>=TELEMETRY_REFRESH){
+			server.fresh=0;
+			state=1;
+		}
 
-                if (delay > WAKEUP_NOW) usleep(delay);
-                if (delay <= WAKEUP_NEVER) usleep(10000);
+		if (exit_tank==1) break;
+		if (state == 1) {
+			last_frame=ts;
+			tank_state_msg(&tank, &tank_msg);
+			tank_server_publish(&server, &tank_msg, sizeof(tank_msg));
+			print_state(&tank);
+		}
 	};
 
-	for (i=0;i<MAX_CONNECTION;i++){
-		if (client[i].fd==-1) continue;
-		close(client[i].fd);
-	}
-	close(fd);
+	atomic_store(&tank.exit, 1);
+	tank_wakeup(&tank);
+	pthread_join(loop_thread, NULL);
+	shm_ctl_close(&tank.shm);
+	close(tank.wake_fd);
+
+	tank_server_close(&server);
+	if (metrics.fd >= 0) metrics_server_close(&metrics);
 	kb_key_nonblock(&kb, 0);
 	kb_key_echo(&kb, 1);
 
-	gpiod_line_set_value (tank.red, 0);
-	gpiod_line_set_value (tank.green, 0);
-	gpiod_line_set_value (tank.blue, 0);
-	gpiod_line_set_value (tank.buzzer, 1);
+	gpio_out_set (&tank.red_pin, 0);
+	gpio_out_set (&tank.green_pin, 0);
+	gpio_out_set (&tank.blue_pin, 0);
+	gpio_out_set (&tank.buzzer_pin, 1);
 
 	for (i=0;i<tank.dev_cnt;i++){
 		device_destroy(&tank.dev[i], 1);
 	};
+	gpio_out_mmio_close();
 
-	printf("\n");
+	printf("\nloop jitter [loop: %s; net: %s]: %u wakeups, mean %d usec, 99%% %d usec, max %d usec\n",
+		loop_desc, net_desc, tank.jitter.count, loop_stats_mean(&tank.jitter),
+		loop_stats_percentile(&tank.jitter, 990), tank.jitter.max);
 
 	return 0;
 }
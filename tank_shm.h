@@ -0,0 +1,81 @@
+#ifndef TANK_SHM_H
+#define TANK_SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "client_server.h"
+
+/*
+ * Local control interface for on-board processes.
+ *
+ * The server started with '-L name' creates the POSIX shared memory
+ * object "/name" holding struct tank_shm and listens on the abstract
+ * unix socket "@name". A process connecting to the socket receives the
+ * wakeup eventfd of the device loop (SCM_RIGHTS), then maps the object
+ * read-write. State is read with tank_shm_read_state(), setpoints are
+ * queued with tank_shm_push(). The ring has a single producer, so only
+ * one local controller may push at a time.
+ *
+ * Setpoints are applied as they come, they override whatever a network
+ * controller sent before, there is no arbitration between the two. A
+ * track setpoint takes the control lease: if no track setpoint or byte
+ * from the network controller comes within the lease window (server
+ * option -l), the tracks are stopped, so a local controller driving the
+ * tank has to repeat its track setpoint.
+ */
+
+#define TANK_SHM_MAGIC		0x544e4b31	// "TNK1"
+#define TANK_SHM_VERSION	1
+#define TANK_SHM_SETPOINTS	64		// must be a power of 2
+
+struct tank_shm_state {
+    int64_t ts;				// usec, CLOCK_MONOTONIC_RAW of the last update
+    int32_t right_speed, left_speed;	// usec of the track PWM period, sign is the direction
+    int32_t track_period;		// usec
+    int32_t sonic_distance;		// cm
+    int32_t servo_angle[3];		// sonic, camera horizontal, camera vertical
+    uint8_t red, green, blue;		// brightness, 0..255
+    uint8_t buzzer;			// 0 or 1
+};
+
+struct tank_shm {
+    uint32_t magic, version;
+
+    // state, written by the device loop under a seqlock (odd while updated)
+    _Atomic uint32_t seq;
+    struct tank_shm_state state;
+
+    // setpoints, head is written by the local controller, tail by the device loop
+    _Atomic uint32_t head, tail;
+    struct tank_setpoint ring[TANK_SHM_SETPOINTS];
+};
+
+static inline void tank_shm_read_state(struct tank_shm *shm, struct tank_shm_state *state)
+{
+    uint32_t seq;
+
+    do {
+	seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+	memcpy(state, &shm->state, sizeof(*state));
+	atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (atomic_load_explicit(&shm->seq, memory_order_relaxed) != seq));
+}
+
+// returns 0 if the ring is full
+static inline int tank_shm_push(struct tank_shm *shm, int wake_fd, const struct tank_setpoint *sp)
+{
+    uint32_t head = atomic_load_explicit(&shm->head, memory_order_relaxed);
+    uint64_t one = 1;
+
+    if (head - atomic_load_explicit(&shm->tail, memory_order_acquire) >= TANK_SHM_SETPOINTS)
+	return 0;
+
+    shm->ring[head & (TANK_SHM_SETPOINTS - 1)] = *sp;
+    atomic_store_explicit(&shm->head, head + 1, memory_order_release);
+    return write(wake_fd, &one, sizeof(one)) == sizeof(one);
+}
+
+#endif
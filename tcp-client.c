@@ -14,21 +14,287 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 
 #include "client_server.h"
 #include "unlock-io.h"
 
+#define PROFILE_LEAD	300000	// usec, how far ahead the profile is sent
+#define PROFILE_STEP	100000	// usec
+#define PROFILE_STEPS	10
+
+#define MACRO_SPEED	12000	// usec of the 20 ms track period, 60%
+
+#define SCAN_FROM	-60	// degrees of the sonic servo
+#define SCAN_TO		60
+#define SCAN_STEP	10
+#define SCAN_POINTS	((SCAN_TO - SCAN_FROM) / SCAN_STEP + 1)
+
+#define TRACE_IDS	256	// commands in flight
+#define TRACE_SAMPLES	4096
+
+enum trace_stage {
+    TRACE_UPLINK,		// send to server receive, needs the probed clock offset
+    TRACE_DISPATCH,
+    TRACE_APPLY,
+    TRACE_SET,
+    TRACE_EDGE,
+    TRACE_TOTAL,		// key press to PWM edge
+    TRACE_STAGES
+};
+
+static const char *trace_names[TRACE_STAGES] = {
+    "uplink", "dispatch", "apply", "set", "edge", "total"
+};
+
+struct trace_stats {
+    uint16_t next_id;
+    long long press[TRACE_IDS], sent[TRACE_IDS];
+    int cnt[TRACE_STAGES];
+    int sample[TRACE_STAGES][TRACE_SAMPLES];
+};
+
 struct server {
     int fd, handhake, cnt_byte;
+    long long offset;		// server clock minus our clock, usec
+    int synced;			// 0: unknown, 1: from frame stamps, 2: from clock probes
+    int rtt;			// usec, -1 if unknown
+    unsigned subs;		// TANK_SUB_* streams
     union {
-	char buf[21];
+	char buf[sizeof(struct tank_srv_msg_tile)];
 	struct tank_srv_msg msg;
+	struct tank_srv_msg_tile tile;
+    };
+};
+
+static long long usec_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * A frame is stamped before it is sent, so server time minus arrival time
+ * underestimates the offset by the one-way delay: the largest sample is
+ * the best one.
+ */
+static void clock_sample(struct server *serv, uint32_t sec, uint32_t usec){
+    long long offset = (long long)sec * 1000000 + usec - usec_now();
+
+    if (serv->synced == 2) return;
+    if (!serv->synced || offset > serv->offset) serv->offset = offset;
+    serv->synced = 1;
+}
+
+// second half of the server clock probe, the server does the math
+static int clock_reply(struct server *serv){
+    struct tank_clnt_clock msg;
+    long long t2 = usec_now(), t3;
+
+    if (ntohl(serv->msg.clock.rtt) != (uint32_t)-1) {
+	serv->rtt = (int32_t)ntohl(serv->msg.clock.rtt);
+	serv->offset = -((long long)(int32_t)ntohl(serv->msg.clock.offset_sec) * 1000000 +
+			 ntohl(serv->msg.clock.offset_usec));
+	serv->synced = 2;
+    };
+
+    memset(&msg, 0, sizeof(msg));
+    msg.cmd = TANK_CLNT_CMD_CLOCK;
+    msg.t1_sec = serv->msg.clock.t1_sec;
+    msg.t1_usec = serv->msg.clock.t1_usec;
+    msg.t2_sec = htonl(t2 / 1000000);
+    msg.t2_usec = htonl(t2 % 1000000);
+    t3 = usec_now();
+    msg.t3_sec = htonl(t3 / 1000000);
+    msg.t3_usec = htonl(t3 % 1000000);
+    return write(serv->fd, &msg, sizeof(msg)) == sizeof(msg) ? 0 : -1;
+}
+
+static void trace_sample(struct trace_stats *st, int stage, long long usec){
+    if (st->cnt[stage] < TRACE_SAMPLES) st->sample[stage][st->cnt[stage]++] = usec;
+}
+
+static int send_traced(struct server *serv, struct trace_stats *st, char key, long long press){
+    struct tank_clnt_traced msg;
+    uint16_t id = st->next_id++;
+
+    msg.cmd = TANK_CLNT_CMD_TRACED;
+    msg.key = key;
+    msg.id = htons(id);
+    st->press[id % TRACE_IDS] = press;
+    st->sent[id % TRACE_IDS] = usec_now();
+    return write(serv->fd, &msg, sizeof(msg)) == sizeof(msg) ? 0 : -1;
+}
+
+static void trace_reply(struct server *serv, struct trace_stats *st){
+    struct tank_srv_trace *tr = &serv->msg.trace;
+    unsigned id = ntohs(tr->id) % TRACE_IDS;
+    long long recv = (long long)ntohl(tr->recv_sec) * 1000000 + ntohl(tr->recv_usec);
+    long long server = ntohs(tr->dispatch) + ntohs(tr->apply) + ntohl(tr->set);
+    long long uplink = recv - serv->offset - st->sent[id];
+
+    trace_sample(st, TRACE_DISPATCH, ntohs(tr->dispatch));
+    trace_sample(st, TRACE_APPLY, ntohs(tr->apply));
+    trace_sample(st, TRACE_SET, ntohl(tr->set));
+    if (tr->flags & TANK_TRACE_EDGE) {
+	trace_sample(st, TRACE_EDGE, ntohl(tr->edge));
+	server += ntohl(tr->edge);
+    };
+    // frame stamps only bound the offset from one side, skip until probed
+    if (serv->synced != 2) return;
+    trace_sample(st, TRACE_UPLINK, uplink);
+    trace_sample(st, TRACE_TOTAL, st->sent[id] - st->press[id] + uplink + server);
+}
+
+static int cmp_int(const void *a, const void *b){
+    return *(const int *)a - *(const int *)b;
+}
+
+static void trace_report(struct trace_stats *st){
+    int i, n;
+
+    if (st->cnt[TRACE_DISPATCH] == 0) return;
+    printf("\ncommand latency, usec     count      p50      p90      p99      max\n");
+    for (i = 0; i < TRACE_STAGES; i++) {
+	n = st->cnt[i];
+	if (n == 0) continue;
+	qsort(st->sample[i], n, sizeof(int), cmp_int);
+	printf("  %-22s %8d %8d %8d %8d %8d\n", trace_names[i], n,
+	       st->sample[i][n / 2], st->sample[i][n * 9 / 10], st->sample[i][n * 99 / 100],
+	       st->sample[i][n - 1]);
     };
+}
+
+static int send_timed(struct server *serv, char type, int a, int b, long long at){
+    struct tank_clnt_timed msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.cmd = TANK_CLNT_CMD_TIMED;
+    msg.type = type;
+    msg.a = htons(a);
+    msg.b = htons(b);
+    msg.at_sec = htonl(at / 1000000);
+    msg.at_usec = htonl(at % 1000000);
+    return write(serv->fd, &msg, sizeof(msg)) == sizeof(msg) ? 0 : -1;
+}
+
+static void macro_step(struct tank_clnt_macro_step *step, int a, int b, int delay){
+    memset(step, 0, sizeof(*step));
+    step->type = TANK_SETPOINT_TRACKS;
+    step->a = htons(a);
+    step->b = htons(b);
+    step->delay = htonl(delay);
+}
+
+// forward for 750 ms, pivot right for 300 ms, stop: played by the server, whatever the network does
+static int send_macro(struct server *serv, uint16_t id){
+    struct {
+	struct tank_clnt_macro hdr;
+	struct tank_clnt_macro_step step[3];
+    } msg;
+
+    msg.hdr.cmd = TANK_CLNT_CMD_MACRO;
+    msg.hdr.steps = 3;
+    msg.hdr.id = htons(id);
+    macro_step(&msg.step[0], MACRO_SPEED, MACRO_SPEED, 0);
+    macro_step(&msg.step[1], MACRO_SPEED, -MACRO_SPEED, 750000);
+    macro_step(&msg.step[2], 0, 0, 300000);
+    return write(serv->fd, &msg, sizeof(msg)) == sizeof(msg) ? 0 : -1;
+}
+
+struct scan_map {
+    int on;
+    unsigned sweep;
+    int distance[SCAN_POINTS];
 };
 
+static int send_subscribe(struct server *serv, unsigned sub, int on){
+    struct tank_clnt_subscribe msg;
+
+    serv->subs = on ? (serv->subs | sub) : (serv->subs & ~sub);
+    msg.cmd = TANK_CLNT_CMD_SUBSCRIBE;
+    msg.flags = serv->subs;
+    return write(serv->fd, &msg, sizeof(msg)) == sizeof(msg) ? 0 : -1;
+}
+
+// starts or stops the sweep scanner and the point stream
+static int send_scan(struct server *serv, int on){
+    if (send_subscribe(serv, TANK_SUB_SCAN, on) != 0)
+	return -1;
+    return send_timed(serv, TANK_SETPOINT_SCAN, TANK_SCAN_ARC(SCAN_FROM, SCAN_TO), on ? SCAN_STEP : 0, 0);
+}
+
+// the map is printed once per sweep, one column per angle
+static void scan_point(struct server *serv, struct scan_map *map){
+    unsigned sweep = ntohs(serv->msg.scan.sweep);
+    int i, angle = serv->msg.scan.angle;
+
+    if (sweep != map->sweep) {
+	printf ("\nscan %u:", map->sweep);
+	for (i = 0; i < SCAN_POINTS; i++) printf (" %+d:%d", SCAN_FROM + i * SCAN_STEP, map->distance[i]);
+	printf ("\n");
+	map->sweep = sweep;
+    };
+    i = (angle - SCAN_FROM) / SCAN_STEP;
+    if (i >= 0 && i < SCAN_POINTS) map->distance[i] = (int16_t)ntohs(serv->msg.scan.distance);
+}
+
+struct grid_view {
+    int on;
+    int x, y;			// pose, cm
+    int8_t cell[TANK_MAP_TILE * TANK_MAP_TILES][TANK_MAP_TILE * TANK_MAP_TILES];
+};
+
+static void grid_tile(struct server *serv, struct grid_view *map){
+    struct tank_srv_tile *t = &serv->tile.tile;
+    int i, v;
+
+    if ((t->tx >= TANK_MAP_TILES) || (t->ty >= TANK_MAP_TILES)) return;
+    for (i = 0; i < TANK_MAP_TILE * TANK_MAP_TILE; i++) {
+	v = (t->cells[i / 2] >> (i % 2 * 4)) & 0x0f;
+	map->cell[t->ty * TANK_MAP_TILE + i / TANK_MAP_TILE][t->tx * TANK_MAP_TILE + i % TANK_MAP_TILE] = v > 7 ? v - 16 : v;
+    };
+}
+
+// 2x2 cells per character, x to the right, the start heading is up
+static void grid_print(struct grid_view *map){
+    int side = TANK_MAP_TILE * TANK_MAP_TILES;
+    int tx = map->x / TANK_MAP_CELL + side / 2, ty = map->y / TANK_MAP_CELL + side / 2;
+    int x, y, occ, free;
+
+    printf ("\n");
+    for (x = side - 2; x >= 0; x -= 2) {
+	for (y = side - 2; y >= 0; y -= 2) {
+	    occ = free = 0;
+	    occ += map->cell[y][x] > 0; occ += map->cell[y][x + 1] > 0;
+	    occ += map->cell[y + 1][x] > 0; occ += map->cell[y + 1][x + 1] > 0;
+	    free += map->cell[y][x] < 0; free += map->cell[y][x + 1] < 0;
+	    free += map->cell[y + 1][x] < 0; free += map->cell[y + 1][x + 1] < 0;
+	    if ((tx / 2 == x / 2) && (ty / 2 == y / 2)) putchar ('@');
+	    else putchar (occ ? '#' : free ? '.' : ' ');
+	};
+	putchar ('\n');
+    };
+}
+
+// smooth speed up and slow down, sent at once and played by the server clock
+static int send_profile(struct server *serv){
+    long long start = usec_now() + serv->offset + PROFILE_LEAD;
+    int i, speed;
+
+    for (i = 0; i <= 2 * PROFILE_STEPS; i++) {
+	speed = (i <= PROFILE_STEPS ? i : 2 * PROFILE_STEPS - i) * 1200;
+	if (send_timed(serv, TANK_SETPOINT_TRACKS, speed, speed, start + i * PROFILE_STEP) != 0)
+	    return -1;
+    };
+    return 0;
+}
+
 int main(int argc, char *argv[]){
     int hellc = strlen(HELLO_CLIENT), hells = strlen(HELLO_SERVER);
     struct addrinfo	hints;
@@ -39,12 +305,28 @@ int main(int argc, char *argv[]){
 
     struct kb_key kb;
     char x[10], c;
+    struct timespec now, last_send;
+    int observer = 0, opt;
+    static struct trace_stats trace;
+    long long press;
+    uint16_t macro_id = 0;
+    static struct scan_map scan;
+    static struct grid_view grid;
+    int reflex_off = 0;
 
     serv.handhake = 0; serv.cnt_byte=0;
+    serv.offset = 0; serv.synced = 0; serv.rtt = -1; serv.subs = 0;
     memset (serv.buf, 0, sizeof(serv.buf));
 
-    if (argc != 3) {
-	fprintf(stderr, "Usage: %s host port\n", argv[0]);
+    while ((opt = getopt(argc, argv, "o")) != -1) {
+	if (opt != 'o') goto usage;
+	observer = 1;
+    };
+
+    if (optind != argc - 2) {
+usage:
+	fprintf(stderr, "Usage: %s [-o] host port\n"
+			"  -o: watch only, don't take control of the tank\n", argv[0]);
 	exit(EXIT_FAILURE);
     };
 
@@ -54,7 +336,7 @@ int main(int argc, char *argv[]){
     hints.ai_flags = 0;
     hints.ai_protocol = 0;           /* Any protocol */
 
-    retval = getaddrinfo(argv[1], argv[2], &hints, &result);
+    retval = getaddrinfo(argv[optind], argv[optind + 1], &hints, &result);
     if (retval != 0) {
 	fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(retval));
 	exit(EXIT_FAILURE);
@@ -103,6 +385,15 @@ int main(int argc, char *argv[]){
 	"BUZZER:\n"
 	" '4'=updown\n"
 	" press key again to shutdown buzzer\n"
+	"PROFILE:\n"
+	" 'p'=smooth_speedup_and_slowdown (2s, timed by the tank clock)\n"
+	" 'm'=forward_pivot_right_stop (macro played by the tank)\n"
+	" 'g'=sweep_scan_start/stop (polar range map, printed per sweep)\n"
+	" 'n'=occupancy_map_on/off  'b'=print_map (@ tank, # occupied, . free)\n"
+	"COLLISION_REFLEX:\n"
+	" 'v'=override/arm (armed again if the control lease expires)\n"
+	"CONTROL:\n"
+	" '+'=take_control          '-'=release_control\n"
 	"EXIT:\n"
 	" 'q'=complete_program\n"
 	"__________________________________________________\n");
@@ -132,6 +423,14 @@ int main(int argc, char *argv[]){
 		};
 		serv.handhake=1;
 		serv.cnt_byte=0;
+		if (!observer) {
+		    c = TANK_CLNT_CMD_TAKE_CONTROL;
+		    if (write(serv.fd, &c, 1) != 1){
+			printf("write error: %s\n", strerror(errno));
+			break;
+		    };
+		};
+		clock_gettime(CLOCK_MONOTONIC, &last_send);
 	    };
 	} else {
 	    retval = select (serv.fd+1, &rfds, NULL, NULL, &timeout);
@@ -141,7 +440,7 @@ int main(int argc, char *argv[]){
 	    };
 	    if (FD_ISSET(serv.fd, &rfds)) {
 		retval = read (serv.fd, serv.buf+serv.cnt_byte,
-				sizeof (struct tank_srv_msg)-serv.cnt_byte);
+				sizeof (serv.buf)-serv.cnt_byte);
 		if (retval <= 0) {
 		    printf("read error: %s\n", strerror(errno));
 		    break;
@@ -162,18 +461,86 @@ int main(int argc, char *argv[]){
 
 			case TANK_SRV_MSG_TYPE_INFO_DATA:
 			    if (serv.cnt_byte < sizeof (struct tank_srv_msg)) goto no_data;
+			    clock_sample(&serv, ntohl(serv.msg.info.ts_sec), ntohl(serv.msg.info.ts_usec));
+			    grid.x = (int16_t)ntohs(serv.msg.info.pose_x);
+			    grid.y = (int16_t)ntohs(serv.msg.info.pose_y);
 			    printf ("\rtrack_power [%+04d%%, %+04d%%], sonic [%+03d, %03dm], camera [%+04d, %+04d], led [%c%c%c], buzzer [%c]",
 				    (int16_t)ntohs(serv.msg.info.left_speed),
 				    (int16_t)ntohs(serv.msg.info.right_speed),
 				    serv.msg.info.sonik_servo_angle, (int16_t)ntohs(serv.msg.info.sonic_distance),
 				    serv.msg.info.camera_servo1_angle, serv.msg.info.camera_servo2_angle,
 				    serv.msg.info.red, serv.msg.info.green, serv.msg.info.blue, serv.msg.info.buzzer);
+			    if ((int16_t)ntohs(serv.msg.info.range_distance) >= 0)
+				printf (", ahead [%dcm %+dcm/s]", (int16_t)ntohs(serv.msg.info.range_distance),
+					(int16_t)ntohs(serv.msg.info.range_closing));
+			    if (serv.msg.info.reflex != TANK_REFLEX_ARMED)
+				printf (", reflex [%c]", serv.msg.info.reflex);
+			    if (serv.msg.info.macro_state != TANK_MACRO_IDLE)
+				printf (", macro %u [%c%u]", ntohs(serv.msg.info.macro_id),
+					serv.msg.info.macro_state, serv.msg.info.macro_step);
+			    if (serv.rtt >= 0)
+				printf (", rtt %d.%01dms, offset %+lldms", serv.rtt / 1000, serv.rtt % 1000 / 100,
+					-serv.offset / 1000);
 			    fflush(stdout);
 			    memmove (serv.buf, serv.buf + sizeof (struct tank_srv_msg),
 					serv.cnt_byte - sizeof (struct tank_srv_msg));
 			    serv.cnt_byte -= sizeof (struct tank_srv_msg);
 			    break;
 
+			case TANK_SRV_MSG_TYPE_CLOCK:
+			    if (serv.cnt_byte < (int)TANK_SRV_MSG_CLOCK_SIZE) goto no_data;
+			    if (clock_reply(&serv) != 0){
+				printf("write error: %s\n", strerror(errno));
+				goto endloop;
+			    };
+			    clock_gettime(CLOCK_MONOTONIC, &last_send);
+			    memmove (serv.buf, serv.buf + TANK_SRV_MSG_CLOCK_SIZE,
+					serv.cnt_byte - TANK_SRV_MSG_CLOCK_SIZE);
+			    serv.cnt_byte -= TANK_SRV_MSG_CLOCK_SIZE;
+			    break;
+
+			case TANK_SRV_MSG_TYPE_TRACE:
+			    if (serv.cnt_byte < (int)TANK_SRV_MSG_TRACE_SIZE) goto no_data;
+			    trace_reply(&serv, &trace);
+			    memmove (serv.buf, serv.buf + TANK_SRV_MSG_TRACE_SIZE,
+					serv.cnt_byte - TANK_SRV_MSG_TRACE_SIZE);
+			    serv.cnt_byte -= TANK_SRV_MSG_TRACE_SIZE;
+			    break;
+
+			case TANK_SRV_MSG_TYPE_MACRO:
+			    if (serv.cnt_byte < (int)TANK_SRV_MSG_MACRO_SIZE) goto no_data;
+			    if (serv.msg.macro.status != TANK_MACRO_ACCEPTED)
+				printf ("\nmacro %u rejected [%c]\n", ntohs(serv.msg.macro.id), serv.msg.macro.status);
+			    memmove (serv.buf, serv.buf + TANK_SRV_MSG_MACRO_SIZE,
+					serv.cnt_byte - TANK_SRV_MSG_MACRO_SIZE);
+			    serv.cnt_byte -= TANK_SRV_MSG_MACRO_SIZE;
+			    break;
+
+			case TANK_SRV_MSG_TYPE_SCAN:
+			    if (serv.cnt_byte < (int)TANK_SRV_MSG_SCAN_SIZE) goto no_data;
+			    scan_point(&serv, &scan);
+			    memmove (serv.buf, serv.buf + TANK_SRV_MSG_SCAN_SIZE,
+					serv.cnt_byte - TANK_SRV_MSG_SCAN_SIZE);
+			    serv.cnt_byte -= TANK_SRV_MSG_SCAN_SIZE;
+			    break;
+
+			case TANK_SRV_MSG_TYPE_TILE:
+			    if (serv.cnt_byte < (int)TANK_SRV_MSG_TILE_SIZE) goto no_data;
+			    grid_tile(&serv, &grid);
+			    memmove (serv.buf, serv.buf + TANK_SRV_MSG_TILE_SIZE,
+					serv.cnt_byte - TANK_SRV_MSG_TILE_SIZE);
+			    serv.cnt_byte -= TANK_SRV_MSG_TILE_SIZE;
+			    break;
+
+			case TANK_SRV_MSG_TYPE_ROLE:
+			    if (serv.cnt_byte < TANK_SRV_MSG_ROLE_SIZE) goto no_data;
+			    printf ("\n%s\n", serv.msg.role == TANK_SRV_ROLE_CONTROLLER ?
+				    "you control the tank" : "watching only, another client controls the tank");
+			    memmove (serv.buf, serv.buf + TANK_SRV_MSG_ROLE_SIZE,
+					serv.cnt_byte - TANK_SRV_MSG_ROLE_SIZE);
+			    serv.cnt_byte -= TANK_SRV_MSG_ROLE_SIZE;
+			    break;
+
 			default:
 			    goto endloop;
 		    };
@@ -181,6 +548,7 @@ int main(int argc, char *argv[]){
 no_data:
 	    };
 	    while(kb_key_read(&kb, x, sizeof(x))) {
+		press = usec_now();
 		if (strcmp(x, "w")==0)         c = TANK_CLNT_CMD_FORWARD;
 		else if (strcmp(x, "a")==0)    c = TANK_CLNT_CMD_RIGHT;
 		else if (strcmp(x, "s")==0)    c = TANK_CLNT_CMD_BACKWARD;
@@ -200,15 +568,86 @@ no_data:
 		else if (strcmp(x, "4")==0)    c = TANK_CLNT_CMD_BUZZER;
 		else if (strcmp(x, "5")==0)    c = TANK_CLNT_CMD_SONIC_MOD1;
 		else if (strcmp(x, "6")==0)    c = TANK_CLNT_CMD_SONIC_MOD0;
+		else if (strcmp(x, "+")==0)    c = TANK_CLNT_CMD_TAKE_CONTROL;
+		else if (strcmp(x, "-")==0)    c = TANK_CLNT_CMD_RELEASE_CONTROL;
+		else if (strcmp(x, "p")==0) {
+		    if (!serv.synced) continue;
+		    if (send_profile(&serv) != 0){
+			printf("write error: %s\n", strerror(errno));
+			goto endloop;
+		    };
+		    clock_gettime(CLOCK_MONOTONIC, &last_send);
+		    continue;
+		}
+		else if (strcmp(x, "m")==0) {
+		    if (send_macro(&serv, ++macro_id) != 0){
+			printf("write error: %s\n", strerror(errno));
+			goto endloop;
+		    };
+		    clock_gettime(CLOCK_MONOTONIC, &last_send);
+		    continue;
+		}
+		else if (strcmp(x, "g")==0) {
+		    scan.on = !scan.on;
+		    if (send_scan(&serv, scan.on) != 0){
+			printf("write error: %s\n", strerror(errno));
+			goto endloop;
+		    };
+		    clock_gettime(CLOCK_MONOTONIC, &last_send);
+		    continue;
+		}
+		else if (strcmp(x, "n")==0) {
+		    grid.on = !grid.on;
+		    if (send_subscribe(&serv, TANK_SUB_MAP, grid.on) != 0){
+			printf("write error: %s\n", strerror(errno));
+			goto endloop;
+		    };
+		    clock_gettime(CLOCK_MONOTONIC, &last_send);
+		    continue;
+		}
+		else if (strcmp(x, "b")==0) {
+		    grid_print(&grid);
+		    continue;
+		}
+		else if (strcmp(x, "v")==0) {
+		    reflex_off = !reflex_off;
+		    if (send_timed(&serv, TANK_SETPOINT_REFLEX, !reflex_off, 0, 0) != 0){
+			printf("write error: %s\n", strerror(errno));
+			goto endloop;
+		    };
+		    clock_gettime(CLOCK_MONOTONIC, &last_send);
+		    continue;
+		}
 		else if (strcmp(x, "q")==0)    goto endloop;
 		else c = '9';
-		if (c!='9') {
+		if ((c == TANK_CLNT_CMD_TAKE_CONTROL) || (c == TANK_CLNT_CMD_RELEASE_CONTROL)) {
 		    retval = write(serv.fd, &c, 1);
 		    if (retval != 1){
 			if (retval < 0) printf("write error: %s\n", strerror(errno));
 			goto endloop;
 		    };
+		    clock_gettime(CLOCK_MONOTONIC, &last_send);
+		} else if (c!='9') {
+		    retval = send_traced(&serv, &trace, c, press);
+		    if (retval != 0){
+			if (retval < 0) printf("write error: %s\n", strerror(errno));
+			goto endloop;
+		    };
+		    clock_gettime(CLOCK_MONOTONIC, &last_send);
+		};
+	    };
+
+	    // keep the server side control lease alive
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    if ((now.tv_sec - last_send.tv_sec) * 1000000 + (now.tv_nsec - last_send.tv_nsec) / 1000 >=
+		    TANK_CLNT_HEARTBEAT_PERIOD) {
+		c = TANK_CLNT_CMD_CONNECT_CHEK;
+		retval = write(serv.fd, &c, 1);
+		if (retval != 1){
+		    if (retval < 0) printf("write error: %s\n", strerror(errno));
+		    goto endloop;
 		};
+		last_send = now;
 	    };
 	}
     };
@@ -217,6 +656,7 @@ endloop:
     kb_key_nonblock(&kb, 0);
     kb_key_echo(&kb, 1);
     close(serv.fd);
+    trace_report(&trace);
     printf("\n");
     return 0;
 }
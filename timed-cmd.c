@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include "device.h"
+#include "timed-cmd.h"
+
+long long timed_usec(struct timespec *ts)
+{
+	return (long long)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+void timed_ring_init(struct timed_ring *ring)
+{
+	memset(ring->cmd, 0, sizeof(ring->cmd));
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+int timed_ring_push(struct timed_ring *ring, const struct timed_cmd *cmd)
+{
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail >= TIMED_RING_SIZE)
+		return -ENOSPC;
+
+	ring->cmd[head & (TIMED_RING_SIZE - 1)] = *cmd;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return 0;
+}
+
+int timed_ring_pop(struct timed_ring *ring, struct timed_cmd *cmd)
+{
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return 0;
+
+	*cmd = ring->cmd[tail & (TIMED_RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+void timed_heap_init(struct timed_heap *heap)
+{
+	memset(heap, 0, sizeof(*heap));
+}
+
+void timed_heap_clear(struct timed_heap *heap)
+{
+	heap->cnt = 0;
+}
+
+static int timed_heap_less(struct timed_heap *heap, int a, int b)
+{
+	if (heap->cmd[a].at != heap->cmd[b].at)
+		return heap->cmd[a].at < heap->cmd[b].at;
+	return (int)(heap->order[a] - heap->order[b]) < 0;
+}
+
+static void timed_heap_swap(struct timed_heap *heap, int a, int b)
+{
+	struct timed_cmd cmd = heap->cmd[a];
+	unsigned order = heap->order[a];
+
+	heap->cmd[a] = heap->cmd[b];
+	heap->order[a] = heap->order[b];
+	heap->cmd[b] = cmd;
+	heap->order[b] = order;
+}
+
+int timed_heap_push(struct timed_heap *heap, const struct timed_cmd *cmd)
+{
+	int i, parent;
+
+	if (heap->cnt == TIMED_HEAP_SIZE)
+		return -ENOSPC;
+
+	i = heap->cnt++;
+	heap->cmd[i] = *cmd;
+	heap->order[i] = heap->seq++;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!timed_heap_less(heap, i, parent))
+			break;
+		timed_heap_swap(heap, i, parent);
+		i = parent;
+	}
+	return 0;
+}
+
+int timed_heap_pop_due(struct timed_heap *heap, long long now, struct timed_cmd *cmd)
+{
+	int i, child;
+
+	if ((heap->cnt == 0) || (heap->cmd[0].at > now))
+		return 0;
+
+	*cmd = heap->cmd[0];
+	heap->cnt--;
+	heap->cmd[0] = heap->cmd[heap->cnt];
+	heap->order[0] = heap->order[heap->cnt];
+
+	for (i = 0; ; i = child) {
+		child = 2 * i + 1;
+		if (child >= heap->cnt)
+			break;
+		if ((child + 1 < heap->cnt) && timed_heap_less(heap, child + 1, child))
+			child++;
+		if (!timed_heap_less(heap, child, i))
+			break;
+		timed_heap_swap(heap, i, child);
+	}
+	return 1;
+}
+
+int timed_heap_delay(struct timed_heap *heap, struct timespec *ts, struct timespec *deadline)
+{
+	long long at, left;
+
+	if (heap->cnt == 0)
+		return WAKEUP_NEVER;
+
+	at = heap->cmd[0].at;
+	deadline->tv_sec = at / 1000000;
+	deadline->tv_nsec = (at % 1000000) * 1000;
+
+	left = at - timed_usec(ts);
+	if (left > INT_MAX)
+		left = INT_MAX;
+	return (left > 0) ? (int)left : WAKEUP_NOW;
+}
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+#ifndef __TIMED_CMD_H__
+#define __TIMED_CMD_H__
+
+#include <stdatomic.h>
+#include <time.h>
+#include "client_server.h"
+
+#define TIMED_RING_SIZE		64	// must be a power of 2
+#define TIMED_HEAP_SIZE		256
+#define TIMED_HORIZON		300000000LL	// usec, commands further ahead are dropped
+
+struct timed_cmd {
+	long long		at;	// usec of CLOCK_MONOTONIC_RAW, 0 to apply at once
+	struct tank_setpoint	sp;
+};
+
+// single producer / single consumer, network thread to loop thread
+struct timed_ring {
+	atomic_uint		head;
+	atomic_uint		tail;
+	struct timed_cmd	cmd[TIMED_RING_SIZE];
+};
+
+// time ordered queue owned by the loop thread
+struct timed_heap {
+	int			cnt;
+	unsigned		seq;	// keeps commands with equal time in arrival order
+	unsigned		order[TIMED_HEAP_SIZE];
+	struct timed_cmd	cmd[TIMED_HEAP_SIZE];
+};
+
+long long timed_usec(struct timespec *ts);
+
+void timed_ring_init(struct timed_ring *ring);
+int  timed_ring_push(struct timed_ring *ring, const struct timed_cmd *cmd);	// 0 or -ENOSPC
+int  timed_ring_pop(struct timed_ring *ring, struct timed_cmd *cmd);		// 1 if taken
+
+void timed_heap_init(struct timed_heap *heap);
+void timed_heap_clear(struct timed_heap *heap);
+int  timed_heap_push(struct timed_heap *heap, const struct timed_cmd *cmd);	// 0 or -ENOSPC
+
+// takes the earliest command if it is due at 'now'
+int  timed_heap_pop_due(struct timed_heap *heap, long long now, struct timed_cmd *cmd);
+
+// usec before the earliest command or WAKEUP_NEVER, deadline is set if a command is queued
+int  timed_heap_delay(struct timed_heap *heap, struct timespec *ts, struct timespec *deadline);
+
+#endif
@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyrights (C) 2024 Mikhail Kshevetskiy
+ *
+ * Author: Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ */
+
+/*
+ * Cost and accuracy of the software PWM: runs the track device alone
+ * on its own lines, the way the tank loop does, over a sweep of duties
+ * for every period:step[:d] setting. The right track PWM line is read
+ * after every wakeup, so the edges are seen as the driver made them.
+ *
+ * For every setting the report gives the wakeups per second, the CPU
+ * share of the process and the cost of one timer action, then the duty
+ * error against the requested one in % of the full duty (mean and worst
+ * over the sweep): "step" is the error of the pulses the driver asked
+ * for, the rounding to the pulse step, "real" is the error of the pulses
+ * that came out, with the late falling edges. Both are taken over the
+ * frames between the first and the last rising edge of a run. A wakeup
+ * too late for the next rising edge loses the whole frame, "lost" is
+ * the share of such frames, they are left out of the duty errors.
+ *
+ * The loop sleeps until the next action like the tank loop does for
+ * the track, -p spins the end of every wait like a precise device.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "track.h"
+#include "precise-wait.h"
+
+#define BENCH_MSEC	2000	// per duty, 100 frames of the 20 ms default period
+#define BENCH_LINES	6
+#define BENCH_DUTY_STEP	1531	// usec of TRACK_PERIOD, odd, so the steps do not divide it
+
+struct bench_conf {
+	int	period, resolution, dither;
+};
+
+static const struct bench_conf bench_confs[] = {
+	{ 20000, 1, 0 },
+	{ 20000, 1000, 0 },
+	{ 20000, 1000, 1 },
+	{ 1000, 1, 0 },
+	{ 1000, 50, 0 },
+	{ 1000, 50, 1 },
+	{ 200, 10, 1 },
+};
+
+struct bench_stat {
+	long long	wall, cpu;		// usec
+	long long	actions, action_nsec;
+	double		step_err, step_max;	// % of the full duty
+	double		real_err, real_max;
+	double		lost;			// % of the frames
+	int		points;
+};
+
+static long long bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long bench_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+	       ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// sleeps until the next action of the device
+static void bench_wait(struct device *dev, struct precise_wait *pw)
+{
+	struct timespec ts;
+	int delay;
+
+	if (pw != NULL) {
+		precise_wait_until(pw, &dev->next_action);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	delay = device_get_action_interval(dev, &ts);
+	if (delay <= WAKEUP_NOW)
+		return;
+	ts.tv_sec = delay / 1000000;
+	ts.tv_nsec = (delay % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+static void bench_err(double *sum, double *max, double err)
+{
+	if (err < 0)
+		err = -err;
+	*sum += err;
+	if (err > *max)
+		*max = err;
+}
+
+// one duty for msec, returns non zero if there were not two rising edges to measure between
+static int bench_run(struct device *dev, struct gpiod_line *pwm, struct precise_wait *pw,
+		     int worktime, int msec, struct bench_stat *st)
+{
+	struct timespec ts, rise, first;
+	long long start, cpu, t;
+	long long sum_pulse = 0, sum_real = 0, pend_pulse = 0, pend_real = 0;
+	long long frames;
+	int level = 0, rises = 0, width;
+	double want = 100.0 * worktime / TRACK_PERIOD;
+
+	track_set_speed(dev, worktime, 0);
+	dev->ops->start_request(dev);
+	start = bench_nsec();
+	cpu = bench_cpu();
+
+	while (bench_nsec() - start < msec * 1000000LL) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		t = bench_nsec();
+		dev->ops->timer_action(dev, &ts);
+		st->action_nsec += bench_nsec() - t;
+		st->actions++;
+
+		if (gpiod_line_get_value(pwm) != level) {
+			level = !level;
+			clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+			if (level) {
+				// the pulse before this edge lies wholly in the window
+				sum_pulse += pend_pulse;
+				sum_real += pend_real;
+				pend_pulse = pend_real = 0;
+				if (rises++ == 0)
+					first = ts;
+				rise = ts;
+			} else if (rises > 0) {
+				width = device_timespec_diff(&ts, &rise);
+				pend_real = width;
+				pend_pulse = width - track_get_pulse_error_right(dev);
+			}
+		}
+		if (dev->state == DEV_STATE_STOPPED)
+			break;
+		bench_wait(dev, pw);
+	}
+	st->cpu += bench_cpu() - cpu;
+	st->wall += (bench_nsec() - start) / 1000;
+
+	// stop at a frame end, so the next run starts on a clean frame
+	track_set_speed(dev, 0, 0);
+	while (dev->state != DEV_STATE_STOPPED) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		dev->ops->timer_action(dev, &ts);
+		if (dev->state != DEV_STATE_STOPPED)
+			bench_wait(dev, pw);
+	}
+
+	if (rises < 2)
+		return -1;
+	// every frame of the sweep has a pulse, a frame without a rising edge was lost
+	frames = (long long)(rises - 1) * track_get_period(dev);
+	bench_err(&st->step_err, &st->step_max, 100.0 * sum_pulse / frames - want);
+	bench_err(&st->real_err, &st->real_max, 100.0 * sum_real / frames - want);
+	st->lost += 100.0 - 100.0 * frames / device_timespec_diff(&rise, &first);
+	st->points++;
+	return 0;
+}
+
+static void bench_conf_run(struct device *dev, struct gpiod_line *pwm, struct precise_wait *pw,
+			   const struct bench_conf *conf, int msec)
+{
+	struct bench_stat st;
+	int worktime, ret;
+
+	ret = track_set_pwm(dev, conf->period, conf->resolution, conf->dither);
+	if (ret != 0) {
+		printf("%6d %5d %-2s  %s\n", conf->period, conf->resolution,
+		       conf->dither ? "d" : "", strerror(-ret));
+		return;
+	}
+
+	memset(&st, 0, sizeof(st));
+	for (worktime = TRACK_MINTIME; worktime < TRACK_PERIOD; worktime += BENCH_DUTY_STEP)
+		if (bench_run(dev, pwm, pw, worktime, msec, &st) != 0)
+			fprintf(stderr, "period %d: no frames at duty %d\n", conf->period, worktime);
+	if (st.points == 0)
+		return;
+
+	printf("%6d %5d %-2s %8.0f %6.1f %8.0f %7.3f %7.3f %7.3f %7.3f %6.2f\n",
+	       conf->period, conf->resolution, conf->dither ? "d" : "",
+	       1e6 * st.actions / st.wall, 100.0 * st.cpu / st.wall,
+	       (double)st.action_nsec / st.actions,
+	       st.step_err / st.points, st.step_max,
+	       st.real_err / st.points, st.real_max, st.lost / st.points);
+}
+
+int main(int argc, char *argv[])
+{
+	struct gpiod_chip *chip;
+	struct gpiod_line *line[BENCH_LINES];
+	struct device dev;
+	struct precise_wait pw, *wait = NULL;
+	struct bench_conf conf;
+	char *p;
+	int opt, i, ret, num = 7, offset = 0, msec = BENCH_MSEC, one = 0;
+
+	while ((opt = getopt(argc, argv, "c:l:t:o:p")) != -1) {
+		switch (opt) {
+		case 'c':
+			num = atoi(optarg);
+			break;
+		case 'l':
+			offset = atoi(optarg);
+			break;
+		case 't':
+			msec = atoi(optarg);
+			break;
+		case 'o':
+			conf.period = atoi(optarg);
+			p = strchr(optarg, ':');
+			conf.resolution = (p != NULL) ? atoi(p + 1) : 1;
+			conf.dither = (p != NULL) && (strchr(p + 1, ':') != NULL);
+			one = 1;
+			break;
+		case 'p':
+			wait = &pw;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c gpiochip] [-l first_line] [-t msec] [-o period[:step[:d]]] [-p]\n"
+					"  drives lines first_line..first_line+%d of the chip, keep them free\n",
+				argv[0], BENCH_LINES - 1);
+			return 1;
+		}
+	}
+	if (msec <= 0)
+		msec = BENCH_MSEC;
+
+	chip = gpiod_chip_open_by_number(num);
+	if (chip == NULL) {
+		perror("gpiod_chip_open_by_number");
+		return 1;
+	}
+	for (i = 0; i < BENCH_LINES; i++) {
+		line[i] = gpiod_chip_get_line(chip, offset + i);
+		if (line[i] == NULL) {
+			perror("gpiod_chip_get_line");
+			return 1;
+		}
+	}
+	ret = track_init(&dev, line[0], line[1], line[2], line[3], line[4], line[5]);
+	if (ret != 0) {
+		fprintf(stderr, "track_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	track_set_ramp(&dev, 0, 0);
+	precise_wait_init(&pw);
+	precise_wait_calibrate(&pw, PRECISE_WAIT_CALIBRATE_LOOPS);
+
+	printf("period  step    wakeup/s  cpu%% nsec/act  step%%     max   real%%     max  lost%%\n");
+	if (one)
+		bench_conf_run(&dev, line[0], wait, &conf, msec);
+	else
+		for (i = 0; i < (int)(sizeof(bench_confs) / sizeof(bench_confs[0])); i++)
+			bench_conf_run(&dev, line[0], wait, &bench_confs[i], msec);
+
+	device_destroy(&dev, 0);
+	gpiod_chip_close(chip);
+	return 0;
+}
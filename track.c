@@ -8,10 +8,13 @@
 #include <errno.h>
 #include <string.h>
 #include "track.h"
+#include "pwm-sysfs.h"
+#include "gpio-out.h"
 
 #define OFF		0
 #define ON		1
 
+
 int min(int x, int y){
 	return x<y?x:y;
 }
@@ -27,13 +30,25 @@ enum track_state{
 
 struct track_manage {
 	struct gpiod_line *pwm, *in1, *in2;
+	struct gpio_out pwm_pin, in1_pin, in2_pin;
 	enum track_state state;
 	int worktime, next_worktime;
+	int pulse;		// usec of the current frame
+	long long dither;	// sigma-delta error, usec*TRACK_PERIOD
+	int pulse_error;
+	struct pwm_sysfs hw;
 };
 
 struct track_prive{
 	struct track_manage right;
 	struct track_manage left;
+	struct timespec frame_start, rise;
+	unsigned latch_cnt;
+	struct timespec latch;	// last frame start that took the requested speed
+	int accel_pct, decel_pct;
+	int accel, decel;	// usec of duty per frame, 0 is no limit
+	int period, resolution;	// usec of the PWM frame and of its pulse step
+	int dither;		// spread the pulse step remainder over the frames
 };
 
 int track_start_request (struct device *dev) {
@@ -45,18 +60,100 @@ int track_start_request (struct device *dev) {
 	return 0;
 }
 
+// % of the full duty per second to usec of duty per frame, a limit never rounds to none
+int track_ramp_limit (int pct, int period) {
+	int step = (long long)pct*(TRACK_PERIOD/100)*period/1000000;
+
+	return (pct > 0 && step == 0) ? 1 : step;
+}
+
+// one period of the ramp from cur to target
+int track_ramp_step (int cur, int target, int up, int down) {
+	int goal;
+
+	// shrinking, a reverse goes through zero
+	if ((cur > 0 && target < cur) || (cur < 0 && target > cur)) {
+		goal = ((cur > 0) == (target > 0)) ? target : 0;
+		if (down == 0 || abs(cur - goal) <= down) return goal;
+		cur += cur > 0 ? -down : down;
+		if (goal == 0 && abs(cur) < TRACK_MINTIME) cur = 0;
+		return cur;
+	};
+
+	// growing, nothing moves below the minimal duty
+	if (cur == 0 && abs(target) > TRACK_MINTIME) cur = target > 0 ? TRACK_MINTIME : -TRACK_MINTIME;
+	if (up == 0 || abs(target - cur) <= up) return target;
+	return cur + (target > cur ? up : -up);
+}
+
+void track_ramp (struct track_prive *priv) {
+	priv->right.worktime = track_ramp_step(priv->right.worktime, priv->right.next_worktime, priv->accel, priv->decel);
+	priv->left.worktime = track_ramp_step(priv->left.worktime, priv->left.next_worktime, priv->accel, priv->decel);
+}
+
 void track_control (struct track_manage *track, enum track_state state) {
-	gpiod_line_set_value (track->in1, track->worktime < 0 ? state : OFF);
-	gpiod_line_set_value (track->in2, track->worktime > 0 ? state : OFF);
-	gpiod_line_set_value (track->pwm, track->worktime != 0 ? state : OFF);
+	struct gpio_out_batch batch;
+
+	// lines of the same bank go out with a single store on the mmio backend
+	gpio_out_batch_init (&batch);
+	gpio_out_batch_set (&batch, &track->in1_pin, track->worktime < 0 ? state : OFF);
+	gpio_out_batch_set (&batch, &track->in2_pin, track->worktime > 0 ? state : OFF);
+	gpio_out_batch_set (&batch, &track->pwm_pin, track->worktime != 0 ? state : OFF);
+	gpio_out_batch_commit (&batch);
 	track->state=state;
 };
 
+/*
+ * Pulse of the frame for the duty, in resolution steps of the device
+ * period. Without dithering the duty is rounded to the nearest step,
+ * with dithering the rounding error is carried to the next frames, so
+ * the mean pulse is exact.
+ */
+void track_pulse (struct track_prive *priv, struct track_manage *track) {
+	long long want = (long long)abs(track->worktime)*priv->period;
+	long long step = (long long)priv->resolution*TRACK_PERIOD;
+	long long n;
+
+	if (want == 0) {
+		track->dither = 0;
+		track->pulse = 0;
+		return;
+	};
+	if (!priv->dither) {
+		track->pulse = (want + step/2)/step*priv->resolution;
+		return;
+	};
+	track->dither += want;
+	n = track->dither/step;
+	track->dither -= n*step;
+	track->pulse = n*priv->resolution;
+}
+
+// switches the track off if its pulse is over, returns time before the falling edge otherwise
+int track_pulse_end (struct track_prive *priv, struct track_manage *track, struct timespec *ts) {
+	struct timespec fall;
+	int time = track->pulse;
+	int left = time - device_timespec_diff(ts, &priv->rise);
+
+	if (track->state==TRACK_OFF) return 0;
+	if (left > 0) return left;
+
+	track_control(track, TRACK_OFF);
+	device_timestamp(&fall);
+	track->pulse_error = device_timespec_diff(&fall, &priv->rise) - time;
+	return 0;
+}
+
+// next frame on the shared frame grid, a lost frame is skipped
+void track_next_frame (struct device *dev, struct track_prive *priv, struct timespec *ts) {
+	device_frame_next(&priv->frame_start, ts, priv->period);
+	dev->next_action=priv->frame_start;
+}
+
 void track_timer_action (struct device *dev, struct timespec *ts) {
 	struct track_prive *priv = (struct track_prive *) dev->priv;
-	int delay;
-	int time_r = abs(priv->right.worktime);
-	int time_l = abs(priv->left.worktime);
+	int delay, left_r, left_l;
+	int time_r, time_l;
 
 	if (dev->state==DEV_STATE_STOPPED) return;
 
@@ -65,61 +162,103 @@ void track_timer_action (struct device *dev, struct timespec *ts) {
 		return;
 	} ;
 
-	if (dev->state==DEV_STATE_STARTING) dev->state=DEV_STATE_STARTED;
+	if (dev->state==DEV_STATE_STARTING) {
+		dev->state=DEV_STATE_STARTED;
+		priv->frame_start=*ts;
+	};
 
 	if (priv->right.state==TRACK_OFF && priv->left.state==TRACK_OFF){
-		if (priv->right.worktime != priv->right.next_worktime) {
-			priv->right.worktime = priv->right.next_worktime;
-			time_r = abs(priv->right.worktime);
-		};
-		if (priv->left.worktime != priv->left.next_worktime) {
-			priv->left.worktime = priv->left.next_worktime;
-			time_l = abs(priv->left.worktime);
+		track_ramp(priv);
+		if(priv->right.worktime==0 && priv->left.worktime==0){
+			priv->right.dither=0;
+			priv->left.dither=0;
+			priv->latch=*ts;
+			priv->latch_cnt++;
+			if(priv->right.next_worktime==0 && priv->left.next_worktime==0){
+				dev->state=DEV_STATE_STOPPED;
+				return;
+			};
+			// a reverse passes through zero, the ramp goes on out of it next frame
+			track_next_frame(dev, priv, ts);
+			return;
 		};
+		track_pulse(priv, &priv->right);
+		track_pulse(priv, &priv->left);
+		time_r = priv->right.pulse;
+		time_l = priv->left.pulse;
 		if(time_r==0 && time_l==0){
-			dev->state=DEV_STATE_STOPPED;
+			// dithered down to no pulse in this frame
+			priv->latch=*ts;
+			priv->latch_cnt++;
+			track_next_frame(dev, priv, ts);
 			return;
 		};
 
 		if(time_r!=0) track_control(&priv->right, TRACK_ON);
 		if(time_l!=0) track_control(&priv->left, TRACK_ON);
+		// falling edges are scheduled from the real rising edge, not from a late wakeup
+		device_timestamp(&priv->rise);
+		priv->latch=priv->rise;
+		priv->latch_cnt++;
 		delay=min(time_r, time_l);
 		if(delay==0) delay=max(time_r, time_l);
-		device_timespec_update(&dev->next_action, ts, delay);
-		return;
-	};
-
-	if (priv->right.state==TRACK_ON && priv->left.state==TRACK_ON){
-		delay=min(time_r, time_l);
-		if (time_r==delay) track_control(&priv->right, TRACK_OFF);
-		if (time_l==delay) track_control(&priv->left, TRACK_OFF);
-		delay=(time_r==time_l) ? TRACK_PERIOD-delay:abs(time_r-time_l);
-		device_timespec_update(&dev->next_action, ts, delay);
+		device_timespec_update(&dev->next_action, &priv->rise, delay);
 		return;
 	};
 
-	if (priv->right.state==TRACK_ON && priv->left.state==TRACK_OFF){
-		track_control(&priv->right, TRACK_OFF);
-		delay=TRACK_PERIOD-time_r;
+	left_r = track_pulse_end(priv, &priv->right, ts);
+	left_l = track_pulse_end(priv, &priv->left, ts);
+	if (left_r != 0 || left_l != 0) {
+		delay = (left_r == 0 || left_l == 0) ? max(left_r, left_l) : min(left_r, left_l);
 		device_timespec_update(&dev->next_action, ts, delay);
 		return;
 	};
 
-	if (priv->right.state==TRACK_OFF && priv->left.state==TRACK_ON){
-		track_control(&priv->left, TRACK_OFF);
-		delay=TRACK_PERIOD-time_l;
-		device_timespec_update(&dev->next_action, ts, delay);
-		return;
-	};
+	track_next_frame(dev, priv, ts);
 }
 
 void track_destroy_priv (struct device *dev) {
 	struct track_prive *priv = (struct track_prive *) dev->priv;
 	track_control(&priv->right, TRACK_OFF);
 	track_control(&priv->left, TRACK_OFF);
+	pwm_sysfs_close(&priv->right.hw);
+	pwm_sysfs_close(&priv->left.hw);
 	free(priv);
 }
 
+void track_hw_control (struct track_prive *priv, struct track_manage *track) {
+	gpio_out_set (&track->in1_pin, track->worktime < 0 ? ON : OFF);
+	gpio_out_set (&track->in2_pin, track->worktime > 0 ? ON : OFF);
+	pwm_sysfs_set_duty (&track->hw, (long long)abs(track->worktime)*priv->period/TRACK_PERIOD);
+}
+
+// hardware PWM generates the pulses itself, the device only wakes up while the ramp goes
+int track_hw_start_request (struct device *dev) {
+	if (dev->state==DEV_STATE_STOPPED) dev->state=DEV_STATE_STARTING;
+	return 0;
+}
+
+void track_hw_timer_action (struct device *dev, struct timespec *ts) {
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	if (dev->state==DEV_STATE_STOPPED) return;
+	if (dev->state==DEV_STATE_STARTING) dev->state=DEV_STATE_STARTED;
+
+	// duty cycle writes only, no CPU is spent between the edges
+	track_ramp(priv);
+	track_hw_control(priv, &priv->right);
+	track_hw_control(priv, &priv->left);
+	priv->latch=*ts;
+	priv->latch_cnt++;
+
+	if ((dev->state==DEV_STATE_STOPPING) ||
+	    (priv->right.worktime==priv->right.next_worktime && priv->left.worktime==priv->left.next_worktime)) {
+		dev->state=DEV_STATE_STOPPED;
+		return;
+	};
+	device_timespec_update(&dev->next_action, ts, priv->period);
+}
+
 struct device_ops track_ops={
 	.start_request=track_start_request,
 	.stop_request=device_stop_request,
@@ -127,6 +266,13 @@ struct device_ops track_ops={
 	.destroy_priv=track_destroy_priv
 };
 
+struct device_ops track_hw_ops={
+	.start_request=track_hw_start_request,
+	.stop_request=device_stop_request,
+	.timer_action=track_hw_timer_action,
+	.destroy_priv=track_destroy_priv
+};
+
 
 int track_init (struct device *dev,
 				struct gpiod_line *pwmb, struct gpiod_line *bin1, struct gpiod_line *bin2,
@@ -140,12 +286,20 @@ int track_init (struct device *dev,
 
 	memset (priv, 0, sizeof(struct track_prive));
 	
+	priv->period = TRACK_PERIOD;
+	priv->resolution = 1;
+	priv->accel_pct = TRACK_ACCEL;
+	priv->decel_pct = TRACK_DECEL;
+	priv->accel = track_ramp_limit(TRACK_ACCEL, TRACK_PERIOD);
+	priv->decel = track_ramp_limit(TRACK_DECEL, TRACK_PERIOD);
 	priv->right.pwm = pwmb;
 	priv->right.in1 = bin1;
 	priv->right.in2 = bin2;
 	priv->left.pwm = pwma;
 	priv->left.in1 = ain1;
 	priv->left.in2 = ain2;
+	pwm_sysfs_init(&priv->right.hw);
+	pwm_sysfs_init(&priv->left.hw);
 
 	gpiod_line_request_output (priv->right.pwm, "track_gpiod", OFF);
 	gpiod_line_request_output (priv->right.in1, "track_gpiod", OFF);
@@ -155,6 +309,13 @@ int track_init (struct device *dev,
 	gpiod_line_request_output (priv->left.in1, "track_gpiod", OFF);
 	gpiod_line_request_output (priv->left.in2, "track_gpiod", OFF);
 
+	gpio_out_init (&priv->right.pwm_pin, priv->right.pwm);
+	gpio_out_init (&priv->right.in1_pin, priv->right.in1);
+	gpio_out_init (&priv->right.in2_pin, priv->right.in2);
+	gpio_out_init (&priv->left.pwm_pin, priv->left.pwm);
+	gpio_out_init (&priv->left.in1_pin, priv->left.in1);
+	gpio_out_init (&priv->left.in2_pin, priv->left.in2);
+
 	ret = device_initialize (dev, "track", &track_ops, priv);
 	if (ret != 0) {
 		free (priv);
@@ -169,6 +330,124 @@ void track_set_speed(struct device *dev, int workload_right, int workload_left)
 
 	priv->right.next_worktime=workload_right;
 	priv->left.next_worktime=workload_left;
+
+	if (dev->ops == &track_hw_ops) track_hw_start_request(dev);
+}
+
+int track_deadband (int duty) {
+	if (duty > 0) return duty + TRACK_MINTIME;
+	if (duty < 0) return duty - TRACK_MINTIME;
+	return 0;
+}
+
+void track_set_drive(struct device *dev, int throttle, int turn)
+{
+	int span = TRACK_PERIOD - TRACK_MINTIME;
+	int r = throttle + turn, l = throttle - turn;
+	int peak = max(abs(r), abs(l));
+
+	// out of range, the ratio of the tracks is kept
+	if (peak > span) {
+		r = (long long)r * span / peak;
+		l = (long long)l * span / peak;
+	};
+	track_set_speed(dev, track_deadband(r), track_deadband(l));
+}
+
+void track_emergency_stop(struct device *dev)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	priv->right.next_worktime=0;
+	priv->left.next_worktime=0;
+	priv->right.worktime=0;
+	priv->left.worktime=0;
+
+	if (dev->ops == &track_hw_ops) {
+		track_hw_control(priv, &priv->right);
+		track_hw_control(priv, &priv->left);
+		device_timestamp(&priv->latch);
+		priv->latch_cnt++;
+		return;
+	};
+	// the frame goes on without its pulses and the track stops at its end
+	if (priv->right.state==TRACK_ON) track_control(&priv->right, TRACK_OFF);
+	if (priv->left.state==TRACK_ON) track_control(&priv->left, TRACK_OFF);
+}
+
+void track_set_ramp(struct device *dev, int accel, int decel)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	priv->accel_pct = accel;
+	priv->decel_pct = decel;
+	priv->accel = track_ramp_limit(accel, priv->period);
+	priv->decel = track_ramp_limit(decel, priv->period);
+}
+
+int track_set_pwm(struct device *dev, int period, int resolution, int dither)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	// the hardware channels were opened with the period already
+	if (dev->ops == &track_hw_ops) return -EBUSY;
+	if (period < TRACK_PERIOD_MIN || period > TRACK_PERIOD || resolution <= 0 || resolution > period/2)
+		return -EINVAL;
+
+	priv->period = period;
+	priv->resolution = resolution;
+	priv->dither = dither;
+	priv->right.dither = 0;
+	priv->left.dither = 0;
+	track_set_ramp(dev, priv->accel_pct, priv->decel_pct);
+	return 0;
+}
+
+int track_get_period(struct device *dev)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	return priv->period;
+}
+
+int track_use_hw_pwm (struct device *dev, const char *root,
+		      int chip_r, int channel_r, int chip_l, int channel_l)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+	int ret;
+
+	ret = pwm_sysfs_open(&priv->right.hw, root, chip_r, channel_r, priv->period);
+	if (ret != 0) return ret;
+
+	ret = pwm_sysfs_open(&priv->left.hw, root, chip_l, channel_l, priv->period);
+	if (ret != 0) {
+		pwm_sysfs_close(&priv->right.hw);
+		return ret;
+	};
+
+	// stop the software pulses, the pins are muxed to the pwm controller now
+	track_control(&priv->right, TRACK_OFF);
+	track_control(&priv->left, TRACK_OFF);
+	dev->state=DEV_STATE_STOPPED;
+	gpiod_line_release(priv->right.pwm);
+	gpiod_line_release(priv->left.pwm);
+	priv->right.pwm = NULL;
+	priv->left.pwm = NULL;
+	gpio_out_init(&priv->right.pwm_pin, NULL);
+	gpio_out_init(&priv->left.pwm_pin, NULL);
+
+	dev->ops = &track_hw_ops;
+	track_hw_control(priv, &priv->right);
+	track_hw_control(priv, &priv->left);
+	track_set_speed(dev, priv->right.next_worktime, priv->left.next_worktime);
+	return 0;
+}
+
+unsigned track_latch_count (struct device *dev, struct timespec *ts)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+	if (ts != NULL) *ts = priv->latch;
+	return priv->latch_cnt;
 }
 
 int track_get_speed_right (struct device *dev)
@@ -183,3 +462,29 @@ int track_get_speed_left (struct device *dev)
 
 	return priv->left.next_worktime;
 }
+
+int track_get_duty_right (struct device *dev)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	return priv->right.worktime;
+}
+int track_get_duty_left (struct device *dev)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	return priv->left.worktime;
+}
+
+int track_get_pulse_error_right (struct device *dev)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	return priv->right.pulse_error;
+}
+int track_get_pulse_error_left (struct device *dev)
+{
+	struct track_prive *priv = (struct track_prive *) dev->priv;
+
+	return priv->left.pulse_error;
+}
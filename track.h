@@ -11,17 +11,61 @@
 #include "device.h"
 #include <gpiod.h>
 
+// duties are usec of TRACK_PERIOD whatever PWM frequency the device runs at
 #define TRACK_PERIOD		20000
 #define TRACK_MINTIME		2000
 #define TRACK_DELTA			1000
+#define TRACK_PERIOD_MIN	200		// usec, 5 kHz, software PWM edges get too dense above
+#define TRACK_ACCEL			500		// % of the full duty per second
+#define TRACK_DECEL			1000
 
+// requested duty, the ramp is on its way to it
 int track_get_speed_right (struct device *dev);
 int track_get_speed_left (struct device *dev);
 
+// duty of the current frame
+int track_get_duty_right (struct device *dev);
+int track_get_duty_left (struct device *dev);
+
+// difference between measured and requested pulse width of the last frame (usec)
+int track_get_pulse_error_right (struct device *dev);
+int track_get_pulse_error_left (struct device *dev);
+
+/*
+ * The duty follows the requested one every period, growing by at most
+ * accel and shrinking by at most decel, a reverse spins down to zero
+ * first. The motor does not turn below TRACK_MINTIME, the ramp starts
+ * right there.
+ */
 void track_set_speed(struct device *dev, int workload_right, int workload_left);
 
+// differential drive: throttle and turn in usec of duty above TRACK_MINTIME, positive turn speeds the right track up
+void track_set_drive(struct device *dev, int throttle, int turn);
+
+// both tracks off right now, the running pulses are cut, no ramp
+void track_emergency_stop(struct device *dev);
+
+// % of the full duty per second, 0 is no limit
+void track_set_ramp(struct device *dev, int accel, int decel);
+
+/*
+ * PWM frame period and pulse step in usec, so there are period/resolution
+ * speed levels. A coarse step costs less wakeup precision, with dither set
+ * the remainder is spread over the next frames by a sigma-delta modulator,
+ * so the mean duty is still exact. Set before track_use_hw_pwm().
+ */
+int track_set_pwm(struct device *dev, int period, int resolution, int dither);
+int track_get_period(struct device *dev);
+
+// frames started with the requested speed so far, ts gets the start of the last one
+unsigned track_latch_count (struct device *dev, struct timespec *ts);
+
 int track_init (struct device *dev,
 				struct gpiod_line *pwmb, struct gpiod_line *bin1, struct gpiod_line *bin2,
 				struct gpiod_line *pwma, struct gpiod_line *ain1, struct gpiod_line *ain2);
 
+// switches the track to pwmchip sysfs channels, software PWM is kept on error
+int track_use_hw_pwm (struct device *dev, const char *root,
+				int chip_r, int channel_r, int chip_l, int channel_l);
+
 #endif